@@ -0,0 +1,585 @@
+/* This block store module mirrors the underlying block store but contains
+ * a write-through cache.  The caching strategy is ARC (Adaptive Replacement
+ * Cache, Megiddo and Modha, FAST 2003), which resists being flushed by
+ * sequential scans.  The interface is as follows:
+ *
+ *		block_if arcdisk_init(block_if below,
+ *									block_t *blocks, block_no nblocks)
+ *			'below' is the underlying block store.  'blocks' points to
+ *			a chunk of memory wth 'nblocks' blocks for caching.
+ *
+ *		void arcdisk_dump_stats(block_if bi)
+ *			Prints the cache statistics, including how the target size
+ *			of the recency list changed over time.
+ *
+ * ARC keeps four LRU lists.  T1 holds cached blocks that were used once
+ * recently, and T2 cached blocks that were used at least twice.  B1 and B2
+ * are "ghost" lists that only remember the block numbers of blocks recently
+ * evicted from T1 and T2 respectively, and take no memory for data.  A miss
+ * on a block in B1 suggests T1 should be larger, and a miss on a block in
+ * B2 that T2 should be larger.  ARC adapts the target size 'p' of T1
+ * accordingly, and evicts from T1 if it is larger than p and from T2
+ * otherwise.  A scan only passes through T1 and so does not evict the
+ * frequently used blocks in T2.
+ *
+ * The lists are doubly-linked through an array of 2 * nblocks nodes, and a
+ * hash index (see blockmap.h) maps block numbers to nodes on any list.
+ *
+ * Blocks may be pinned in the cache, giving the client read-only access
+ * to the cache entry itself.  A pinned entry is not evicted until it has
+ * been unpinned as many times as it was pinned.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "block_if.h"
+#include "blockmap.h"
+
+#define ARC_NSAMPLES	32		// #samples of p kept for the stats
+#define ARC_INTERVAL	64		// initial #accesses between samples
+
+enum arc_list { ARC_T1, ARC_T2, ARC_B1, ARC_B2, ARC_NLISTS };
+
+struct arc_node {
+	block_no offset;			// block number
+	enum arc_list list;			// list the node is on
+	unsigned int slot;			// cache entry if on T1 or T2
+	unsigned int prev, next;	// neighbors towards MRU and LRU end
+};
+
+/* State contains the pointer to the block module below as well as caching
+ * information and caching statistics.
+ */
+struct arcdisk_state {
+	block_if below;				// block store below
+	block_t *blocks;			// memory for caching blocks
+	block_no nblocks;			// size of cache (not size of block store!)
+	unsigned int *pins;			// #outstanding pins per cache entry
+
+	/* Nodes 0 .. 2 * nblocks - 1 are for blocks, and the next ARC_NLISTS
+	 * are the heads of the lists.  Unused nodes and cache entries are
+	 * kept on stacks.
+	 */
+	struct arc_node *nodes;
+	unsigned int len[ARC_NLISTS];	// #nodes on each list
+	unsigned int *free_nodes, nfree_nodes;
+	unsigned int *free_slots, nfree_slots;
+	struct blockmap map;		// block number to node
+	unsigned int p;				// target size of T1
+
+	/* Stats.
+	 */
+	unsigned int read_hit, read_miss, write_hit, write_miss;
+	unsigned int ghost_hit[2];	// #misses on B1 and B2
+	unsigned int p_max;			// largest p so far
+	unsigned int naccess;		// #accesses so far
+	unsigned int interval;		// #accesses between samples of p
+	unsigned int nsamples;
+	unsigned int samples[ARC_NSAMPLES];
+};
+
+static unsigned int arc_head(struct arcdisk_state *as, enum arc_list list){
+	return 2 * as->nblocks + list;
+}
+
+static void arc_unlink(struct arcdisk_state *as, unsigned int n){
+	struct arc_node *nodes = as->nodes;
+
+	nodes[nodes[n].prev].next = nodes[n].next;
+	nodes[nodes[n].next].prev = nodes[n].prev;
+	as->len[nodes[n].list]--;
+}
+
+/* Put node n at the MRU end of the given list.
+ */
+static void arc_push(struct arcdisk_state *as, unsigned int n, enum arc_list list){
+	struct arc_node *nodes = as->nodes;
+	unsigned int h = arc_head(as, list);
+
+	nodes[n].list = list;
+	nodes[n].prev = h;
+	nodes[n].next = nodes[h].next;
+	nodes[nodes[h].next].prev = n;
+	nodes[h].next = n;
+	as->len[list]++;
+}
+
+/* Return the least recently used node on the list that can be evicted,
+ * i.e., is not pinned, or -1 if there is none.
+ */
+static int arc_victim(struct arcdisk_state *as, enum arc_list list){
+	unsigned int h = arc_head(as, list), n;
+
+	for (n = as->nodes[h].prev; n != h; n = as->nodes[n].prev) {
+		if (list >= ARC_B1 || as->pins[as->nodes[n].slot] == 0) {
+			return n;
+		}
+	}
+	return -1;
+}
+
+/* Forget about the block in node n altogether.
+ */
+static void arc_forget(struct arcdisk_state *as, unsigned int n){
+	if (as->nodes[n].list < ARC_B1) {
+		as->free_slots[as->nfree_slots++] = as->nodes[n].slot;
+	}
+	arc_unlink(as, n);
+	blockmap_remove(&as->map, as->nodes[n].offset);
+	as->free_nodes[as->nfree_nodes++] = n;
+}
+
+/* Evict the cached block in node n, keeping it on the ghost list.
+ */
+static void arc_demote(struct arcdisk_state *as, unsigned int n){
+	enum arc_list ghost = as->nodes[n].list == ARC_T1 ? ARC_B1 : ARC_B2;
+
+	as->free_slots[as->nfree_slots++] = as->nodes[n].slot;
+	arc_unlink(as, n);
+	arc_push(as, n, ghost);
+}
+
+/* Free up a cache entry by evicting a block from T1 if T1 exceeds its
+ * target size, and from T2 otherwise.  'b2' says whether the block being
+ * cached was on B2.  Returns 0, or -1 if all cache entries are pinned.
+ */
+static int arc_replace(struct arcdisk_state *as, int b2){
+	int n = -1;
+
+	if (as->len[ARC_T1] > 0 && (as->len[ARC_T1] > as->p || (b2 && as->len[ARC_T1] == as->p))) {
+		n = arc_victim(as, ARC_T1);
+	}
+	if (n < 0) {
+		n = arc_victim(as, ARC_T2);
+	}
+	if (n < 0) {
+		n = arc_victim(as, ARC_T1);
+	}
+	if (n < 0) {
+		return -1;
+	}
+	arc_demote(as, n);
+	return 0;
+}
+
+/* Make sure there is a free cache entry.
+ */
+static int arc_slot(struct arcdisk_state *as, int b2){
+	return as->nfree_slots > 0 ? 0 : arc_replace(as, b2);
+}
+
+/* Make sure there is a free node, dropping the oldest ghost if needed.
+ */
+static int arc_node(struct arcdisk_state *as){
+	int n;
+
+	if (as->nfree_nodes > 0) {
+		return 0;
+	}
+	if ((n = arc_victim(as, ARC_B1)) < 0 && (n = arc_victim(as, ARC_B2)) < 0) {
+		return -1;
+	}
+	arc_forget(as, n);
+	return 0;
+}
+
+static void arc_sample(struct arcdisk_state *as){
+	unsigned int i;
+
+	if (as->p > as->p_max) {
+		as->p_max = as->p;
+	}
+	if (++as->naccess % as->interval != 0) {
+		return;
+	}
+
+	/* Once all samples are used, keep every other one and sample half as
+	 * often, so the samples always cover the whole run.
+	 */
+	if (as->nsamples == ARC_NSAMPLES) {
+		for (i = 0; i < ARC_NSAMPLES / 2; i++) {
+			as->samples[i] = as->samples[2 * i + 1];
+		}
+		as->nsamples = ARC_NSAMPLES / 2;
+		as->interval *= 2;
+		if (as->naccess % as->interval != 0) {
+			return;
+		}
+	}
+	as->samples[as->nsamples++] = as->p;
+}
+
+/* Return the index of the cache entry that holds the given block, or -1
+ * if the block is not in the cache.  On a hit the block moves to T2.
+ */
+static int cache_lookup(struct arcdisk_state *as, block_no offset){
+	int n = blockmap_lookup(&as->map, offset);
+
+	if (n < 0 || as->nodes[n].list >= ARC_B1) {
+		return -1;
+	}
+	arc_unlink(as, n);
+	arc_push(as, n, ARC_T2);
+	arc_sample(as);
+	return as->nodes[n].slot;
+}
+
+/* Check whether a block is in the cache without counting it as a use.
+ */
+static int cache_present(struct arcdisk_state *as, block_no offset){
+	int n = blockmap_lookup(&as->map, offset);
+
+	return n >= 0 && as->nodes[n].list < ARC_B1;
+}
+
+/* The given block is not in the cache but is about to be placed there.
+ * Returns the cache entry to use, or -1 if all entries are pinned.  The
+ * caller fills in the entry, or invokes cache_drop if that fails.
+ */
+static int cache_alloc(struct arcdisk_state *as, block_no offset){
+	unsigned int c = as->nblocks, delta;
+	int n = blockmap_lookup(&as->map, offset), victim;
+
+	if (n >= 0) {
+		/* A ghost hit.  Adapt p and move the block to T2.
+		 */
+		int b2 = as->nodes[n].list == ARC_B2;
+		unsigned int b1len = as->len[ARC_B1], b2len = as->len[ARC_B2];
+		if (!b2) {
+			delta = b1len >= b2len ? 1 : b2len / b1len;
+			as->p = as->p + delta < c ? as->p + delta : c;
+		}
+		else {
+			delta = b2len >= b1len ? 1 : b1len / b2len;
+			as->p = as->p > delta ? as->p - delta : 0;
+		}
+		as->ghost_hit[b2]++;
+		if (arc_slot(as, b2) < 0) {
+			return -1;
+		}
+		arc_unlink(as, n);
+		arc_push(as, n, ARC_T2);
+	}
+	else {
+		/* A new block.  Keep T1 + B1 at most c, and all lists together at
+		 * most 2c, then put the block on T1.
+		 */
+		unsigned int l1 = as->len[ARC_T1] + as->len[ARC_B1];
+		unsigned int total = l1 + as->len[ARC_T2] + as->len[ARC_B2];
+		if (l1 >= c) {
+			if (as->len[ARC_T1] < c) {
+				arc_forget(as, arc_victim(as, ARC_B1));
+			}
+			else if ((victim = arc_victim(as, ARC_T1)) >= 0) {
+				arc_forget(as, victim);
+			}
+		}
+		else if (total >= 2 * c && as->len[ARC_B2] > 0) {
+			arc_forget(as, arc_victim(as, ARC_B2));
+		}
+		if (arc_slot(as, 0) < 0 || arc_node(as) < 0) {
+			return -1;
+		}
+		n = as->free_nodes[--as->nfree_nodes];
+		as->nodes[n].offset = offset;
+		blockmap_insert(&as->map, offset, n);
+		arc_push(as, n, ARC_T1);
+	}
+	as->nodes[n].slot = as->free_slots[--as->nfree_slots];
+	arc_sample(as);
+	return as->nodes[n].slot;
+}
+
+/* Undo cache_alloc for a block that could not be read.
+ */
+static void cache_drop(struct arcdisk_state *as, block_no offset){
+	int n = blockmap_lookup(&as->map, offset);
+
+	if (n >= 0) {
+		arc_forget(as, n);
+	}
+}
+
+/* The given block was just used but it's not in the cache.  Stick it in
+ * the cache, if possible.
+ */
+static void cache_update(struct arcdisk_state *as, block_no offset, block_t *block){
+	int i = cache_alloc(as, offset);
+
+	if (i >= 0) {
+		memcpy(&as->blocks[i], block, BLOCK_SIZE);
+	}
+}
+
+/* Forget about the 'count' blocks starting at offset, including any ghosts.
+ * If there are fewer such blocks than nodes, look each one up in the
+ * index.  Otherwise it is cheaper to go through the nodes.
+ */
+static void cache_invalidate(struct arcdisk_state *as, block_no offset, block_no count){
+	unsigned int l;
+	block_no i;
+	int n;
+
+	if (count < 2 * as->nblocks) {
+		for (i = 0; i < count; i++) {
+			if ((n = blockmap_lookup(&as->map, offset + i)) >= 0) {
+				arc_forget(as, n);
+			}
+		}
+		return;
+	}
+	for (l = 0; l < ARC_NLISTS; l++) {
+		unsigned int h = arc_head(as, l), next;
+		for (i = as->nodes[h].next; i != h; i = next) {
+			next = as->nodes[i].next;
+			if (as->nodes[i].offset >= offset && as->nodes[i].offset - offset < count) {
+				arc_forget(as, i);
+			}
+		}
+	}
+}
+
+static int arcdisk_nblocks(block_if bi){
+	struct arcdisk_state *as = bi->state;
+
+	return (*as->below->nblocks)(as->below);
+}
+
+/* The old size returned by the block store below tells which blocks are
+ * cut off, so they can be dropped from the cache.
+ */
+static int arcdisk_setsize(block_if bi, block_no nblocks){
+	struct arcdisk_state *as = bi->state;
+
+	int before = (*as->below->setsize)(as->below, nblocks);
+	if (before > 0 && (block_no) before > nblocks) {
+		cache_invalidate(as, nblocks, before - nblocks);
+	}
+	return before;
+}
+
+static int arcdisk_read(block_if bi, block_no offset, block_t *block){
+	struct arcdisk_state *as = bi->state;
+
+	/* Check the cache first.
+	 */
+	int i = cache_lookup(as, offset);
+	if (i >= 0) {
+		memcpy(block, &as->blocks[i], BLOCK_SIZE);
+		as->read_hit++;
+		return 0;
+	}
+
+	int r = (*as->below->read)(as->below, offset, block);
+	if (r >= 0) {
+		cache_update(as, offset, block);
+		as->read_miss++;
+	}
+	return r;
+}
+
+static int arcdisk_write(block_if bi, block_no offset, block_t *block){
+	struct arcdisk_state *as = bi->state;
+
+	/* Check the cache first.  Even if it's in the cache, write to the
+	 * block store below because this implements a write-through cache.
+	 */
+	int i = cache_lookup(as, offset);
+	if (i >= 0) {
+		memcpy(&as->blocks[i], block, BLOCK_SIZE);
+		as->write_hit++;
+		return (*as->below->write)(as->below, offset, block);
+	}
+
+	cache_update(as, offset, block);
+	as->write_miss++;
+	return (*as->below->write)(as->below, offset, block);
+}
+
+/* Read a range of blocks.  Blocks that are in the cache are copied from
+ * there, while each run of consecutive misses is read from the block
+ * store below using a single range read.
+ */
+static int arcdisk_readv(block_if bi, block_no offset, block_no count, block_t *blocks){
+	struct arcdisk_state *as = bi->state;
+	block_no i = 0, j;
+	int slot;
+
+	while (i < count) {
+		if ((slot = cache_lookup(as, offset + i)) >= 0) {
+			memcpy(&blocks[i], &as->blocks[slot], BLOCK_SIZE);
+			as->read_hit++;
+			i++;
+			continue;
+		}
+
+		/* Find the end of the run of misses.
+		 */
+		for (j = i + 1; j < count; j++) {
+			if (cache_present(as, offset + j)) {
+				break;
+			}
+		}
+		int r = block_readv(as->below, offset + i, j - i, &blocks[i]);
+		if (r < 0) {
+			return r;
+		}
+		for (; i < j; i++) {
+			cache_update(as, offset + i, &blocks[i]);
+			as->read_miss++;
+		}
+	}
+	return 0;
+}
+
+/* Write a range of blocks.  Update the cache block by block, and then
+ * write the entire range through to the block store below.
+ */
+static int arcdisk_writev(block_if bi, block_no offset, block_no count, block_t *blocks){
+	struct arcdisk_state *as = bi->state;
+	block_no i;
+	int slot;
+
+	for (i = 0; i < count; i++) {
+		if ((slot = cache_lookup(as, offset + i)) >= 0) {
+			memcpy(&as->blocks[slot], &blocks[i], BLOCK_SIZE);
+			as->write_hit++;
+		}
+		else {
+			cache_update(as, offset + i, &blocks[i]);
+			as->write_miss++;
+		}
+	}
+	return block_writev(as->below, offset, count, blocks);
+}
+
+/* Pin the block at the given offset in the cache, reading it into a
+ * cache entry if necessary.
+ */
+static const block_t *arcdisk_pin(block_if bi, block_no offset){
+	struct arcdisk_state *as = bi->state;
+
+	int i = cache_lookup(as, offset);
+	if (i >= 0) {
+		as->pins[i]++;
+		as->read_hit++;
+		return &as->blocks[i];
+	}
+
+	if ((i = cache_alloc(as, offset)) < 0) {
+		return 0;
+	}
+	if ((*as->below->read)(as->below, offset, &as->blocks[i]) < 0) {
+		cache_drop(as, offset);
+		return 0;
+	}
+	as->pins[i]++;
+	as->read_miss++;
+	return &as->blocks[i];
+}
+
+static void arcdisk_unpin(block_if bi, const block_t *block){
+	struct arcdisk_state *as = bi->state;
+
+	as->pins[block - as->blocks]--;
+}
+
+/* Drop any cached copies of the discarded blocks, making room for other
+ * blocks, and pass the discard on to the block store below.
+ */
+static int arcdisk_discard(block_if bi, block_no offset, block_no count){
+	struct arcdisk_state *as = bi->state;
+
+	cache_invalidate(as, offset, count);
+	return block_discard(as->below, offset, count);
+}
+
+/* The cache is write-through, so there is nothing to write back.
+ */
+static int arcdisk_flush(block_if bi){
+	struct arcdisk_state *as = bi->state;
+
+	return block_flush(as->below);
+}
+
+static void arcdisk_destroy(block_if bi){
+	struct arcdisk_state *as = bi->state;
+
+	blockmap_free(&as->map);
+	free(as->pins);
+	free(as->nodes);
+	free(as->free_nodes);
+	free(as->free_slots);
+	free(as);
+	free(bi);
+}
+
+void arcdisk_dump_stats(block_if bi){
+	struct arcdisk_state *as = bi->state;
+	unsigned int i;
+
+	printf("!$ARC: #read hits:    %u\n", as->read_hit);
+	printf("!$ARC: #read misses:  %u\n", as->read_miss);
+	printf("!$ARC: #write hits:   %u\n", as->write_hit);
+	printf("!$ARC: #write misses: %u\n", as->write_miss);
+	printf("!$ARC: #B1 hits:      %u\n", as->ghost_hit[0]);
+	printf("!$ARC: #B2 hits:      %u\n", as->ghost_hit[1]);
+	printf("!$ARC: T1 target p:   %u (max %u, cache %u)\n",
+							as->p, as->p_max, as->nblocks);
+	printf("!$ARC: T1/T2/B1/B2:   %u/%u/%u/%u\n", as->len[ARC_T1],
+					as->len[ARC_T2], as->len[ARC_B1], as->len[ARC_B2]);
+	printf("!$ARC: p every %u accesses:", as->interval);
+	for (i = 0; i < as->nsamples; i++) {
+		printf(" %u", as->samples[i]);
+	}
+	printf("\n");
+}
+
+/* Create a new block store module on top of the specified module below.
+ * blocks points to a chunk of memory of nblocks blocks that can be used
+ * for caching.
+ */
+block_if arcdisk_init(block_if below, block_t *blocks, block_no nblocks){
+	unsigned int i;
+
+	/* Create the block store state structure.
+	 */
+	struct arcdisk_state *as = calloc(1, sizeof(*as));
+	as->below = below;
+	as->blocks = blocks;
+	as->nblocks = nblocks;
+	as->pins = calloc(nblocks, sizeof(*as->pins));
+	as->nodes = calloc(2 * nblocks + ARC_NLISTS, sizeof(*as->nodes));
+	for (i = 0; i < ARC_NLISTS; i++) {
+		unsigned int h = arc_head(as, i);
+		as->nodes[h].prev = as->nodes[h].next = h;
+	}
+	as->free_nodes = calloc(2 * nblocks, sizeof(*as->free_nodes));
+	for (i = 0; i < 2 * nblocks; i++) {
+		as->free_nodes[as->nfree_nodes++] = 2 * nblocks - 1 - i;
+	}
+	as->free_slots = calloc(nblocks, sizeof(*as->free_slots));
+	for (i = 0; i < nblocks; i++) {
+		as->free_slots[as->nfree_slots++] = nblocks - 1 - i;
+	}
+	blockmap_init(&as->map, 2 * nblocks);
+	as->interval = ARC_INTERVAL;
+
+	/* Return a block interface to this inode.
+	 */
+	block_if bi = calloc(1, sizeof(*bi));
+	bi->state = as;
+	bi->nblocks = arcdisk_nblocks;
+	bi->setsize = arcdisk_setsize;
+	bi->read = arcdisk_read;
+	bi->write = arcdisk_write;
+	bi->destroy = arcdisk_destroy;
+	bi->flush = arcdisk_flush;
+	bi->readv = arcdisk_readv;
+	bi->writev = arcdisk_writev;
+	bi->pin = arcdisk_pin;
+	bi->unpin = arcdisk_unpin;
+	bi->discard = arcdisk_discard;
+	return bi;
+}
@@ -9,3 +9,132 @@ void panic(char *s){
 	fprintf(stderr, "!!PANIC: %s\n", s);
 	exit(1);
 }
+
+/* Read 'count' consecutive blocks starting at 'offset'.  Use the readv
+ * method if the block store has one, or else read one block at a time.
+ */
+int block_readv(block_if bi, block_no offset, block_no count, block_t *blocks){
+	block_no i;
+
+	if (bi->readv != 0) {
+		return (*bi->readv)(bi, offset, count, blocks);
+	}
+	for (i = 0; i < count; i++) {
+		if ((*bi->read)(bi, offset + i, &blocks[i]) < 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* Write 'count' consecutive blocks starting at 'offset'.  Use the writev
+ * method if the block store has one, or else write one block at a time.
+ */
+int block_writev(block_if bi, block_no offset, block_no count, block_t *blocks){
+	block_no i;
+
+	if (bi->writev != 0) {
+		return (*bi->writev)(bi, offset, count, blocks);
+	}
+	for (i = 0; i < count; i++) {
+		if ((*bi->write)(bi, offset + i, &blocks[i]) < 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* Submit a batch of asynchronous requests.  If the block store does not
+ * support asynchronous I/O, carry out the requests right away and queue
+ * them for block_reap().
+ */
+int block_submit(block_if bi, struct block_req *reqs, unsigned int nreqs){
+	unsigned int i;
+
+	if (bi->submit != 0) {
+		return (*bi->submit)(bi, reqs, nreqs);
+	}
+	for (i = 0; i < nreqs; i++) {
+		struct block_req *req = &reqs[i];
+		if (req->op == BLOCK_READ) {
+			req->result = (*bi->read)(bi, req->offset, req->block);
+		}
+		else {
+			req->result = (*bi->write)(bi, req->offset, req->block);
+		}
+		req->next = bi->completed;
+		bi->completed = req;
+	}
+	return 0;
+}
+
+/* Collect completed asynchronous requests.  Requests that were carried
+ * out by block_submit() itself have already completed, so there is never
+ * a need to wait for them.
+ */
+int block_reap(block_if bi, struct block_req **done, unsigned int max, unsigned int min){
+	unsigned int n = 0;
+
+	if (bi->reap != 0) {
+		return (*bi->reap)(bi, done, max, min);
+	}
+	while (n < max && bi->completed != 0) {
+		done[n++] = bi->completed;
+		bi->completed = bi->completed->next;
+	}
+	return n;
+}
+
+/* Get read-only access to the block at the given offset without copying
+ * it, if the block store supports that.  Otherwise the block is read
+ * into 'scratch'.  Returns null upon error.
+ */
+const block_t *block_pin(block_if bi, block_no offset, block_t *scratch){
+	const block_t *block;
+
+	if (bi->pin != 0 && (block = (*bi->pin)(bi, offset)) != 0) {
+		return block;
+	}
+	if ((*bi->read)(bi, offset, scratch) < 0) {
+		return 0;
+	}
+	return scratch;
+}
+
+/* Release a block obtained with block_pin().
+ */
+void block_unpin(block_if bi, const block_t *block, block_t *scratch){
+	if (block != scratch && bi->unpin != 0) {
+		(*bi->unpin)(bi, block);
+	}
+}
+
+/* Tell the block store that a range of blocks is no longer in use.  This
+ * is only a hint, so there is nothing to do if the block store does not
+ * support it.
+ */
+int block_discard(block_if bi, block_no offset, block_no count){
+	if (bi->discard != 0) {
+		return (*bi->discard)(bi, offset, count);
+	}
+	return 0;
+}
+
+/* Make sure all writes so far have reached stable storage.  Block stores
+ * without a flush method do not hold on to writes.
+ */
+int block_flush(block_if bi){
+	if (bi->flush != 0) {
+		return (*bi->flush)(bi);
+	}
+	return 0;
+}
+
+/* Tell the block store what kind of block the next request at the given
+ * offset is for.  Block stores that don't care ignore it.
+ */
+void block_hint(block_if bi, block_no offset, enum block_class cls){
+	if (bi->hint != 0) {
+		(*bi->hint)(bi, offset, cls);
+	}
+}
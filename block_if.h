@@ -24,6 +24,61 @@
  * All these return -1 upon error (typically after printing the
  * reason for the error).
  *
+ * In addition, a block store may provide the following optional methods.
+ * Modules that do not implement them leave the pointers null.  Clients
+ * should not invoke them directly but use the block_*() wrappers declared
+ * at the end of this file, which fall back on the basic methods above:
+ *
+ *		int readv(block_if, block_no offset, block_no count, block_t *blocks)
+ *			read the 'count' consecutive blocks starting at offset into
+ *			the array 'blocks'; returns 0
+ *
+ *		int writev(block_if, block_no offset, block_no count, block_t *blocks)
+ *			write the 'count' blocks in the array 'blocks' to the
+ *			consecutive blocks starting at offset; returns 0
+ *
+ *		int submit(block_if, struct block_req *reqs, unsigned int nreqs)
+ *			start the 'nreqs' read and write requests in the array 'reqs'
+ *			without waiting for them to complete; returns 0
+ *
+ *		int reap(block_if, struct block_req **done, unsigned int max,
+ *														unsigned int min)
+ *			wait until at least 'min' submitted requests have completed
+ *			(or all of them, if fewer are outstanding) and store pointers
+ *			to up to 'max' completed requests in 'done'; returns the
+ *			number of requests stored
+ *
+ *		const block_t *pin(block_if, block_no offset)
+ *			return a pointer to the block at offset in the block store's
+ *			own memory, which stays valid until unpin is invoked on it;
+ *			returns null if the block cannot be pinned
+ *
+ *		void unpin(block_if, const block_t *block)
+ *			release a block returned by pin
+ *
+ *		int discard(block_if, block_no offset, block_no count)
+ *			tell the block store that the 'count' blocks starting at
+ *			offset are no longer in use, so their contents are undefined
+ *			until they are written again; returns 0
+ *
+ *		int flush(block_if)
+ *			make sure that all blocks written so far have reached
+ *			stable storage; returns 0
+ *
+ *		void hint(block_if, block_no offset, enum block_class cls)
+ *			tell the block store what kind of block the next request
+ *			for the block at offset is for, so a cache can decide what
+ *			to keep; block stores that pass requests on unchanged pass
+ *			hints on as well
+ *
+ * A submitted request is owned by the block store until it is returned
+ * by reap, at which point its 'result' field holds what read or write
+ * would have returned.  The requests are not necessarily carried out in
+ * the order in which they were submitted.
+ *
+ * A pinned block must not be modified by the client, but it may change
+ * if the block is written while it is pinned.
+ *
  * A 'block_t' is a block of BLOCK_SIZE bytes.  A block store is an array
  * of blocks.  A 'block_no' holds the index of the block in the block store.
  *
@@ -40,6 +95,29 @@ struct block {
 };
 typedef struct block block_t;
 
+/* An asynchronous read or write request.
+ */
+enum block_op { BLOCK_READ, BLOCK_WRITE };
+struct block_req {
+	enum block_op op;			// BLOCK_READ or BLOCK_WRITE
+	block_no offset;			// block to read or write
+	block_t *block;				// data to read into or write from
+	int result;					// 0 or -1, set upon completion
+	void *cookie;				// for use by the submitter
+	struct block_req *next;		// for use by the block store
+};
+
+/* Classes of blocks for hints.  treedisk sets these for its own blocks.
+ */
+enum block_class {
+	BLOCK_DATA,					// client data, or unknown
+	BLOCK_SUPER,				// superblock
+	BLOCK_INODE,				// block of inodes
+	BLOCK_INDIRECT,				// indirect block
+	BLOCK_FREELIST,				// block of the free list
+	BLOCK_NCLASSES
+};
+
 struct block_if {
 	void *state;
 	int (*nblocks)(struct block_if *bi);
@@ -47,6 +125,23 @@ struct block_if {
 	int (*write)(struct block_if *bi, block_no offset, block_t *block);
 	int (*setsize)(struct block_if *bi, block_no size);
 	void (*destroy)(struct block_if *bi);
+
+	/* Optional methods (null if not implemented).
+	 */
+	int (*readv)(struct block_if *bi, block_no offset, block_no count, block_t *blocks);
+	int (*writev)(struct block_if *bi, block_no offset, block_no count, block_t *blocks);
+	int (*submit)(struct block_if *bi, struct block_req *reqs, unsigned int nreqs);
+	int (*reap)(struct block_if *bi, struct block_req **done, unsigned int max, unsigned int min);
+	const block_t *(*pin)(struct block_if *bi, block_no offset);
+	void (*unpin)(struct block_if *bi, const block_t *block);
+	int (*discard)(struct block_if *bi, block_no offset, block_no count);
+	int (*flush)(struct block_if *bi);
+	void (*hint)(struct block_if *bi, block_no offset, enum block_class cls);
+
+	/* Requests completed by block_submit() on behalf of a block store
+	 * that does not implement submit, waiting to be reaped.
+	 */
+	struct block_req *completed;
 };
 
 typedef struct block_if *block_if;
@@ -58,7 +153,12 @@ void panic(char *s);
 /* 'init' functions of various available block store types.
  */
 block_if disk_init(char *file_name, block_no nblocks);
+block_if directdisk_init(char *file_name, block_no nblocks);
+block_if mmapdisk_init(char *file_name, block_no nblocks);
+block_if uringdisk_init(char *file_name, block_no nblocks);
 block_if ramdisk_init(block_t *blocks, block_no nblocks);
+block_if sparsedisk_init(block_no nblocks, int huge);
+block_if compdisk_init(block_no nblocks, size_t budget);
 block_if treedisk_init(block_if below, unsigned int inode_no);
 block_if debugdisk_init(block_if below, char *descr);
 block_if sandboxdisk_init(block_if below);
@@ -66,18 +166,55 @@ block_if partdisk_init(block_if below, block_no delta, block_no nblocks);
 block_if cachedisk_init(block_if below, block_t *blocks, block_no nblocks);
 block_if clockdisk_init(block_if below, block_t *blocks, block_no nblocks);
 block_if LRUdisk_init(block_if below, block_t *blocks, block_no nblocks);
+block_if arcdisk_init(block_if below, block_t *blocks, block_no nblocks);
+block_if s3fifodisk_init(block_if below, block_t *blocks, block_no nblocks);
+block_if twoqdisk_init(block_if below, block_t *blocks, block_no nblocks);
+block_if sharddisk_init(block_if below, block_t *blocks, block_no nblocks, unsigned int nshards);
+block_if mrcdisk_init(block_if below, unsigned int max_samples);
+block_if radisk_init(block_if below, block_t *blocks, block_no nblocks);
+block_if tierdisk_init(block_if below, block_t *blocks, block_no nblocks, block_if tier2);
 block_if statdisk_init(block_if below);
 block_if checkdisk_init(block_if below, char *descr);
 block_if tracedisk_init(block_if below, char *trace, unsigned int n_inodes);
 block_if raid0disk_init(block_if *below, unsigned int nbelow);
 block_if raid1disk_init(block_if *below, unsigned int nbelow);
+block_if dedupdisk_init(block_if below, block_no nblocks);
 
 /* Some useful functions on some block store types.
  */
 int treedisk_create(block_if below, unsigned int n_inodes);
 int treedisk_check(block_if below);
+#define DISK_PREALLOC	((64 << 20) / BLOCK_SIZE)	// 64 MB growth chunk
+int disk_set_prealloc(block_if bi, block_no chunk);
+void disk_dump_stats(block_if bi);
 void clockdisk_dump_stats(block_if bi);
+void clockdisk_set_admission(block_if bi, int on);
+void clockdisk_set_writeback(block_if bi, int on);
+void clockdisk_set_protect(block_if bi, int on);
+int clockdisk_resize(block_if bi, block_t *blocks, block_no nblocks);
 void LRUdisk_dump_stats(block_if bi);
+void arcdisk_dump_stats(block_if bi);
+void s3fifodisk_dump_stats(block_if bi);
+void sharddisk_dump_stats(block_if bi);
+void mrcdisk_dump_stats(block_if bi);
+void radisk_dump_stats(block_if bi);
+void tierdisk_dump_stats(block_if bi);
 void statdisk_dump_stats(block_if bi);
+void sparsedisk_dump_stats(block_if bi);
+void compdisk_dump_stats(block_if bi);
+void dedupdisk_dump_stats(block_if bi);
 int sandboxdisk_ischild(block_if bi);
 void sandboxdisk_rundisk(block_if bi, block_if within);
+
+/* Wrappers for the optional methods.  These invoke the method if the
+ * block store provides it, and otherwise emulate it using the basic ones.
+ */
+int block_readv(block_if bi, block_no offset, block_no count, block_t *blocks);
+int block_writev(block_if bi, block_no offset, block_no count, block_t *blocks);
+int block_submit(block_if bi, struct block_req *reqs, unsigned int nreqs);
+int block_reap(block_if bi, struct block_req **done, unsigned int max, unsigned int min);
+const block_t *block_pin(block_if bi, block_no offset, block_t *scratch);
+void block_unpin(block_if bi, const block_t *block, block_t *scratch);
+int block_discard(block_if bi, block_no offset, block_no count);
+int block_flush(block_if bi);
+void block_hint(block_if bi, block_no offset, enum block_class cls);
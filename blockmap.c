@@ -0,0 +1,100 @@
+/* An open-addressing hash table from block numbers to cache slots.  See
+ * blockmap.h for the interface.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "block_if.h"
+#include "blockmap.h"
+
+/* Fibonacci hashing: multiply by 2^32 / golden ratio and use the top bits,
+ * which spreads consecutive block numbers over the table.
+ */
+static unsigned int blockmap_hash(struct blockmap *bm, block_no offset){
+	return (unsigned int) (offset * 2654435769u) >> (32 - bm->bits);
+}
+
+void blockmap_init(struct blockmap *bm, unsigned int nentries){
+	unsigned int i;
+
+	for (bm->bits = 4; (1u << bm->bits) < 2 * nentries; bm->bits++)
+		;
+	bm->mask = (1u << bm->bits) - 1;
+	bm->count = 0;
+	bm->table = malloc((bm->mask + 1) * sizeof(*bm->table));
+	if (bm->table == 0) {
+		panic("blockmap_init");
+	}
+	for (i = 0; i <= bm->mask; i++) {
+		bm->table[i].slot = BLOCKMAP_EMPTY;
+	}
+}
+
+int blockmap_lookup(struct blockmap *bm, block_no offset){
+	unsigned int i;
+
+	for (i = blockmap_hash(bm, offset); bm->table[i].slot != BLOCKMAP_EMPTY;
+													i = (i + 1) & bm->mask) {
+		if (bm->table[i].offset == offset) {
+			return bm->table[i].slot;
+		}
+	}
+	return -1;
+}
+
+void blockmap_insert(struct blockmap *bm, block_no offset, unsigned int slot){
+	unsigned int i = blockmap_hash(bm, offset);
+
+	if (bm->count == bm->mask) {
+		panic("blockmap_insert: table full");
+	}
+	while (bm->table[i].slot != BLOCKMAP_EMPTY) {
+		i = (i + 1) & bm->mask;
+	}
+	bm->table[i].offset = offset;
+	bm->table[i].slot = slot;
+	bm->count++;
+}
+
+int blockmap_remove(struct blockmap *bm, block_no offset){
+	unsigned int i, j, home;
+
+	for (i = blockmap_hash(bm, offset); bm->table[i].offset != offset;
+													i = (i + 1) & bm->mask) {
+		if (bm->table[i].slot == BLOCKMAP_EMPTY) {
+			return -1;
+		}
+	}
+	if (bm->table[i].slot == BLOCKMAP_EMPTY) {
+		return -1;
+	}
+	int slot = bm->table[i].slot;
+
+	/* Move back any later entry that would no longer be found once there
+	 * is a hole at i, i.e., one whose home is not between i and itself.
+	 */
+	for (j = (i + 1) & bm->mask; bm->table[j].slot != BLOCKMAP_EMPTY; j = (j + 1) & bm->mask) {
+		home = blockmap_hash(bm, bm->table[j].offset);
+		if (((j - home) & bm->mask) >= ((j - i) & bm->mask)) {
+			bm->table[i] = bm->table[j];
+			i = j;
+		}
+	}
+	bm->table[i].slot = BLOCKMAP_EMPTY;
+	bm->count--;
+	return slot;
+}
+
+void blockmap_clear(struct blockmap *bm){
+	unsigned int i;
+
+	for (i = 0; i <= bm->mask; i++) {
+		bm->table[i].slot = BLOCKMAP_EMPTY;
+	}
+	bm->count = 0;
+}
+
+void blockmap_free(struct blockmap *bm){
+	free(bm->table);
+	bm->table = 0;
+}
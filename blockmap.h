@@ -0,0 +1,50 @@
+/* A blockmap maps block numbers to cache slots, so that cache modules can
+ * find the slot that holds a block without scanning all slots.  It is an
+ * open-addressing hash table with linear probing over an array of
+ * (offset, slot) pairs, sized to be at most half full when it holds as
+ * many entries as it was created for.  Deleting an entry moves later
+ * entries of the same probe sequence back, so there are no tombstones.
+ *
+ *		void blockmap_init(struct blockmap *bm, unsigned int nentries)
+ *			Initialize an empty blockmap for up to 'nentries' entries.
+ *
+ *		int blockmap_lookup(struct blockmap *bm, block_no offset)
+ *			Return the slot mapped to 'offset', or -1 if none.
+ *
+ *		void blockmap_insert(struct blockmap *bm, block_no offset,
+ *														unsigned int slot)
+ *			Map 'offset' to 'slot'.  'offset' must not be mapped yet.
+ *
+ *		int blockmap_remove(struct blockmap *bm, block_no offset)
+ *			Remove the entry for 'offset' and return its slot, or -1
+ *			if there is none.
+ *
+ *		void blockmap_clear(struct blockmap *bm)
+ *			Remove all entries.
+ *
+ *		void blockmap_free(struct blockmap *bm)
+ *			Release the memory of the blockmap.
+ *
+ * Include "block_if.h" before this file.
+ */
+
+#define BLOCKMAP_EMPTY		((unsigned int) -1)	// slot of an unused entry
+
+struct blockmap_entry {
+	block_no offset;			// block number
+	unsigned int slot;			// cache slot, or BLOCKMAP_EMPTY
+};
+
+struct blockmap {
+	struct blockmap_entry *table;
+	unsigned int bits;			// log2 of table size
+	unsigned int mask;			// table size minus 1
+	unsigned int count;			// #entries in use
+};
+
+void blockmap_init(struct blockmap *bm, unsigned int nentries);
+int blockmap_lookup(struct blockmap *bm, block_no offset);
+void blockmap_insert(struct blockmap *bm, block_no offset, unsigned int slot);
+int blockmap_remove(struct blockmap *bm, block_no offset);
+void blockmap_clear(struct blockmap *bm);
+void blockmap_free(struct blockmap *bm);
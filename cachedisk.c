@@ -67,6 +67,14 @@ static int cachedisk_write(block_if bi, block_no offset, block_t *block){
 	return (*cs->below->write)(cs->below, offset, block);
 }
 
+/* The cache is write-through, so there is nothing to write back.
+ */
+static int cachedisk_flush(block_if bi){
+	struct cachedisk_state *cs = bi->state;
+
+	return block_flush(cs->below);
+}
+
 static void cachedisk_destroy(block_if bi){
 	struct cachedisk_state *cs = bi->state;
 
@@ -106,5 +114,6 @@ block_if cachedisk_init(block_if below, block_t *blocks, block_no nblocks){
 	bi->read = cachedisk_read;
 	bi->write = cachedisk_write;
 	bi->destroy = cachedisk_destroy;
+	bi->flush = cachedisk_flush;
 	return bi;
 }
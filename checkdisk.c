@@ -107,6 +107,37 @@ static int checkdisk_write(block_if bi, block_no offset, block_t *block){
 	return result;
 }
 
+static int checkdisk_discard(block_if bi, block_no offset, block_no count){
+	struct checkdisk_state *cs = bi->state;
+
+	/* The contents of discarded blocks are undefined.  Forget them.
+	 */
+	struct block_list **pbl, *bl;
+	for (pbl = &cs->bl; (bl = *pbl) != 0;) {
+		if (bl->offset >= offset && bl->offset - offset < count) {
+			*pbl = bl->next;
+			free(bl);
+		}
+		else {
+			pbl = &bl->next;
+		}
+	}
+
+	return block_discard(cs->below, offset, count);
+}
+
+static int checkdisk_flush(block_if bi){
+	struct checkdisk_state *cs = bi->state;
+
+	return block_flush(cs->below);
+}
+
+static void checkdisk_hint(block_if bi, block_no offset, enum block_class cls){
+	struct checkdisk_state *cs = bi->state;
+
+	block_hint(cs->below, offset, cls);
+}
+
 static void checkdisk_destroy(block_if bi){
 	struct checkdisk_state *cs = bi->state;
 	struct block_list *bl;
@@ -135,5 +166,8 @@ block_if checkdisk_init(block_if below, char *descr){
 	bi->read = checkdisk_read;
 	bi->write = checkdisk_write;
 	bi->destroy = checkdisk_destroy;
+	bi->flush = checkdisk_flush;
+	bi->discard = checkdisk_discard;
+	bi->hint = checkdisk_hint;
 	return bi;
 }
@@ -1,7 +1,8 @@
 /* Author: Robbert van Renesse, August 2015
  *
  * This block store module mirrors the underlying block store but contains
- * a write-through cache.  The caching strategy is CLOCK, approximating LRU.
+ * a write-through or write-back cache.  The caching strategy is CLOCK,
+ * approximating LRU.
  * The interface is as follows:
  *
  *		block_if clockdisk_init(block_if below,
@@ -11,12 +12,72 @@
  *
  *		void clockdisk_dump_stats(block_if bi)
  *			Prints the cache statistics.
+ *
+ *		void clockdisk_set_admission(block_if bi, int on)
+ *			Turn the TinyLFU admission filter (see tinylfu.h) on or off.
+ *			When on, a block that misses only replaces the block chosen
+ *			by the clock if it has been used more often recently.
+ *			Blocks that are pinned are always admitted.
+ *
+ *		void clockdisk_set_writeback(block_if bi, int on)
+ *			Turn write-back caching on or off (it is off initially).
+ *			Turning it off flushes the cache.
+ *
+ *		void clockdisk_set_protect(block_if bi, int on)
+ *			Turn protection of file system metadata on or off (it is
+ *			off initially).
+ *
+ *		int clockdisk_resize(block_if bi, block_t *blocks, block_no nblocks)
+ *			Change the size of the cache to 'nblocks' blocks, kept in
+ *			the memory that 'blocks' points to.  Returns 0, or -1 if
+ *			the cache could not be resized.
+ *
+ * When a cache is resized, blocks are evicted using the clock until the
+ * rest fit, and then moved into the new memory.  If 'blocks' is the memory
+ * the cache uses already, the blocks in its first 'nblocks' entries stay
+ * where they are, and only the ones beyond are moved, so that the cache
+ * can grow into memory that follows it or shrink to a prefix of it.  In
+ * that case pinned blocks in the first 'nblocks' entries do not get in the
+ * way; otherwise the cache cannot be resized while blocks are pinned.
+ * After a successful resize, the cache no longer uses the memory that is
+ * not part of the new region.
+ *
+ * Each cache entry remembers the class of its block (see block_hint() in
+ * block_if.h), as given by the hint for the last request on the block,
+ * or BLOCK_DATA if there was none.  With protection on, the clock has to
+ * pass an entry holding metadata (anything but BLOCK_DATA) a number of
+ * extra times without the block being used before it is evicted, so that
+ * a scan through data blocks does not push out the superblock, inodes,
+ * and indirect blocks.  The superblock and inodes, which are needed for
+ * every request, get the most extra passes; see clock_credit below.  Once
+ * any hints have been received, the statistics include the read hit rate
+ * for each class.
+ *
+ * In write-back mode, a write only updates the cache entry and marks it
+ * dirty, so that repeated writes to the same block are absorbed.  A dirty
+ * block is written to the block store below when its entry is reused, or
+ * when the cache is flushed.  A flush writes all dirty blocks in order of
+ * increasing offset, so the block store below sees them as sequentially
+ * as possible.  The cache is flushed upon flush, setsize, and destroy.
+ * Errors writing dirty blocks are reported by the operation that causes
+ * the blocks to be written.  Writes that cannot be cached are written
+ * through.
+ *
+ * The cache entry holding a block is found through a hash index (see
+ * blockmap.h), so the cost of a lookup does not depend on the size of
+ * the cache.
+ *
+ * Blocks may be pinned in the cache, giving the client read-only access
+ * to the cache entry itself.  A pinned entry is not evicted until it has
+ * been unpinned as many times as it was pinned.
  */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include "block_if.h"
+#include "blockmap.h"
+#include "tinylfu.h"
 
 /* Per block in the cache we keep track of the following info:
  */
@@ -27,6 +88,10 @@ struct block_info {
 		BI_USED				// recently used
 	} status;
 	block_no offset;		// block being cached if not BI_EMPTY
+	unsigned int pins;		// #outstanding pins; entry may not be evicted
+	int dirty;				// modified since written to the store below
+	enum block_class cls;	// kind of block, from hints
+	unsigned int credit;	// #times the clock may still pass it over
 };
 
 /* State contains the pointer to the block module below as well as caching
@@ -37,30 +102,238 @@ struct clockdisk_state {
 	block_t *blocks;			// memory for caching blocks
 	block_no nblocks;			// size of cache (not size of block store!)
 	struct block_info *binfo;	// info per block
+	struct blockmap map;		// offset to cache entry of cached blocks
 	unsigned int clock_hand;	// rotating hand for clock algorithm
+	int admission;				// consult the admission filter
+	struct tinylfu filter;		// admission filter, if admission is set
+	int writeback;				// write-back rather than write-through
+	unsigned int ndirty;		// #dirty entries
+	int protect;				// protect metadata from eviction
+	int hinted;					// a hint is pending
+	block_no hint_offset;		// block the pending hint is for
+	enum block_class hint_class;	// class given by the pending hint
+	int hints_seen;				// any hints have been received
 
 	/* Stats.
 	 */
 	unsigned int read_hit, read_miss, write_hit, write_miss;
+	unsigned int absorbed;		// #writes to blocks that were dirty already
+	unsigned int evict_write;	// #dirty blocks written upon eviction
+	unsigned int flush_write;	// #dirty blocks written by flushes
+	unsigned int class_hit[BLOCK_NCLASSES], class_miss[BLOCK_NCLASSES];
 };
 
-/* The given block was just used but it's not in the cache.  Use the clock
- * algorithm to find an entry that hasn't been used recently, evict any
- * block in it, and stick the block in the entry.
+/* The number of extra trips around the clock for each class of block
+ * when protection is on.
  */
-static void cache_update(struct clockdisk_state *cs, block_no offset, block_t *block) {
-	for (;;) {
-		if (cs->binfo[cs->clock_hand].status != BI_USED) {
-			break;
+#define CLOCK_MAX_CREDIT	4
+static const unsigned int clock_credit[BLOCK_NCLASSES] = {
+	0,						// BLOCK_DATA
+	CLOCK_MAX_CREDIT,		// BLOCK_SUPER
+	CLOCK_MAX_CREDIT,		// BLOCK_INODE
+	2,						// BLOCK_INDIRECT
+	1						// BLOCK_FREELIST
+};
+
+/* Return the class of the block for the request at hand, using up the
+ * pending hint if it is for this block.
+ */
+static enum block_class cache_class(struct clockdisk_state *cs, block_no offset){
+	if (cs->hinted && cs->hint_offset == offset) {
+		cs->hinted = 0;
+		return cs->hint_class;
+	}
+	return BLOCK_DATA;
+}
+
+/* Set the class of the block in cache entry i.
+ */
+static void cache_classify(struct clockdisk_state *cs, int i, enum block_class cls){
+	cs->binfo[i].cls = cls;
+	cs->binfo[i].credit = cs->protect ? clock_credit[cls] : 0;
+}
+
+/* Write the dirty block in the given entry to the block store below.
+ */
+static int cache_writeback(struct clockdisk_state *cs, unsigned int i){
+	if ((*cs->below->write)(cs->below, cs->binfo[i].offset, &cs->blocks[i]) < 0) {
+		return -1;
+	}
+	cs->binfo[i].dirty = 0;
+	cs->ndirty--;
+	return 0;
+}
+
+/* A block is about to be placed in the cache.  Use the clock algorithm to
+ * find an entry that hasn't been used recently and evict any block in it.
+ * Pinned entries are skipped, as are dirty entries that cannot be written
+ * back and protected entries that have credit left.  If 'admit' is set and
+ * the admission filter is on, the filter may turn the new block away
+ * rather than evicting the old one.  Returns the index of the entry, or
+ * -1 if all entries are pinned or the block was not admitted.  The caller
+ * adds the new block to the index.
+ */
+static int cache_alloc(struct clockdisk_state *cs, block_no offset, int admit){
+	unsigned int n;
+
+	for (n = 0; n < (2 + CLOCK_MAX_CREDIT) * cs->nblocks; n++) {
+		struct block_info *info = &cs->binfo[cs->clock_hand];
+		if (info->status != BI_USED && info->pins == 0) {
+			if (info->status == BI_UNUSED && info->credit > 0) {
+				info->credit--;
+				goto next;
+			}
+			if (info->status == BI_UNUSED && admit && cs->admission &&
+						!tinylfu_admit(&cs->filter, offset, info->offset)) {
+				return -1;
+			}
+			if (info->status == BI_UNUSED && info->dirty) {
+				if (cache_writeback(cs, cs->clock_hand) < 0) {
+					goto next;
+				}
+				cs->evict_write++;
+			}
+			if (info->status == BI_UNUSED) {
+				blockmap_remove(&cs->map, info->offset);
+			}
+			info->status = BI_USED;
+			return cs->clock_hand;
+		}
+	next:
+		if (info->status == BI_USED) {
+			info->status = BI_UNUSED;
 		}
-		cs->binfo[cs->clock_hand].status = BI_UNUSED;
 		if (++cs->clock_hand == cs->nblocks) {
 			cs->clock_hand = 0;
 		}
 	}
-	cs->binfo[cs->clock_hand].status = BI_USED;
-	cs->binfo[cs->clock_hand].offset = offset;
-	memcpy(&cs->blocks[cs->clock_hand], block, BLOCK_SIZE);
+	return -1;
+}
+
+/* Drop cache entry i.  A dirty block is discarded without writing it.
+ */
+static void cache_drop(struct clockdisk_state *cs, unsigned int i){
+	if (cs->binfo[i].dirty) {
+		cs->binfo[i].dirty = 0;
+		cs->ndirty--;
+	}
+	cs->binfo[i].status = BI_EMPTY;
+}
+
+/* The given block was just used but it's not in the cache.  Stick it in
+ * the entry chosen by the clock algorithm, if any, and return its index
+ * or -1 if there is none.
+ */
+static int cache_update(struct clockdisk_state *cs, block_no offset, block_t *block) {
+	int i = cache_alloc(cs, offset, 1);
+
+	if (i >= 0) {
+		cs->binfo[i].offset = offset;
+		blockmap_insert(&cs->map, offset, i);
+		memcpy(&cs->blocks[i], block, BLOCK_SIZE);
+	}
+	return i;
+}
+
+/* A block was written into cache entry i.  In write-back mode, that makes
+ * the entry dirty.
+ */
+static void cache_dirty(struct clockdisk_state *cs, unsigned int i){
+	if (cs->binfo[i].dirty) {
+		cs->absorbed++;
+	}
+	else {
+		cs->binfo[i].dirty = 1;
+		cs->ndirty++;
+	}
+}
+
+/* A dirty entry, to be sorted by the offset of its block.
+ */
+struct cache_dirty_entry {
+	block_no offset;		// offset of the block
+	unsigned int index;		// index of the cache entry
+};
+
+static int cache_cmp(const void *a, const void *b){
+	block_no x = ((const struct cache_dirty_entry *) a)->offset;
+	block_no y = ((const struct cache_dirty_entry *) b)->offset;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Write all dirty blocks to the block store below, in order of offset.
+ * Returns 0, or -1 if some block could not be written.
+ */
+static int cache_flush(struct clockdisk_state *cs){
+	struct cache_dirty_entry *order;
+	unsigned int i, n = 0;
+	int result = 0;
+
+	if (cs->ndirty == 0) {
+		return 0;
+	}
+	if ((order = malloc(cs->ndirty * sizeof(*order))) == 0) {
+		fprintf(stderr, "clockdisk_flush: out of memory\n");
+		return -1;
+	}
+	for (i = 0; i < cs->nblocks; i++) {
+		if (cs->binfo[i].status != BI_EMPTY && cs->binfo[i].dirty) {
+			order[n].offset = cs->binfo[i].offset;
+			order[n++].index = i;
+		}
+	}
+	qsort(order, n, sizeof(*order), cache_cmp);
+	for (i = 0; i < n; i++) {
+		if (cache_writeback(cs, order[i].index) < 0) {
+			result = -1;
+		}
+		else {
+			cs->flush_write++;
+		}
+	}
+	free(order);
+	return result;
+}
+
+/* Return the index of the cache entry that holds the given block, or -1
+ * if the block is not in the cache.
+ */
+static int cache_lookup(struct clockdisk_state *cs, block_no offset){
+	return blockmap_lookup(&cs->map, offset);
+}
+
+/* Tell the admission filter, if any, that the block is being accessed.
+ */
+static void cache_record(struct clockdisk_state *cs, block_no offset){
+	if (cs->admission) {
+		tinylfu_record(&cs->filter, offset);
+	}
+}
+
+/* Drop the cached copies of the 'count' blocks starting at offset.  If
+ * there are fewer such blocks than cache entries, look each one up in the
+ * index.  Otherwise it is cheaper to go through the cache entries.
+ */
+static void cache_invalidate(struct clockdisk_state *cs, block_no offset, block_no count){
+	block_no i;
+	int slot;
+
+	if (count < cs->nblocks) {
+		for (i = 0; i < count; i++) {
+			if ((slot = blockmap_remove(&cs->map, offset + i)) >= 0) {
+				cache_drop(cs, slot);
+			}
+		}
+		return;
+	}
+	for (i = 0; i < cs->nblocks; i++) {
+		if (cs->binfo[i].status != BI_EMPTY && cs->binfo[i].offset >= offset &&
+									cs->binfo[i].offset - offset < count) {
+			blockmap_remove(&cs->map, cs->binfo[i].offset);
+			cache_drop(cs, i);
+		}
+	}
 }
 
 static int clockdisk_nblocks(block_if bi){
@@ -69,65 +342,255 @@ static int clockdisk_nblocks(block_if bi){
 	return (*cs->below->nblocks)(cs->below);
 }
 
+/* The old size returned by the block store below tells which blocks are
+ * cut off, so they can be dropped from the cache.  Dirty blocks are
+ * written back first.
+ */
 static int clockdisk_setsize(block_if bi, block_no nblocks){
 	struct clockdisk_state *cs = bi->state;
-	int i;
 
-	for (i = 0; i < cs->nblocks; i++) {
-		if (cs->binfo[i].status != BI_EMPTY && cs->binfo[i].offset >= nblocks) {
-			cs->binfo[i].status = BI_EMPTY;
-		}
+	if (cache_flush(cs) < 0) {
+		return -1;
+	}
+	int before = (*cs->below->setsize)(cs->below, nblocks);
+	if (before > 0 && (block_no) before > nblocks) {
+		cache_invalidate(cs, nblocks, before - nblocks);
 	}
-	return (*cs->below->setsize)(cs->below, nblocks);
+	return before;
 }
 
 static int clockdisk_read(block_if bi, block_no offset, block_t *block){
 	struct clockdisk_state *cs = bi->state;
-	unsigned int i;
 
 	/* Check the cache first.
 	 */
-	for (i = 0; i < cs->nblocks; i++) {
-		if (cs->binfo[i].status != BI_EMPTY && cs->binfo[i].offset == offset) {
-			memcpy(block, &cs->blocks[i], BLOCK_SIZE);
-			cs->binfo[i].status = BI_USED;
-			cs->read_hit++;
-			return 0;
-		}
+	enum block_class cls = cache_class(cs, offset);
+	cache_record(cs, offset);
+	int i = cache_lookup(cs, offset);
+	if (i >= 0) {
+		memcpy(block, &cs->blocks[i], BLOCK_SIZE);
+		cs->binfo[i].status = BI_USED;
+		cache_classify(cs, i, cls);
+		cs->read_hit++;
+		cs->class_hit[cls]++;
+		return 0;
 	}
 
 	int r = (*cs->below->read)(cs->below, offset, block);
 	if (r >= 0) {
-		cache_update(cs, offset, block);
+		if ((i = cache_update(cs, offset, block)) >= 0) {
+			cache_classify(cs, i, cls);
+		}
 		cs->read_miss++;
+		cs->class_miss[cls]++;
 	}
 	return r;
 }
 
 static int clockdisk_write(block_if bi, block_no offset, block_t *block){
 	struct clockdisk_state *cs = bi->state;
-	unsigned int i;
 
 	/* Check the cache first.  Even if it's in the cache, write to the
-	 * block store below because this implements a write-through cache.
+	 * block store below if this is a write-through cache.
 	 */
-	for (i = 0; i < cs->nblocks; i++) {
-		if (cs->binfo[i].status != BI_EMPTY && cs->binfo[i].offset == offset) {
-			memcpy(&cs->blocks[i], block, BLOCK_SIZE);
-			cs->binfo[i].status = BI_USED;
+	enum block_class cls = cache_class(cs, offset);
+	cache_record(cs, offset);
+	int i = cache_lookup(cs, offset);
+	if (i >= 0) {
+		memcpy(&cs->blocks[i], block, BLOCK_SIZE);
+		cs->binfo[i].status = BI_USED;
+		cs->write_hit++;
+	}
+	else {
+		i = cache_update(cs, offset, block);
+		cs->write_miss++;
+	}
+	if (i >= 0) {
+		cache_classify(cs, i, cls);
+	}
+	if (cs->writeback && i >= 0) {
+		cache_dirty(cs, i);
+		return 0;
+	}
+	return (*cs->below->write)(cs->below, offset, block);
+}
+
+/* Read a range of blocks.  Blocks that are in the cache are copied from
+ * there, while each run of consecutive misses is read from the block
+ * store below using a single range read.
+ */
+static int clockdisk_readv(block_if bi, block_no offset, block_no count, block_t *blocks){
+	struct clockdisk_state *cs = bi->state;
+	block_no i = 0, j;
+	int slot;
+
+	while (i < count) {
+		cache_record(cs, offset + i);
+		if ((slot = cache_lookup(cs, offset + i)) >= 0) {
+			enum block_class cls = cache_class(cs, offset + i);
+
+			memcpy(&blocks[i], &cs->blocks[slot], BLOCK_SIZE);
+			cs->binfo[slot].status = BI_USED;
+			cache_classify(cs, slot, cls);
+			cs->read_hit++;
+			cs->class_hit[cls]++;
+			i++;
+			continue;
+		}
+
+		/* Find the end of the run of misses.
+		 */
+		for (j = i + 1; j < count; j++) {
+			if (cache_lookup(cs, offset + j) >= 0) {
+				break;
+			}
+			cache_record(cs, offset + j);
+		}
+		int r = block_readv(cs->below, offset + i, j - i, &blocks[i]);
+		if (r < 0) {
+			return r;
+		}
+		for (; i < j; i++) {
+			enum block_class cls = cache_class(cs, offset + i);
+
+			if ((slot = cache_update(cs, offset + i, &blocks[i])) >= 0) {
+				cache_classify(cs, slot, cls);
+			}
+			cs->read_miss++;
+			cs->class_miss[cls]++;
+		}
+	}
+	return 0;
+}
+
+/* Write a range of blocks.  Update the cache block by block, and then
+ * write the entire range through to the block store below.  In write-back
+ * mode, only the runs of blocks that could not be cached are written.
+ */
+static int clockdisk_writev(block_if bi, block_no offset, block_no count, block_t *blocks){
+	struct clockdisk_state *cs = bi->state;
+	block_no i, run = 0;
+	int slot;
+
+	for (i = 0; i < count; i++) {
+		cache_record(cs, offset + i);
+		if ((slot = cache_lookup(cs, offset + i)) >= 0) {
+			memcpy(&cs->blocks[slot], &blocks[i], BLOCK_SIZE);
+			cs->binfo[slot].status = BI_USED;
 			cs->write_hit++;
-			return (*cs->below->write)(cs->below, offset, block);
 		}
+		else {
+			slot = cache_update(cs, offset + i, &blocks[i]);
+			cs->write_miss++;
+		}
+		if (slot >= 0) {
+			cache_classify(cs, slot, cache_class(cs, offset + i));
+		}
+		if (!cs->writeback) {
+			continue;
+		}
+		if (slot >= 0) {
+			cache_dirty(cs, slot);
+			if (run < i && block_writev(cs->below, offset + run, i - run, &blocks[run]) < 0) {
+				return -1;
+			}
+			run = i + 1;
+		}
+	}
+	if (!cs->writeback) {
+		return block_writev(cs->below, offset, count, blocks);
+	}
+	if (run < count) {
+		return block_writev(cs->below, offset + run, count - run, &blocks[run]);
+	}
+	return 0;
+}
+
+/* Pin the block at the given offset in the cache, reading it into a
+ * cache entry if necessary.
+ */
+static const block_t *clockdisk_pin(block_if bi, block_no offset){
+	struct clockdisk_state *cs = bi->state;
+
+	enum block_class cls = cache_class(cs, offset);
+	cache_record(cs, offset);
+	int i = cache_lookup(cs, offset);
+	if (i >= 0) {
+		cs->binfo[i].status = BI_USED;
+		cs->binfo[i].pins++;
+		cache_classify(cs, i, cls);
+		cs->read_hit++;
+		cs->class_hit[cls]++;
+		return &cs->blocks[i];
 	}
 
-	cache_update(cs, offset, block);
-	cs->write_miss++;
-	return (*cs->below->write)(cs->below, offset, block);
+	if ((i = cache_alloc(cs, offset, 0)) < 0) {
+		return 0;
+	}
+	if ((*cs->below->read)(cs->below, offset, &cs->blocks[i]) < 0) {
+		cs->binfo[i].status = BI_EMPTY;
+		return 0;
+	}
+	cs->binfo[i].offset = offset;
+	blockmap_insert(&cs->map, offset, i);
+	cs->binfo[i].pins++;
+	cache_classify(cs, i, cls);
+	cs->read_miss++;
+	cs->class_miss[cls]++;
+	return &cs->blocks[i];
+}
+
+static void clockdisk_unpin(block_if bi, const block_t *block){
+	struct clockdisk_state *cs = bi->state;
+
+	cs->binfo[block - cs->blocks].pins--;
+}
+
+/* Remember the class of the next request for the given block.  The hint
+ * is not passed on, as the request may never get to the store below.
+ */
+static void clockdisk_hint(block_if bi, block_no offset, enum block_class cls){
+	struct clockdisk_state *cs = bi->state;
+
+	cs->hinted = 1;
+	cs->hint_offset = offset;
+	cs->hint_class = cls;
+	cs->hints_seen = 1;
+}
+
+/* Drop any cached copies of the discarded blocks, making room for other
+ * blocks, and pass the discard on to the block store below.
+ */
+static int clockdisk_discard(block_if bi, block_no offset, block_no count){
+	struct clockdisk_state *cs = bi->state;
+
+	cache_invalidate(cs, offset, count);
+	return block_discard(cs->below, offset, count);
+}
+
+/* Write back the dirty blocks, if any, and then flush the block store
+ * below.
+ */
+static int clockdisk_flush(block_if bi){
+	struct clockdisk_state *cs = bi->state;
+
+	int r = cache_flush(cs);
+	if (block_flush(cs->below) < 0) {
+		return -1;
+	}
+	return r;
 }
 
 static void clockdisk_destroy(block_if bi){
 	struct clockdisk_state *cs = bi->state;
 
+	if (cache_flush(cs) < 0) {
+		fprintf(stderr, "clockdisk_destroy: dirty blocks lost\n");
+	}
+	blockmap_free(&cs->map);
+	if (cs->admission) {
+		tinylfu_free(&cs->filter);
+	}
 	free(cs->binfo);
 	free(cs);
 	free(bi);
@@ -140,6 +603,173 @@ void clockdisk_dump_stats(block_if bi){
 	printf("!$CLOCK: #read misses:  %u\n", cs->read_miss);
 	printf("!$CLOCK: #write hits:   %u\n", cs->write_hit);
 	printf("!$CLOCK: #write misses: %u\n", cs->write_miss);
+	if (cs->admission) {
+		printf("!$CLOCK: #admitted:     %u\n", cs->filter.accepted);
+		printf("!$CLOCK: #rejected:     %u\n", cs->filter.rejected);
+	}
+	if (cs->writeback) {
+		printf("!$CLOCK: #absorbed:     %u\n", cs->absorbed);
+		printf("!$CLOCK: #evict writes: %u\n", cs->evict_write);
+		printf("!$CLOCK: #flush writes: %u\n", cs->flush_write);
+		printf("!$CLOCK: #dirty:        %u\n", cs->ndirty);
+	}
+	if (cs->hints_seen) {
+		static char *names[BLOCK_NCLASSES] = {
+			"data", "super", "inode", "indirect", "freelist"
+		};
+		int c;
+
+		for (c = 0; c < BLOCK_NCLASSES; c++) {
+			unsigned int total = cs->class_hit[c] + cs->class_miss[c];
+			printf("!$CLOCK: %-8s read hits: %6u misses: %6u (%5.1f%%)\n",
+						names[c], cs->class_hit[c], cs->class_miss[c],
+						total == 0 ? 0.0 : 100.0 * cs->class_hit[c] / total);
+		}
+	}
+}
+
+void clockdisk_set_admission(block_if bi, int on){
+	struct clockdisk_state *cs = bi->state;
+
+	if (on && !cs->admission) {
+		tinylfu_init(&cs->filter, cs->nblocks);
+	}
+	else if (!on && cs->admission) {
+		tinylfu_free(&cs->filter);
+	}
+	cs->admission = on != 0;
+}
+
+void clockdisk_set_writeback(block_if bi, int on){
+	struct clockdisk_state *cs = bi->state;
+
+	if (!on && cache_flush(cs) < 0) {
+		fprintf(stderr, "clockdisk_set_writeback: could not flush\n");
+		return;
+	}
+	cs->writeback = on != 0;
+}
+
+void clockdisk_set_protect(block_if bi, int on){
+	struct clockdisk_state *cs = bi->state;
+
+	cs->protect = on != 0;
+}
+
+/* An entry is occupied if it holds a block or is still pinned.  A pinned
+ * block that was discarded or invalidated leaves an empty entry whose
+ * memory the client may still be using.
+ */
+static int cache_occupied(struct block_info *info){
+	return info->status != BI_EMPTY || info->pins > 0;
+}
+
+/* Evict blocks with the clock until no more than 'nblocks' entries are
+ * occupied.  Returns the number of occupied entries left.
+ */
+static unsigned int cache_shrink(struct clockdisk_state *cs, unsigned int nblocks){
+	unsigned int i, n, used = 0;
+
+	for (i = 0; i < cs->nblocks; i++) {
+		if (cache_occupied(&cs->binfo[i])) {
+			used++;
+		}
+	}
+	for (n = 0; used > nblocks && n < (2 + CLOCK_MAX_CREDIT) * cs->nblocks; n++) {
+		struct block_info *info = &cs->binfo[cs->clock_hand];
+
+		if (info->status == BI_USED) {
+			info->status = BI_UNUSED;
+		}
+		else if (info->status == BI_UNUSED && info->pins == 0) {
+			if (info->credit > 0) {
+				info->credit--;
+			}
+			else if (!info->dirty || cache_writeback(cs, cs->clock_hand) == 0) {
+				blockmap_remove(&cs->map, info->offset);
+				info->status = BI_EMPTY;
+				used--;
+			}
+		}
+		if (++cs->clock_hand == cs->nblocks) {
+			cs->clock_hand = 0;
+		}
+	}
+	return used;
+}
+
+int clockdisk_resize(block_if bi, block_t *blocks, block_no nblocks){
+	struct clockdisk_state *cs = bi->state;
+	struct block_info *binfo;
+	unsigned int i, k;
+	int same = blocks == cs->blocks;
+
+	if (nblocks == 0) {
+		fprintf(stderr, "clockdisk_resize: cache needs at least one block\n");
+		return -1;
+	}
+
+	/* Pinned blocks cannot be moved.
+	 */
+	for (i = 0; i < cs->nblocks; i++) {
+		if (cs->binfo[i].pins > 0 && (!same || i >= nblocks)) {
+			fprintf(stderr, "clockdisk_resize: block %u is pinned\n", cs->binfo[i].offset);
+			return -1;
+		}
+	}
+	if (cache_shrink(cs, nblocks) > nblocks) {
+		fprintf(stderr, "clockdisk_resize: can't evict enough blocks\n");
+		return -1;
+	}
+	if ((binfo = calloc(nblocks, sizeof(*binfo))) == 0) {
+		fprintf(stderr, "clockdisk_resize: out of memory\n");
+		return -1;
+	}
+
+	/* Move the remaining blocks.  In the same memory, blocks that are in
+	 * range stay put and the others go into unoccupied entries.
+	 */
+	if (same) {
+		for (i = 0; i < cs->nblocks && i < nblocks; i++) {
+			binfo[i] = cs->binfo[i];
+		}
+	}
+	for (i = same ? nblocks : 0, k = 0; i < cs->nblocks; i++) {
+		if (cs->binfo[i].status == BI_EMPTY) {
+			continue;
+		}
+		while (cache_occupied(&binfo[k])) {
+			k++;
+		}
+		binfo[k] = cs->binfo[i];
+		memcpy(&blocks[k], &cs->blocks[i], BLOCK_SIZE);
+	}
+
+	/* Rebuild the index, and start the clock over if its hand is out of
+	 * range or the entries were rearranged.
+	 */
+	free(cs->binfo);
+	cs->binfo = binfo;
+	if (!same || cs->clock_hand >= nblocks) {
+		cs->clock_hand = 0;
+	}
+	cs->blocks = blocks;
+	cs->nblocks = nblocks;
+	blockmap_free(&cs->map);
+	blockmap_init(&cs->map, nblocks);
+	for (i = 0; i < nblocks; i++) {
+		if (binfo[i].status != BI_EMPTY) {
+			blockmap_insert(&cs->map, binfo[i].offset, i);
+		}
+	}
+
+	/* The admission filter is sized for the cache.
+	 */
+	if (cs->admission) {
+		tinylfu_free(&cs->filter);
+		tinylfu_init(&cs->filter, nblocks);
+	}
+	return 0;
 }
 
 /* Create a new block store module on top of the specified module below.
@@ -154,6 +784,7 @@ block_if clockdisk_init(block_if below, block_t *blocks, block_no nblocks){
 	cs->blocks = blocks;
 	cs->nblocks = nblocks;
 	cs->binfo = calloc(nblocks, sizeof(*cs->binfo));
+	blockmap_init(&cs->map, nblocks);
 
 	/* Return a block interface to this inode.
 	 */
@@ -164,5 +795,12 @@ block_if clockdisk_init(block_if below, block_t *blocks, block_no nblocks){
 	bi->read = clockdisk_read;
 	bi->write = clockdisk_write;
 	bi->destroy = clockdisk_destroy;
+	bi->flush = clockdisk_flush;
+	bi->readv = clockdisk_readv;
+	bi->writev = clockdisk_writev;
+	bi->pin = clockdisk_pin;
+	bi->unpin = clockdisk_unpin;
+	bi->discard = clockdisk_discard;
+	bi->hint = clockdisk_hint;
 	return bi;
 }
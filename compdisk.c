@@ -0,0 +1,484 @@
+/* This code implements a block store in memory that keeps its blocks
+ * compressed, so that compressible data takes less memory:
+ *
+ *		block_if compdisk_init(block_no nblocks, size_t budget)
+ *			Create a new block store with nblocks blocks, all of which
+ *			initially contain zeroes.  At most 'budget' bytes of memory
+ *			are used for block contents (0 means no limit); writes that
+ *			need more memory than that fail.
+ *
+ *		void compdisk_dump_stats(block_if bi)
+ *			Print how well the contents compress.
+ *
+ * Blocks are compressed with a small LZ77 codec (in the style of LZ4) and
+ * stored in slots of size classes that are a multiple of COMP_GRAIN bytes.
+ * Slots are carved out of slabs of COMP_SLAB bytes, and freed slots are
+ * kept on a free list per size class for reuse.  Blocks that do not
+ * compress are stored as is.  Blocks that are all zeroes take no memory
+ * other than their entry in the block map.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "block_if.h"
+
+#define COMP_GRAIN		16					// slot size granularity
+#define COMP_NCLASSES	(BLOCK_SIZE / COMP_GRAIN)
+#define COMP_SLAB		(16 * 1024)			// #bytes per slab
+#define COMP_HASHBITS	10					// log2 of codec hash table size
+#define COMP_MINMATCH	4					// minimum match length
+
+struct comp_block {
+	unsigned char *data;		// compressed contents, or null if zero
+	unsigned short len;			// #bytes of compressed contents
+};
+
+struct comp_slab {
+	struct comp_slab *next;		// list of all slabs
+	unsigned char mem[];		// COMP_SLAB bytes, carved into slots
+};
+
+struct compdisk_state {
+	block_no nblocks;			// #blocks in the block store
+	struct comp_block *map;		// one entry per block
+	size_t budget;				// max #bytes in slabs, or 0
+
+	/* Slot allocator.  Each size class is served by its own slabs, of
+	 * which only the most recent one ('cur') may have unused space left.
+	 */
+	struct comp_slab *slabs;
+	void *free[COMP_NCLASSES];			// free list of each size class
+	unsigned char *cur[COMP_NCLASSES];	// next unused slot in newest slab
+	unsigned char *end[COMP_NCLASSES];	// end of newest slab
+	size_t slab_bytes;					// #bytes in slabs
+
+	/* Stats.
+	 */
+	unsigned int nstored;		// #blocks with non-zero contents
+	unsigned int nraw;			// #blocks stored uncompressed
+	size_t comp_bytes;			// total compressed length of stored blocks
+	size_t slot_bytes;			// total size of slots in use
+};
+
+/* The codec.  A compressed block is a sequence of (literals, match) pairs.
+ * Each pair starts with a token byte holding the number of literals in the
+ * top four bits and the match length minus COMP_MINMATCH in the bottom
+ * four.  A value of 15 is followed by bytes that are added to it until one
+ * is less than 255.  Then come the literals and a two-byte little-endian
+ * distance back to the start of the match.  The last pair has no match;
+ * it ends where the input ends.
+ */
+
+static uint32_t comp_read32(const unsigned char *p){
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static unsigned char *comp_putlen(unsigned char *op, unsigned char *oend, unsigned int len){
+	while (len >= 255) {
+		if (op >= oend) {
+			return 0;
+		}
+		*op++ = 255;
+		len -= 255;
+	}
+	if (op >= oend) {
+		return 0;
+	}
+	*op++ = len;
+	return op;
+}
+
+/* Append a pair to 'op'.  Returns the new end of the output, or null if it
+ * does not fit before 'oend'.  A match length of 0 means there is no match.
+ */
+static unsigned char *comp_emit(unsigned char *op, unsigned char *oend,
+				const unsigned char *lit, unsigned int nlit,
+				unsigned int dist, unsigned int mlen){
+	unsigned int mcode = mlen == 0 ? 0 : mlen - COMP_MINMATCH;
+
+	if (op >= oend) {
+		return 0;
+	}
+	unsigned char *token = op++;
+	*token = ((nlit < 15 ? nlit : 15) << 4) | (mcode < 15 ? mcode : 15);
+	if (nlit >= 15 && (op = comp_putlen(op, oend, nlit - 15)) == 0) {
+		return 0;
+	}
+	if (nlit > oend - op) {
+		return 0;
+	}
+	memcpy(op, lit, nlit);
+	op += nlit;
+	if (mlen != 0) {
+		if (oend - op < 2) {
+			return 0;
+		}
+		*op++ = dist & 0xFF;
+		*op++ = dist >> 8;
+		if (mcode >= 15 && (op = comp_putlen(op, oend, mcode - 15)) == 0) {
+			return 0;
+		}
+	}
+	return op;
+}
+
+/* Compress the n bytes at 'src' into at most 'cap' bytes at 'dst'.
+ * Returns the compressed length, or 0 if it does not fit.
+ */
+static unsigned int comp_compress(const unsigned char *src, unsigned int n,
+										unsigned char *dst, unsigned int cap){
+	unsigned short table[1 << COMP_HASHBITS];	// position + 1, or 0
+	unsigned char *op = dst, *oend = dst + cap;
+	unsigned int ip = 0, anchor = 0;
+
+	memset(table, 0, sizeof(table));
+	while (ip + COMP_MINMATCH <= n) {
+		uint32_t v = comp_read32(&src[ip]);
+		unsigned int h = (v * 2654435761u) >> (32 - COMP_HASHBITS);
+		unsigned int ref = table[h];
+
+		table[h] = ip + 1;
+		if (ref == 0 || comp_read32(&src[ref - 1]) != v) {
+			ip++;
+			continue;
+		}
+		ref--;
+		unsigned int len = COMP_MINMATCH;
+		while (ip + len < n && src[ref + len] == src[ip + len]) {
+			len++;
+		}
+		op = comp_emit(op, oend, &src[anchor], ip - anchor, ip - ref, len);
+		if (op == 0) {
+			return 0;
+		}
+		ip += len;
+		anchor = ip;
+	}
+	op = comp_emit(op, oend, &src[anchor], n - anchor, 0, 0);
+	return op == 0 ? 0 : op - dst;
+}
+
+static const unsigned char *comp_getlen(const unsigned char *ip, const unsigned char *iend,
+										unsigned int *len){
+	unsigned char c;
+
+	do {
+		if (ip >= iend) {
+			return 0;
+		}
+		c = *ip++;
+		*len += c;
+	} while (c == 255);
+	return ip;
+}
+
+/* Decompress 'len' bytes at 'src' into exactly n bytes at 'dst'.
+ * Returns 0, or -1 if the input is corrupt.
+ */
+static int comp_decompress(const unsigned char *src, unsigned int len,
+										unsigned char *dst, unsigned int n){
+	const unsigned char *ip = src, *iend = src + len;
+	unsigned int op = 0;
+
+	while (ip < iend) {
+		unsigned int token = *ip++;
+		unsigned int nlit = token >> 4, mlen = token & 0xF;
+		if (nlit == 15 && (ip = comp_getlen(ip, iend, &nlit)) == 0) {
+			return -1;
+		}
+		if (nlit > iend - ip || nlit > n - op) {
+			return -1;
+		}
+		memcpy(&dst[op], ip, nlit);
+		ip += nlit;
+		op += nlit;
+		if (ip == iend) {
+			break;
+		}
+		if (iend - ip < 2) {
+			return -1;
+		}
+		unsigned int dist = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if (mlen == 15 && (ip = comp_getlen(ip, iend, &mlen)) == 0) {
+			return -1;
+		}
+		mlen += COMP_MINMATCH;
+		if (dist == 0 || dist > op || mlen > n - op) {
+			return -1;
+		}
+		while (mlen-- > 0) {		// may overlap, so byte by byte
+			dst[op] = dst[op - dist];
+			op++;
+		}
+	}
+	return op == n ? 0 : -1;
+}
+
+/* The slot allocator.
+ */
+static unsigned int comp_class(unsigned int len){
+	return (len + COMP_GRAIN - 1) / COMP_GRAIN - 1;
+}
+
+static unsigned char *comp_alloc(struct compdisk_state *cs, unsigned int len){
+	unsigned int c = comp_class(len);
+	size_t size = (c + 1) * COMP_GRAIN;
+	unsigned char *slot;
+
+	if ((slot = cs->free[c]) != 0) {
+		memcpy(&cs->free[c], slot, sizeof(void *));
+	}
+	else {
+		if (cs->cur[c] == 0 || cs->end[c] - cs->cur[c] < size) {
+			if (cs->budget != 0 && cs->slab_bytes + COMP_SLAB > cs->budget) {
+				fprintf(stderr, "compdisk: memory budget exhausted\n");
+				return 0;
+			}
+			struct comp_slab *slab = malloc(sizeof(*slab) + COMP_SLAB);
+			if (slab == 0) {
+				fprintf(stderr, "compdisk: out of memory\n");
+				return 0;
+			}
+			slab->next = cs->slabs;
+			cs->slabs = slab;
+			cs->slab_bytes += COMP_SLAB;
+			cs->cur[c] = slab->mem;
+			cs->end[c] = slab->mem + COMP_SLAB;
+		}
+		slot = cs->cur[c];
+		cs->cur[c] += size;
+	}
+	cs->slot_bytes += size;
+	return slot;
+}
+
+static void comp_free(struct compdisk_state *cs, struct comp_block *cb){
+	if (cb->data != 0) {
+		unsigned int c = comp_class(cb->len);
+		memcpy(cb->data, &cs->free[c], sizeof(void *));
+		cs->free[c] = cb->data;
+		cs->slot_bytes -= (c + 1) * COMP_GRAIN;
+		cs->comp_bytes -= cb->len;
+		cs->nstored--;
+		if (cb->len == BLOCK_SIZE) {
+			cs->nraw--;
+		}
+		cb->data = 0;
+		cb->len = 0;
+	}
+}
+
+static int compdisk_nblocks(block_if bi){
+	struct compdisk_state *cs = bi->state;
+
+	return cs->nblocks;
+}
+
+static int compdisk_setsize(block_if bi, block_no nblocks){
+	struct compdisk_state *cs = bi->state;
+	block_no i;
+
+	/* Drop the blocks beyond the new end, so they read as zeroes if the
+	 * block store grows again.
+	 */
+	for (i = nblocks; i < cs->nblocks; i++) {
+		comp_free(cs, &cs->map[i]);
+	}
+	struct comp_block *map = realloc(cs->map, (size_t) nblocks * sizeof(*map));
+	if (map == 0 && nblocks != 0) {
+		fprintf(stderr, "compdisk_setsize: out of memory\n");
+		return -1;
+	}
+	if (nblocks > cs->nblocks) {
+		memset(&map[cs->nblocks], 0, (size_t) (nblocks - cs->nblocks) * sizeof(*map));
+	}
+	cs->map = map;
+
+	int before = cs->nblocks;
+	cs->nblocks = nblocks;
+	return before;
+}
+
+static int compdisk_read(block_if bi, block_no offset, block_t *block){
+	struct compdisk_state *cs = bi->state;
+
+	if (offset >= cs->nblocks) {
+		fprintf(stderr, "compdisk_read: bad offset %u\n", offset);
+		return -1;
+	}
+	struct comp_block *cb = &cs->map[offset];
+	if (cb->data == 0) {
+		memset(block, 0, BLOCK_SIZE);
+	}
+	else if (cb->len == BLOCK_SIZE) {
+		memcpy(block, cb->data, BLOCK_SIZE);
+	}
+	else if (comp_decompress(cb->data, cb->len, (unsigned char *) block, BLOCK_SIZE) < 0) {
+		fprintf(stderr, "compdisk_read: corrupt block %u\n", offset);
+		return -1;
+	}
+	return 0;
+}
+
+static int compdisk_iszero(block_t *block){
+	static const block_t zero;
+
+	return memcmp(block, &zero, BLOCK_SIZE) == 0;
+}
+
+static int compdisk_write(block_if bi, block_no offset, block_t *block){
+	struct compdisk_state *cs = bi->state;
+	unsigned char buf[BLOCK_SIZE];
+	unsigned int len;
+
+	if (offset >= cs->nblocks) {
+		fprintf(stderr, "compdisk_write: bad offset %u\n", offset);
+		return -1;
+	}
+	struct comp_block *cb = &cs->map[offset];
+	if (compdisk_iszero(block)) {
+		comp_free(cs, cb);
+		return 0;
+	}
+
+	/* Only keep the compressed version if it saves at least one grain.
+	 */
+	len = comp_compress((unsigned char *) block, BLOCK_SIZE, buf, BLOCK_SIZE - COMP_GRAIN);
+	if (len == 0) {
+		len = BLOCK_SIZE;
+	}
+
+	/* Reuse the old slot if it is of the right size class.
+	 */
+	if (cb->data == 0 || comp_class(cb->len) != comp_class(len)) {
+		unsigned char *data = comp_alloc(cs, len);
+		if (data == 0) {
+			return -1;
+		}
+		comp_free(cs, cb);
+		cb->data = data;
+	}
+	else {
+		cs->comp_bytes -= cb->len;
+		cs->nstored--;
+		if (cb->len == BLOCK_SIZE) {
+			cs->nraw--;
+		}
+	}
+	memcpy(cb->data, len == BLOCK_SIZE ? (unsigned char *) block : buf, len);
+	cb->len = len;
+	cs->comp_bytes += len;
+	cs->nstored++;
+	if (len == BLOCK_SIZE) {
+		cs->nraw++;
+	}
+	return 0;
+}
+
+static int compdisk_readv(block_if bi, block_no offset, block_no count, block_t *blocks){
+	struct compdisk_state *cs = bi->state;
+	block_no i;
+
+	if (count > cs->nblocks || offset > cs->nblocks - count) {
+		fprintf(stderr, "compdisk_readv: bad range %u %u\n", offset, count);
+		return -1;
+	}
+	for (i = 0; i < count; i++) {
+		if (compdisk_read(bi, offset + i, &blocks[i]) < 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int compdisk_writev(block_if bi, block_no offset, block_no count, block_t *blocks){
+	struct compdisk_state *cs = bi->state;
+	block_no i;
+
+	if (count > cs->nblocks || offset > cs->nblocks - count) {
+		fprintf(stderr, "compdisk_writev: bad range %u %u\n", offset, count);
+		return -1;
+	}
+	for (i = 0; i < count; i++) {
+		if (compdisk_write(bi, offset + i, &blocks[i]) < 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* Discarded blocks are dropped, so they read as zeroes.
+ */
+static int compdisk_discard(block_if bi, block_no offset, block_no count){
+	struct compdisk_state *cs = bi->state;
+	block_no i;
+
+	if (count > cs->nblocks || offset > cs->nblocks - count) {
+		fprintf(stderr, "compdisk_discard: bad range %u %u\n", offset, count);
+		return -1;
+	}
+	for (i = 0; i < count; i++) {
+		comp_free(cs, &cs->map[offset + i]);
+	}
+	return 0;
+}
+
+static void compdisk_destroy(block_if bi){
+	struct compdisk_state *cs = bi->state;
+	struct comp_slab *slab;
+
+	while ((slab = cs->slabs) != 0) {
+		cs->slabs = slab->next;
+		free(slab);
+	}
+	free(cs->map);
+	free(cs);
+	free(bi);
+}
+
+void compdisk_dump_stats(block_if bi){
+	struct compdisk_state *cs = bi->state;
+	size_t logical = (size_t) cs->nstored * BLOCK_SIZE;
+
+	printf("!$COMP: #blocks:      %u\n", cs->nblocks);
+	printf("!$COMP: #stored:      %u\n", cs->nstored);
+	printf("!$COMP: #raw:         %u\n", cs->nraw);
+	printf("!$COMP: #zero:        %u\n", cs->nblocks - cs->nstored);
+	printf("!$COMP: data bytes:   %zu\n", logical);
+	printf("!$COMP: comp bytes:   %zu\n", cs->comp_bytes);
+	printf("!$COMP: slot bytes:   %zu\n", cs->slot_bytes);
+	printf("!$COMP: slab bytes:   %zu\n", cs->slab_bytes);
+	if (cs->slab_bytes != 0) {
+		printf("!$COMP: ratio:        %.2f (%.2f in slots)\n",
+				(double) logical / cs->slab_bytes,
+				cs->slot_bytes == 0 ? 0.0 : (double) logical / cs->slot_bytes);
+	}
+}
+
+block_if compdisk_init(block_no nblocks, size_t budget){
+	struct compdisk_state *cs = calloc(1, sizeof(*cs));
+
+	cs->budget = budget;
+
+	block_if bi = calloc(1, sizeof(*bi));
+	bi->state = cs;
+	bi->nblocks = compdisk_nblocks;
+	bi->setsize = compdisk_setsize;
+	bi->read = compdisk_read;
+	bi->write = compdisk_write;
+	bi->destroy = compdisk_destroy;
+	bi->readv = compdisk_readv;
+	bi->writev = compdisk_writev;
+	bi->discard = compdisk_discard;
+
+	if (compdisk_setsize(bi, nblocks) < 0) {
+		panic("compdisk_init");
+	}
+	return bi;
+}
@@ -56,6 +56,32 @@ static int debugdisk_write(block_if bi, block_no offset, block_t *block){
 	return r;
 }
 
+static int debugdisk_discard(block_if bi, block_no offset, block_no count){
+	struct debugdisk_state *ds = bi->state;
+
+	fprintf(stderr, "%s: invoke discard(offset = %u, count = %u)\n", ds->descr, offset, count);
+	int r = block_discard(ds->below, offset, count);
+	fprintf(stderr, "%s: discard(offset = %u, count = %u) --> %d\n", ds->descr, offset, count, r);
+	return r;
+}
+
+static int debugdisk_flush(block_if bi){
+	struct debugdisk_state *ds = bi->state;
+
+	fprintf(stderr, "%s: invoke flush()\n", ds->descr);
+	int r = block_flush(ds->below);
+	fprintf(stderr, "%s: flush() --> %d\n", ds->descr, r);
+	return r;
+}
+
+/* Hints are passed on quietly, as they are not requests.
+ */
+static void debugdisk_hint(block_if bi, block_no offset, enum block_class cls){
+	struct debugdisk_state *ds = bi->state;
+
+	block_hint(ds->below, offset, cls);
+}
+
 static void debugdisk_destroy(block_if bi){
 	struct debugdisk_state *ds = bi->state;
 
@@ -80,5 +106,8 @@ block_if debugdisk_init(block_if below, char *descr){
 	bi->read = debugdisk_read;
 	bi->write = debugdisk_write;
 	bi->destroy = debugdisk_destroy;
+	bi->discard = debugdisk_discard;
+	bi->flush = debugdisk_flush;
+	bi->hint = debugdisk_hint;
 	return bi;
 }
@@ -0,0 +1,368 @@
+/* This block store module stores each distinct block only once in the
+ * underlying block store:
+ *
+ *		block_if dedupdisk_init(block_if below, block_no nblocks)
+ *			'below' is the underlying block store, and 'nblocks' is the
+ *			size of the new block store.  Distinct blocks written are
+ *			stored in 'below', so at most as many distinct blocks can be
+ *			stored as 'below' has blocks.  Initially all blocks contain
+ *			zeroes.
+ *
+ *		void dedupdisk_dump_stats(block_if bi)
+ *			Print how many blocks are shared.
+ *
+ * The module maps each (logical) block of the block store to a (physical)
+ * block in 'below', and keeps a reference count for each physical block.
+ * Blocks that are all zeroes are not mapped and take no space.  To find
+ * out whether a block is already stored, the module keeps an index from
+ * the fingerprint (a 64-bit hash) of each physical block's contents to
+ * the physical block.  The index is an open-addressing hash table with
+ * linear probing.  As fingerprints may collide, a block is only shared
+ * after comparing it with the stored block.
+ *
+ * The map, reference counts, and index are kept in memory, so the block
+ * store does not survive being destroyed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "block_if.h"
+
+#define DEDUP_NONE		((block_no) -1)		// no physical block
+
+struct dedup_entry {
+	uint64_t fp;				// fingerprint
+	block_no phys;				// physical block, or DEDUP_NONE if empty
+};
+
+struct dedupdisk_state {
+	block_if below;				// block store below
+	block_no nblocks;			// #logical blocks
+	block_no *map;				// logical to physical block, or DEDUP_NONE
+	block_no nphys;				// #physical blocks
+	unsigned int *refs;			// reference count of each physical block
+	uint64_t *fps;				// fingerprint of each physical block in use
+	block_no *free;				// stack of unused physical blocks
+	block_no nfree;				// #entries on the stack
+	struct dedup_entry *index;	// fingerprint index
+	unsigned int mask;			// index size minus 1 (a power of 2 minus 1)
+
+	/* Stats.
+	 */
+	unsigned int nwrite;		// #blocks written
+	unsigned int nzero;			// #blocks written that were all zeroes
+	unsigned int nshared;		// #blocks written that were already stored
+	unsigned int ncollide;		// #fingerprint matches with other contents
+	unsigned int nmapped;		// #logical blocks mapped
+};
+
+/* A 64-bit hash of the contents of a block.
+ */
+static uint64_t dedup_fingerprint(const block_t *block){
+	const unsigned char *p = (const unsigned char *) block;
+	uint64_t h = 0x9E3779B97F4A7C15ull, v;
+	unsigned int i;
+
+	for (i = 0; i < BLOCK_SIZE; i += sizeof(v)) {
+		memcpy(&v, &p[i], sizeof(v));
+		v *= 0xFF51AFD7ED558CCDull;
+		v ^= v >> 32;
+		h = (h ^ v) * 0xC4CEB9FE1A85EC53ull;
+		h ^= h >> 29;
+	}
+	return h;
+}
+
+static unsigned int dedup_slot(struct dedupdisk_state *ds, uint64_t fp){
+	return (unsigned int) (fp ^ (fp >> 32)) & ds->mask;
+}
+
+static void dedup_index_insert(struct dedupdisk_state *ds, uint64_t fp, block_no phys){
+	unsigned int i = dedup_slot(ds, fp);
+
+	while (ds->index[i].phys != DEDUP_NONE) {
+		i = (i + 1) & ds->mask;
+	}
+	ds->index[i].fp = fp;
+	ds->index[i].phys = phys;
+}
+
+/* Remove the entry for the given physical block.  Entries further along
+ * the probe sequence are moved back to fill the hole, so lookups never
+ * need to skip over deleted entries.
+ */
+static void dedup_index_remove(struct dedupdisk_state *ds, uint64_t fp, block_no phys){
+	unsigned int i = dedup_slot(ds, fp), j, home;
+
+	while (ds->index[i].phys != phys) {
+		i = (i + 1) & ds->mask;
+	}
+	for (j = (i + 1) & ds->mask; ds->index[j].phys != DEDUP_NONE; j = (j + 1) & ds->mask) {
+		home = dedup_slot(ds, ds->index[j].fp);
+		if (((j - home) & ds->mask) >= ((j - i) & ds->mask)) {
+			ds->index[i] = ds->index[j];
+			i = j;
+		}
+	}
+	ds->index[i].phys = DEDUP_NONE;
+}
+
+/* Look for a physical block with the same contents as 'block' and store
+ * it in *phys, or DEDUP_NONE if there is none.  Returns 0, or -1 upon an
+ * error reading 'below'.
+ */
+static int dedup_find(struct dedupdisk_state *ds, uint64_t fp, block_t *block, block_no *phys){
+	unsigned int i;
+	block_t scratch;
+
+	for (i = dedup_slot(ds, fp); ds->index[i].phys != DEDUP_NONE; i = (i + 1) & ds->mask) {
+		if (ds->index[i].fp != fp) {
+			continue;
+		}
+		const block_t *stored = block_pin(ds->below, ds->index[i].phys, &scratch);
+		if (stored == 0) {
+			return -1;
+		}
+		int same = memcmp(stored, block, BLOCK_SIZE) == 0;
+		block_unpin(ds->below, stored, &scratch);
+		if (same) {
+			*phys = ds->index[i].phys;
+			return 0;
+		}
+		ds->ncollide++;
+	}
+	*phys = DEDUP_NONE;
+	return 0;
+}
+
+/* Drop the mapping of a logical block.  A physical block that is no longer
+ * referenced is freed, and discarded in the block store below.
+ */
+static void dedup_unmap(struct dedupdisk_state *ds, block_no offset){
+	block_no phys = ds->map[offset];
+
+	if (phys == DEDUP_NONE) {
+		return;
+	}
+	ds->map[offset] = DEDUP_NONE;
+	ds->nmapped--;
+	if (--ds->refs[phys] == 0) {
+		dedup_index_remove(ds, ds->fps[phys], phys);
+		ds->free[ds->nfree++] = phys;
+		(void) block_discard(ds->below, phys, 1);
+	}
+}
+
+static int dedupdisk_nblocks(block_if bi){
+	struct dedupdisk_state *ds = bi->state;
+
+	return ds->nblocks;
+}
+
+/* Only the logical size changes.  Blocks beyond the new end are unmapped,
+ * so they contain zeroes when the block store grows again.
+ */
+static int dedupdisk_setsize(block_if bi, block_no nblocks){
+	struct dedupdisk_state *ds = bi->state;
+	block_no i;
+
+	for (i = nblocks; i < ds->nblocks; i++) {
+		dedup_unmap(ds, i);
+	}
+	block_no *map = realloc(ds->map, (size_t) nblocks * sizeof(*map));
+	if (map == 0 && nblocks != 0) {
+		fprintf(stderr, "dedupdisk_setsize: out of memory\n");
+		return -1;
+	}
+	for (i = ds->nblocks; i < nblocks; i++) {
+		map[i] = DEDUP_NONE;
+	}
+	ds->map = map;
+
+	int before = ds->nblocks;
+	ds->nblocks = nblocks;
+	return before;
+}
+
+static int dedupdisk_read(block_if bi, block_no offset, block_t *block){
+	struct dedupdisk_state *ds = bi->state;
+
+	if (offset >= ds->nblocks) {
+		fprintf(stderr, "dedupdisk_read: bad offset %u\n", offset);
+		return -1;
+	}
+	if (ds->map[offset] == DEDUP_NONE) {
+		memset(block, 0, BLOCK_SIZE);
+		return 0;
+	}
+	return (*ds->below->read)(ds->below, ds->map[offset], block);
+}
+
+static int dedupdisk_iszero(block_t *block){
+	static const block_t zero;
+
+	return memcmp(block, &zero, BLOCK_SIZE) == 0;
+}
+
+static int dedupdisk_write(block_if bi, block_no offset, block_t *block){
+	struct dedupdisk_state *ds = bi->state;
+	block_no old, phys;
+
+	if (offset >= ds->nblocks) {
+		fprintf(stderr, "dedupdisk_write: bad offset %u\n", offset);
+		return -1;
+	}
+	ds->nwrite++;
+	if (dedupdisk_iszero(block)) {
+		ds->nzero++;
+		dedup_unmap(ds, offset);
+		return 0;
+	}
+
+	uint64_t fp = dedup_fingerprint(block);
+	if (dedup_find(ds, fp, block, &phys) < 0) {
+		return -1;
+	}
+	old = ds->map[offset];
+
+	/* If the contents are already stored, share them.
+	 */
+	if (phys != DEDUP_NONE) {
+		ds->nshared++;
+		if (phys != old) {
+			ds->refs[phys]++;
+			dedup_unmap(ds, offset);
+			ds->map[offset] = phys;
+			ds->nmapped++;
+		}
+		return 0;
+	}
+
+	/* Otherwise overwrite the old physical block if this is its only
+	 * reference, or store the contents in a new one.
+	 */
+	if (old != DEDUP_NONE && ds->refs[old] == 1) {
+		phys = old;
+		dedup_index_remove(ds, ds->fps[phys], phys);
+	}
+	else {
+		if (ds->nfree == 0) {
+			fprintf(stderr, "dedupdisk_write: block store below is full\n");
+			return -1;
+		}
+		phys = ds->free[--ds->nfree];
+	}
+	if ((*ds->below->write)(ds->below, phys, block) < 0) {
+		if (phys == old) {				// the old contents are lost
+			ds->map[offset] = DEDUP_NONE;
+			ds->nmapped--;
+			ds->refs[phys] = 0;
+		}
+		ds->free[ds->nfree++] = phys;
+		return -1;
+	}
+	if (phys != old) {
+		dedup_unmap(ds, offset);
+		ds->refs[phys] = 1;
+		ds->map[offset] = phys;
+		ds->nmapped++;
+	}
+	ds->fps[phys] = fp;
+	dedup_index_insert(ds, fp, phys);
+	return 0;
+}
+
+/* Discarded blocks are unmapped, so they read as zeroes.
+ */
+static int dedupdisk_discard(block_if bi, block_no offset, block_no count){
+	struct dedupdisk_state *ds = bi->state;
+	block_no i;
+
+	if (count > ds->nblocks || offset > ds->nblocks - count) {
+		fprintf(stderr, "dedupdisk_discard: bad range %u %u\n", offset, count);
+		return -1;
+	}
+	for (i = 0; i < count; i++) {
+		dedup_unmap(ds, offset + i);
+	}
+	return 0;
+}
+
+static int dedupdisk_flush(block_if bi){
+	struct dedupdisk_state *ds = bi->state;
+
+	return block_flush(ds->below);
+}
+
+static void dedupdisk_destroy(block_if bi){
+	struct dedupdisk_state *ds = bi->state;
+
+	free(ds->map);
+	free(ds->refs);
+	free(ds->fps);
+	free(ds->free);
+	free(ds->index);
+	free(ds);
+	free(bi);
+}
+
+void dedupdisk_dump_stats(block_if bi){
+	struct dedupdisk_state *ds = bi->state;
+	block_no used = ds->nphys - ds->nfree;
+
+	printf("!$DEDUP: #write:     %u\n", ds->nwrite);
+	printf("!$DEDUP: #zero:      %u\n", ds->nzero);
+	printf("!$DEDUP: #shared:    %u\n", ds->nshared);
+	printf("!$DEDUP: #collide:   %u\n", ds->ncollide);
+	printf("!$DEDUP: #mapped:    %u\n", ds->nmapped);
+	printf("!$DEDUP: #stored:    %u\n", used);
+	if (used != 0) {
+		printf("!$DEDUP: ratio:      %.2f\n", (double) ds->nmapped / used);
+	}
+}
+
+block_if dedupdisk_init(block_if below, block_no nblocks){
+	struct dedupdisk_state *ds = calloc(1, sizeof(*ds));
+	block_no i;
+	unsigned int size;
+
+	ds->below = below;
+	ds->nphys = (*below->nblocks)(below);
+	ds->refs = calloc(ds->nphys, sizeof(*ds->refs));
+	ds->fps = calloc(ds->nphys, sizeof(*ds->fps));
+	ds->free = calloc(ds->nphys, sizeof(*ds->free));
+
+	/* Allocate low physical blocks first.
+	 */
+	for (i = 0; i < ds->nphys; i++) {
+		ds->free[i] = ds->nphys - 1 - i;
+	}
+	ds->nfree = ds->nphys;
+
+	/* Keep the index at most half full.
+	 */
+	for (size = 16; size < 2 * ds->nphys; size *= 2)
+		;
+	ds->index = malloc(size * sizeof(*ds->index));
+	ds->mask = size - 1;
+	for (i = 0; i < size; i++) {
+		ds->index[i].phys = DEDUP_NONE;
+	}
+
+	block_if bi = calloc(1, sizeof(*bi));
+	bi->state = ds;
+	bi->nblocks = dedupdisk_nblocks;
+	bi->setsize = dedupdisk_setsize;
+	bi->read = dedupdisk_read;
+	bi->write = dedupdisk_write;
+	bi->destroy = dedupdisk_destroy;
+	bi->discard = dedupdisk_discard;
+	bi->flush = dedupdisk_flush;
+
+	if (dedupdisk_setsize(bi, nblocks) < 0) {
+		panic("dedupdisk_init");
+	}
+	return bi;
+}
@@ -6,92 +6,562 @@
  *		block_if disk_init(char *file_name, block_no nblocks)
  *			Create a new block store, stored in the file by the given
  *			name and with the given number of blocks.
+ *
+ *		block_if directdisk_init(char *file_name, block_no nblocks)
+ *			Like disk_init, but bypass the host's page cache using O_DIRECT.
+ *			Blocks that are not aligned in memory are copied through a
+ *			pool of aligned buffers.  If the host file system does not
+ *			support direct I/O, falls back to ordinary buffered I/O.
+ *
+ * All I/O uses positioned reads and writes rather than the file offset,
+ * so each read or write is a single system call and several threads may
+ * read and write the same block store concurrently.  Setting the size
+ * should not be done concurrently with other operations.
+ *
+ * By default the file grows only as blocks are written, which leaves it
+ * sparse.  Space can instead be preallocated in large chunks with:
+ *
+ *		int disk_set_prealloc(block_if bi, block_no chunk)
+ *			From now on, allocate space in the host file system in chunks
+ *			of 'chunk' blocks (e.g., DISK_PREALLOC), so that writing a block
+ *			never needs to allocate space.  0 turns preallocation off.
+ *			While it is on, discarded blocks stay allocated.
+ *
+ * Writes to consecutive blocks are combined in a buffer and written with
+ * a single system call once the run is broken, the buffer fills up, or
+ * the blocks are read, discarded, or flushed.  An error writing out
+ * combined blocks is reported by the operation that caused the write.
+ * The number of system calls saved is printed by:
+ *
+ *		void disk_dump_stats(block_if bi)
+ *
+ * Asynchronous requests are carried out by a small pool of worker threads
+ * that is started upon the first submission, so that several requests
+ * can be outstanding at the underlying file at the same time.
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <stdint.h>
 #include <unistd.h>
+#include <pthread.h>
 #include "block_if.h"
 
+#define DISK_NWORKERS		4		// #threads for asynchronous I/O
+#define DISK_ALIGN			4096	// buffer alignment for direct I/O
+#define DISK_BOUNCE_BLOCKS	64		// #blocks per bounce buffer
+#define DISK_NBOUNCE		8		// max #bounce buffers kept in the pool
+#define DISK_WC_BLOCKS		64		// max #blocks combined into one write
+
 struct disk_state {
 	block_no nblocks;			// #blocks in the block store
 	int fd;						// POSIX file descriptor of underlying file
+	int direct;					// file is opened with O_DIRECT
+	block_no prealloc;			// growth chunk in blocks, or 0 if disabled
+	off_t allocated;			// #blocks known to be preallocated
+
+	/* Asynchronous I/O.  Submitted requests are queued on 'pending'.
+	 * The workers carry them out and move them to 'completed'.
+	 */
+	pthread_mutex_t lock;		// protects the fields below
+	pthread_cond_t work;		// signaled when requests are queued
+	pthread_cond_t done;		// signaled when requests complete
+	struct block_req *pending, **pending_tail;
+	struct block_req *completed;
+	unsigned int busy;			// #submitted requests not yet completed
+	unsigned int nworkers;		// #worker threads started
+	int stopping;				// set when the workers should exit
+	pthread_t workers[DISK_NWORKERS];
+
+	/* Pool of aligned buffers for direct I/O on unaligned blocks.
+	 */
+	block_t *bounce[DISK_NBOUNCE];
+	unsigned int nbounce;		// #buffers in the pool
+
+	/* Write combining.  Writes of consecutive blocks are collected in
+	 * 'wc_blocks' and written out with a single system call.
+	 */
+	pthread_mutex_t wc_lock;	// protects the fields below
+	block_t *wc_blocks;			// DISK_WC_BLOCKS blocks, aligned
+	block_no wc_offset;			// offset of wc_blocks[0]
+	block_no wc_count;			// #blocks pending in wc_blocks
+
+	/* Stats.  These are updated atomically, as no single lock covers all
+	 * the places that update them.
+	 */
+	unsigned int nwrite;		// #blocks written by clients
+	unsigned int nwrite_sys;	// #write system calls
+	unsigned int ncombined;		// #writes absorbed by a pending write
 };
 
+static int disk_wc_flush(struct disk_state *ds);
+
 static int disk_nblocks(block_if bi){
 	struct disk_state *ds = bi->state;
 
 	return ds->nblocks;
 }
 
+/* Make sure the file has space allocated for the first nblocks blocks,
+ * growing the allocation in whole chunks.  The space is allocated beyond
+ * the end of the file so that the size of the file is not affected.
+ */
+static int disk_prealloc(struct disk_state *ds, block_no nblocks){
+	if (ds->prealloc == 0 || nblocks <= ds->allocated) {
+		return 0;
+	}
+	off_t target = ((off_t) nblocks + ds->prealloc - 1) / ds->prealloc * ds->prealloc;
+	if (fallocate(ds->fd, FALLOC_FL_KEEP_SIZE, ds->allocated * BLOCK_SIZE,
+							(target - ds->allocated) * BLOCK_SIZE) < 0) {
+		if (errno == EOPNOTSUPP || errno == ENOSYS) {
+			fprintf(stderr, "disk_prealloc: preallocation not supported\n");
+			ds->prealloc = 0;
+			return 0;
+		}
+		perror("disk_prealloc");
+		return -1;
+	}
+	ds->allocated = target;
+	return 0;
+}
+
 static int disk_setsize(block_if bi, block_no nblocks){
 	struct disk_state *ds = bi->state;
 
+	pthread_mutex_lock(&ds->wc_lock);
+	int result = disk_wc_flush(ds);
+	pthread_mutex_unlock(&ds->wc_lock);
+	if (result < 0) {
+		return -1;
+	}
+
+	if (disk_prealloc(ds, nblocks) < 0) {
+		return -1;
+	}
+
 	int before = ds->nblocks;
 	ds->nblocks = nblocks;
 	ftruncate(ds->fd, (off_t) nblocks * BLOCK_SIZE);
+
+	/* Truncating releases any space allocated beyond the new end.
+	 */
+	if (nblocks < ds->allocated) {
+		ds->allocated = nblocks;
+	}
 	return before;
 }
 
-static struct disk_state *disk_seek(block_if bi, block_no offset){
+static struct disk_state *disk_check(block_if bi, block_no offset, block_no count){
 	struct disk_state *ds = bi->state;
 
-	if (offset >= ds->nblocks) {
-		fprintf(stderr, "--> %u %u\n", offset, ds->nblocks);
-		panic("disk_seek: offset too large");
+	if (count > ds->nblocks || offset > ds->nblocks - count) {
+		fprintf(stderr, "--> %u %u %u\n", offset, count, ds->nblocks);
+		panic("disk_check: offset too large");
 	}
-	lseek(ds->fd, (off_t) offset * BLOCK_SIZE, SEEK_SET);
 	return ds;
 }
 
+/* Transfer 'size' bytes between 'buf' and the file at byte offset 'off'.
+ * This takes a single system call unless it is interrupted.  Any part
+ * of a read beyond the end of the file reads as null bytes.
+ */
+static int disk_xfer(struct disk_state *ds, int write, char *buf, size_t size, off_t off){
+	size_t done = 0;
+	ssize_t n;
+
+	while (done < size) {
+		if (write) {
+			__atomic_fetch_add(&ds->nwrite_sys, 1, __ATOMIC_RELAXED);
+			n = pwrite(ds->fd, buf + done, size - done, off + done);
+		}
+		else {
+			n = pread(ds->fd, buf + done, size - done, off + done);
+		}
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			/* The file system may accept O_DIRECT when opening the file
+			 * but then reject our block size or alignment.
+			 */
+			if (errno == EINVAL && ds->direct) {
+				fprintf(stderr, "disk: direct I/O rejected, using buffered I/O\n");
+				fcntl(ds->fd, F_SETFL, fcntl(ds->fd, F_GETFL) & ~O_DIRECT);
+				ds->direct = 0;
+				continue;
+			}
+			perror(write ? "disk_write" : "disk_read");
+			return -1;
+		}
+		if (n == 0) {
+			if (write) {
+				fprintf(stderr, "disk_write: wrote only %zu bytes\n", done);
+				return -1;
+			}
+			memset(buf + done, 0, size - done);
+			break;
+		}
+		done += n;
+	}
+	return 0;
+}
+
+/* Get an aligned buffer of DISK_BOUNCE_BLOCKS blocks from the pool.
+ */
+static block_t *disk_bounce_get(struct disk_state *ds){
+	void *buf;
+
+	pthread_mutex_lock(&ds->lock);
+	if (ds->nbounce > 0) {
+		buf = ds->bounce[--ds->nbounce];
+		pthread_mutex_unlock(&ds->lock);
+		return buf;
+	}
+	pthread_mutex_unlock(&ds->lock);
+	if (posix_memalign(&buf, DISK_ALIGN, DISK_BOUNCE_BLOCKS * BLOCK_SIZE) != 0) {
+		panic("disk_bounce_get");
+	}
+	return buf;
+}
+
+static void disk_bounce_put(struct disk_state *ds, block_t *buf){
+	pthread_mutex_lock(&ds->lock);
+	if (ds->nbounce < DISK_NBOUNCE) {
+		ds->bounce[ds->nbounce++] = buf;
+		buf = 0;
+	}
+	pthread_mutex_unlock(&ds->lock);
+	free(buf);
+}
+
+/* Read or write a range of blocks.  With direct I/O, the caller's buffer
+ * may not be suitably aligned, in which case the blocks are copied through
+ * aligned buffers from the pool.
+ */
+static int disk_io(struct disk_state *ds, int write, block_no offset, block_no count, block_t *blocks){
+	if (!ds->direct || (uintptr_t) blocks % DISK_ALIGN == 0) {
+		return disk_xfer(ds, write, (char *) blocks, (size_t) count * BLOCK_SIZE, (off_t) offset * BLOCK_SIZE);
+	}
+
+	block_t *buf = disk_bounce_get(ds);
+	block_no i, n;
+	int result = 0;
+	for (i = 0; i < count && result == 0; i += n) {
+		n = count - i < DISK_BOUNCE_BLOCKS ? count - i : DISK_BOUNCE_BLOCKS;
+		size_t size = (size_t) n * BLOCK_SIZE;
+		if (write) {
+			memcpy(buf, &blocks[i], size);
+		}
+		result = disk_xfer(ds, write, (char *) buf, size, (off_t) (offset + i) * BLOCK_SIZE);
+		if (!write && result == 0) {
+			memcpy(&blocks[i], buf, size);
+		}
+	}
+	disk_bounce_put(ds, buf);
+	return result;
+}
+
+static int disk_pread(struct disk_state *ds, block_no offset, block_no count, block_t *blocks){
+	return disk_io(ds, 0, offset, count, blocks);
+}
+
+static int disk_pwrite(struct disk_state *ds, block_no offset, block_no count, block_t *blocks){
+	return disk_io(ds, 1, offset, count, blocks);
+}
+
+/* Write out the pending combined write, if any.  The caller holds wc_lock.
+ */
+static int disk_wc_flush(struct disk_state *ds){
+	if (ds->wc_count == 0) {
+		return 0;
+	}
+	int result = disk_pwrite(ds, ds->wc_offset, ds->wc_count, ds->wc_blocks);
+	ds->wc_count = 0;
+	return result;
+}
+
+/* Write out the pending combined write if it overlaps the given range,
+ * so that the range can be accessed in the file itself.
+ */
+static int disk_wc_sync(struct disk_state *ds, block_no offset, block_no count){
+	int result = 0;
+
+	pthread_mutex_lock(&ds->wc_lock);
+	if (ds->wc_count != 0 && offset < ds->wc_offset + ds->wc_count &&
+										ds->wc_offset < offset + count) {
+		result = disk_wc_flush(ds);
+	}
+	pthread_mutex_unlock(&ds->wc_lock);
+	return result;
+}
+
+static int disk_readv(block_if bi, block_no offset, block_no count, block_t *blocks){
+	struct disk_state *ds = disk_check(bi, offset, count);
+
+	if (disk_wc_sync(ds, offset, count) < 0) {
+		return -1;
+	}
+	return disk_pread(ds, offset, count, blocks);
+}
+
+static int disk_writev(block_if bi, block_no offset, block_no count, block_t *blocks){
+	struct disk_state *ds = disk_check(bi, offset, count);
+
+	__atomic_fetch_add(&ds->nwrite, count, __ATOMIC_RELAXED);
+	if (disk_wc_sync(ds, offset, count) < 0) {
+		return -1;
+	}
+	return disk_pwrite(ds, offset, count, blocks);
+}
+
 static int disk_read(block_if bi, block_no offset, block_t *block){
-	struct disk_state *ds = disk_seek(bi, offset);
+	return disk_readv(bi, offset, 1, block);
+}
+
+/* Writes are combined with a pending write if they overwrite one of its
+ * blocks or extend it.  Otherwise the pending write is written out and
+ * this write becomes the new pending one.  Note that an error writing
+ * a pending write is reported by whatever operation writes it out.
+ */
+static int disk_write(block_if bi, block_no offset, block_t *block){
+	struct disk_state *ds = disk_check(bi, offset, 1);
+	int result = 0;
+
+	__atomic_fetch_add(&ds->nwrite, 1, __ATOMIC_RELAXED);
+	pthread_mutex_lock(&ds->wc_lock);
+	if (ds->wc_count != 0 && offset >= ds->wc_offset &&
+								offset - ds->wc_offset <= ds->wc_count &&
+								offset - ds->wc_offset < DISK_WC_BLOCKS) {
+		__atomic_fetch_add(&ds->ncombined, 1, __ATOMIC_RELAXED);
+	}
+	else {
+		result = disk_wc_flush(ds);
+		ds->wc_offset = offset;
+	}
+	block_no i = offset - ds->wc_offset;
+	memcpy(&ds->wc_blocks[i], block, BLOCK_SIZE);
+	if (i == ds->wc_count) {
+		ds->wc_count++;
+	}
+	if (ds->wc_count == DISK_WC_BLOCKS && disk_wc_flush(ds) < 0) {
+		result = -1;
+	}
+	pthread_mutex_unlock(&ds->wc_lock);
+	return result;
+}
+
+/* Punch a hole in the file so the host file system can reclaim the space.
+ * With preallocation on, the space is kept reserved instead: the range is
+ * zeroed with FALLOC_FL_ZERO_RANGE, which leaves it allocated, so that
+ * later writes still land in preallocated space.  Not all file systems
+ * support this, in which case the blocks are simply left as they are.
+ */
+static int disk_discard(block_if bi, block_no offset, block_no count){
+	struct disk_state *ds = bi->state;
 
-	int n = read(ds->fd, (void *) block, BLOCK_SIZE);
-	if (n < 0) {
-		perror("disk_read");
+	if (count > ds->nblocks || offset > ds->nblocks - count) {
+		fprintf(stderr, "disk_discard: range too large %u %u %u\n", offset, count, ds->nblocks);
 		return -1;
 	}
-	if (n < BLOCK_SIZE) {
-		memset((char *) block + n, 0, BLOCK_SIZE - n);
+	if (disk_wc_sync(ds, offset, count) < 0) {
+		return -1;
+	}
+	int mode = ds->prealloc != 0 ? FALLOC_FL_ZERO_RANGE : FALLOC_FL_PUNCH_HOLE;
+	if (fallocate(ds->fd, mode | FALLOC_FL_KEEP_SIZE,
+			(off_t) offset * BLOCK_SIZE, (off_t) count * BLOCK_SIZE) < 0 &&
+			errno != EOPNOTSUPP && errno != ENOSYS) {
+		perror("disk_discard");
+		return -1;
 	}
 	return 0;
 }
 
-static int disk_write(block_if bi, block_no offset, block_t *block){
-	struct disk_state *ds = disk_seek(bi, offset);
+static int disk_flush(block_if bi){
+	struct disk_state *ds = bi->state;
 
-	int n = write(ds->fd, (void *) block, BLOCK_SIZE);
-	if (n < 0) {
-		perror("disk_write");
+	pthread_mutex_lock(&ds->wc_lock);
+	int result = disk_wc_flush(ds);
+	pthread_mutex_unlock(&ds->wc_lock);
+	if (result < 0) {
 		return -1;
 	}
-	if (n != BLOCK_SIZE) {
-		fprintf(stderr, "disk_write: wrote only %d bytes\n", n);
+	if (fdatasync(ds->fd) < 0) {
+		perror("disk_flush");
+		return -1;
+	}
+	return 0;
+}
+
+static void *disk_worker(void *arg){
+	struct disk_state *ds = arg;
+	struct block_req *req;
+
+	pthread_mutex_lock(&ds->lock);
+	for (;;) {
+		while (ds->pending == 0 && !ds->stopping) {
+			pthread_cond_wait(&ds->work, &ds->lock);
+		}
+		if ((req = ds->pending) == 0) {
+			break;
+		}
+		if ((ds->pending = req->next) == 0) {
+			ds->pending_tail = &ds->pending;
+		}
+		pthread_mutex_unlock(&ds->lock);
+
+		if (req->op == BLOCK_READ) {
+			req->result = disk_pread(ds, req->offset, 1, req->block);
+		}
+		else {
+			req->result = disk_pwrite(ds, req->offset, 1, req->block);
+		}
+
+		pthread_mutex_lock(&ds->lock);
+		req->next = ds->completed;
+		ds->completed = req;
+		ds->busy--;
+		pthread_cond_broadcast(&ds->done);
+	}
+	pthread_mutex_unlock(&ds->lock);
+	return 0;
+}
+
+static int disk_submit(block_if bi, struct block_req *reqs, unsigned int nreqs){
+	struct disk_state *ds = bi->state;
+	unsigned int i;
+
+	/* The workers access the file directly, so write out the pending
+	 * combined write first.
+	 */
+	pthread_mutex_lock(&ds->wc_lock);
+	int result = disk_wc_flush(ds);
+	pthread_mutex_unlock(&ds->wc_lock);
+	if (result < 0) {
 		return -1;
 	}
+
+	pthread_mutex_lock(&ds->lock);
+	for (i = 0; i < nreqs; i++) {
+		struct block_req *req = &reqs[i];
+		if (req->offset >= ds->nblocks) {
+			fprintf(stderr, "disk_submit: offset too large %u %u\n", req->offset, ds->nblocks);
+			req->result = -1;
+			req->next = ds->completed;
+			ds->completed = req;
+			continue;
+		}
+		if (req->op == BLOCK_WRITE) {
+			__atomic_fetch_add(&ds->nwrite, 1, __ATOMIC_RELAXED);
+		}
+		req->next = 0;
+		*ds->pending_tail = req;
+		ds->pending_tail = &req->next;
+		ds->busy++;
+	}
+
+	/* Start another worker if there is more work than workers.
+	 */
+	while (ds->nworkers < DISK_NWORKERS && ds->nworkers < ds->busy) {
+		if (pthread_create(&ds->workers[ds->nworkers], 0, disk_worker, ds) != 0) {
+			if (ds->nworkers == 0) {
+				panic("disk_submit: can't start worker");
+			}
+			break;
+		}
+		ds->nworkers++;
+	}
+	pthread_cond_broadcast(&ds->work);
+	pthread_mutex_unlock(&ds->lock);
 	return 0;
 }
 
+static int disk_reap(block_if bi, struct block_req **done, unsigned int max, unsigned int min){
+	struct disk_state *ds = bi->state;
+	unsigned int n = 0;
+
+	pthread_mutex_lock(&ds->lock);
+	for (;;) {
+		while (n < max && ds->completed != 0) {
+			done[n++] = ds->completed;
+			ds->completed = ds->completed->next;
+		}
+		if (n >= min || n == max || ds->busy == 0) {
+			break;
+		}
+		pthread_cond_wait(&ds->done, &ds->lock);
+	}
+	pthread_mutex_unlock(&ds->lock);
+	return n;
+}
+
 static void disk_destroy(block_if bi){
 	struct disk_state *ds = bi->state;
+	unsigned int i;
+
+	pthread_mutex_lock(&ds->wc_lock);
+	disk_wc_flush(ds);
+	pthread_mutex_unlock(&ds->wc_lock);
+
+	/* The workers finish any pending requests before exiting.
+	 */
+	pthread_mutex_lock(&ds->lock);
+	ds->stopping = 1;
+	pthread_cond_broadcast(&ds->work);
+	pthread_mutex_unlock(&ds->lock);
+	for (i = 0; i < ds->nworkers; i++) {
+		pthread_join(ds->workers[i], 0);
+	}
+	pthread_mutex_destroy(&ds->lock);
+	pthread_cond_destroy(&ds->work);
+	pthread_cond_destroy(&ds->done);
+	while (ds->nbounce > 0) {
+		free(ds->bounce[--ds->nbounce]);
+	}
+	pthread_mutex_destroy(&ds->wc_lock);
+	free(ds->wc_blocks);
 
 	close(ds->fd);
 	free(ds);
 	free(bi);
 }
 
-block_if disk_init(char *file_name, block_no nblocks){
+static block_if disk_open(char *file_name, block_no nblocks, int direct){
 	struct disk_state *ds = calloc(1, sizeof(*ds));
 
-	ds->fd = open(file_name, O_RDWR | O_CREAT, 0600);
+	/* Not all file systems support O_DIRECT.
+	 */
+	if (direct) {
+		ds->fd = open(file_name, O_RDWR | O_CREAT | O_DIRECT, 0600);
+		if (ds->fd >= 0) {
+			ds->direct = 1;
+		}
+		else if (errno == EINVAL) {
+			fprintf(stderr, "%s: direct I/O not supported, using buffered I/O\n", file_name);
+			direct = 0;
+		}
+	}
+	if (!direct) {
+		ds->fd = open(file_name, O_RDWR | O_CREAT, 0600);
+	}
 	if (ds->fd < 0) {
 		perror(file_name);
 		panic("disk_init");
 	}
 	ds->nblocks = nblocks;
+	pthread_mutex_init(&ds->lock, 0);
+	pthread_cond_init(&ds->work, 0);
+	pthread_cond_init(&ds->done, 0);
+	ds->pending_tail = &ds->pending;
+	pthread_mutex_init(&ds->wc_lock, 0);
+	if (posix_memalign((void **) &ds->wc_blocks, DISK_ALIGN,
+								DISK_WC_BLOCKS * sizeof(block_t)) != 0) {
+		panic("disk_init");
+	}
 
 	block_if bi = calloc(1, sizeof(*bi));
 	bi->state = ds;
@@ -100,5 +570,37 @@ block_if disk_init(char *file_name, block_no nblocks){
 	bi->read = disk_read;
 	bi->write = disk_write;
 	bi->destroy = disk_destroy;
+	bi->readv = disk_readv;
+	bi->writev = disk_writev;
+	bi->submit = disk_submit;
+	bi->reap = disk_reap;
+	bi->discard = disk_discard;
+	bi->flush = disk_flush;
 	return bi;
 }
+
+/* Preallocate the space for the block store in chunks of the given number
+ * of blocks, now and whenever it grows.  A chunk of 0 disables this.
+ */
+int disk_set_prealloc(block_if bi, block_no chunk){
+	struct disk_state *ds = bi->state;
+
+	ds->prealloc = chunk;
+	return disk_prealloc(ds, ds->nblocks);
+}
+
+void disk_dump_stats(block_if bi){
+	struct disk_state *ds = bi->state;
+
+	printf("!$DISK: #write:     %u\n", ds->nwrite);
+	printf("!$DISK: #write sys: %u\n", ds->nwrite_sys);
+	printf("!$DISK: #combined:  %u\n", ds->ncombined);
+}
+
+block_if disk_init(char *file_name, block_no nblocks){
+	return disk_open(file_name, nblocks, 0);
+}
+
+block_if directdisk_init(char *file_name, block_no nblocks){
+	return disk_open(file_name, nblocks, 1);
+}
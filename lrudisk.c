@@ -0,0 +1,382 @@
+/* This block store module mirrors the underlying block store but contains
+ * a write-through cache.  The caching strategy is LRU (least recently
+ * used).  The interface is as follows:
+ *
+ *		block_if LRUdisk_init(block_if below,
+ *									block_t *blocks, block_no nblocks)
+ *			'below' is the underlying block store.  'blocks' points to
+ *			a chunk of memory wth 'nblocks' blocks for caching.
+ *
+ *		void LRUdisk_dump_stats(block_if bi)
+ *			Prints the cache statistics.
+ *
+ * The cache entries are kept on a doubly-linked list in order of use, with
+ * the most recently used entry at the front.  The links are indices into
+ * an array with an entry per cache block, and a block is found through a
+ * hash index (see blockmap.h), so hits, misses, and evictions all take
+ * constant time.  Unused entries are kept at the back of the list.
+ *
+ * Blocks may be pinned in the cache, giving the client read-only access
+ * to the cache entry itself.  A pinned entry is not evicted until it has
+ * been unpinned as many times as it was pinned.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "block_if.h"
+#include "blockmap.h"
+
+/* Per block in the cache we keep track of the following info:
+ */
+struct lru_info {
+	int valid;				// entry holds a block
+	block_no offset;		// block being cached if valid
+	unsigned int pins;		// #outstanding pins; entry may not be evicted
+	unsigned int prev;		// more recently used entry
+	unsigned int next;		// less recently used entry
+};
+
+/* State contains the pointer to the block module below as well as caching
+ * information and caching statistics.
+ */
+struct lrudisk_state {
+	block_if below;				// block store below
+	block_t *blocks;			// memory for caching blocks
+	block_no nblocks;			// size of cache (not size of block store!)
+	struct lru_info *info;		// info per block, plus list head at [nblocks]
+	struct blockmap map;		// offset to cache entry of cached blocks
+
+	/* Stats.
+	 */
+	unsigned int read_hit, read_miss, write_hit, write_miss;
+};
+
+static void lru_unlink(struct lrudisk_state *ls, unsigned int i){
+	struct lru_info *info = ls->info;
+
+	info[info[i].prev].next = info[i].next;
+	info[info[i].next].prev = info[i].prev;
+}
+
+/* Insert entry i after entry 'after' (the list head for the front).
+ */
+static void lru_link(struct lrudisk_state *ls, unsigned int i, unsigned int after){
+	struct lru_info *info = ls->info;
+
+	info[i].prev = after;
+	info[i].next = info[after].next;
+	info[info[after].next].prev = i;
+	info[after].next = i;
+}
+
+/* Entry i was just used.  Move it to the front of the list.
+ */
+static void cache_touch(struct lrudisk_state *ls, unsigned int i){
+	lru_unlink(ls, i);
+	lru_link(ls, i, ls->nblocks);
+}
+
+/* Drop the block in entry i from the cache, and move the entry to the back
+ * of the list so it is reused first.
+ */
+static void cache_drop(struct lrudisk_state *ls, unsigned int i){
+	blockmap_remove(&ls->map, ls->info[i].offset);
+	ls->info[i].valid = 0;
+	lru_unlink(ls, i);
+	lru_link(ls, i, ls->info[ls->nblocks].prev);
+}
+
+/* A block is about to be placed in the cache.  Take the least recently
+ * used entry that is not pinned and evict any block in it.  Returns the
+ * index of the entry, now at the front of the list, or -1 if all entries
+ * are pinned.  The caller adds the new block to the index.
+ */
+static int cache_alloc(struct lrudisk_state *ls){
+	unsigned int i;
+
+	for (i = ls->info[ls->nblocks].prev; i != ls->nblocks; i = ls->info[i].prev) {
+		if (ls->info[i].pins == 0) {
+			if (ls->info[i].valid) {
+				blockmap_remove(&ls->map, ls->info[i].offset);
+			}
+			ls->info[i].valid = 1;
+			cache_touch(ls, i);
+			return i;
+		}
+	}
+	return -1;
+}
+
+/* The given block was just used but it's not in the cache.  Stick it in
+ * the least recently used entry, if any.
+ */
+static void cache_update(struct lrudisk_state *ls, block_no offset, block_t *block){
+	int i = cache_alloc(ls);
+
+	if (i >= 0) {
+		ls->info[i].offset = offset;
+		blockmap_insert(&ls->map, offset, i);
+		memcpy(&ls->blocks[i], block, BLOCK_SIZE);
+	}
+}
+
+/* Return the index of the cache entry that holds the given block, or -1
+ * if the block is not in the cache.
+ */
+static int cache_lookup(struct lrudisk_state *ls, block_no offset){
+	return blockmap_lookup(&ls->map, offset);
+}
+
+/* Drop the cached copies of the 'count' blocks starting at offset.  If
+ * there are fewer such blocks than cache entries, look each one up in the
+ * index.  Otherwise it is cheaper to go through the cache entries.
+ */
+static void cache_invalidate(struct lrudisk_state *ls, block_no offset, block_no count){
+	block_no i;
+	int slot;
+
+	if (count < ls->nblocks) {
+		for (i = 0; i < count; i++) {
+			if ((slot = cache_lookup(ls, offset + i)) >= 0) {
+				cache_drop(ls, slot);
+			}
+		}
+		return;
+	}
+	for (i = 0; i < ls->nblocks; i++) {
+		if (ls->info[i].valid && ls->info[i].offset >= offset &&
+									ls->info[i].offset - offset < count) {
+			cache_drop(ls, i);
+		}
+	}
+}
+
+static int lrudisk_nblocks(block_if bi){
+	struct lrudisk_state *ls = bi->state;
+
+	return (*ls->below->nblocks)(ls->below);
+}
+
+/* The old size returned by the block store below tells which blocks are
+ * cut off, so they can be dropped from the cache.
+ */
+static int lrudisk_setsize(block_if bi, block_no nblocks){
+	struct lrudisk_state *ls = bi->state;
+
+	int before = (*ls->below->setsize)(ls->below, nblocks);
+	if (before > 0 && (block_no) before > nblocks) {
+		cache_invalidate(ls, nblocks, before - nblocks);
+	}
+	return before;
+}
+
+static int lrudisk_read(block_if bi, block_no offset, block_t *block){
+	struct lrudisk_state *ls = bi->state;
+
+	/* Check the cache first.
+	 */
+	int i = cache_lookup(ls, offset);
+	if (i >= 0) {
+		memcpy(block, &ls->blocks[i], BLOCK_SIZE);
+		cache_touch(ls, i);
+		ls->read_hit++;
+		return 0;
+	}
+
+	int r = (*ls->below->read)(ls->below, offset, block);
+	if (r >= 0) {
+		cache_update(ls, offset, block);
+		ls->read_miss++;
+	}
+	return r;
+}
+
+static int lrudisk_write(block_if bi, block_no offset, block_t *block){
+	struct lrudisk_state *ls = bi->state;
+
+	/* Check the cache first.  Even if it's in the cache, write to the
+	 * block store below because this implements a write-through cache.
+	 */
+	int i = cache_lookup(ls, offset);
+	if (i >= 0) {
+		memcpy(&ls->blocks[i], block, BLOCK_SIZE);
+		cache_touch(ls, i);
+		ls->write_hit++;
+		return (*ls->below->write)(ls->below, offset, block);
+	}
+
+	cache_update(ls, offset, block);
+	ls->write_miss++;
+	return (*ls->below->write)(ls->below, offset, block);
+}
+
+/* Read a range of blocks.  Blocks that are in the cache are copied from
+ * there, while each run of consecutive misses is read from the block
+ * store below using a single range read.
+ */
+static int lrudisk_readv(block_if bi, block_no offset, block_no count, block_t *blocks){
+	struct lrudisk_state *ls = bi->state;
+	block_no i = 0, j;
+	int slot;
+
+	while (i < count) {
+		if ((slot = cache_lookup(ls, offset + i)) >= 0) {
+			memcpy(&blocks[i], &ls->blocks[slot], BLOCK_SIZE);
+			cache_touch(ls, slot);
+			ls->read_hit++;
+			i++;
+			continue;
+		}
+
+		/* Find the end of the run of misses.
+		 */
+		for (j = i + 1; j < count; j++) {
+			if (cache_lookup(ls, offset + j) >= 0) {
+				break;
+			}
+		}
+		int r = block_readv(ls->below, offset + i, j - i, &blocks[i]);
+		if (r < 0) {
+			return r;
+		}
+		for (; i < j; i++) {
+			cache_update(ls, offset + i, &blocks[i]);
+			ls->read_miss++;
+		}
+	}
+	return 0;
+}
+
+/* Write a range of blocks.  Update the cache block by block, and then
+ * write the entire range through to the block store below.
+ */
+static int lrudisk_writev(block_if bi, block_no offset, block_no count, block_t *blocks){
+	struct lrudisk_state *ls = bi->state;
+	block_no i;
+	int slot;
+
+	for (i = 0; i < count; i++) {
+		if ((slot = cache_lookup(ls, offset + i)) >= 0) {
+			memcpy(&ls->blocks[slot], &blocks[i], BLOCK_SIZE);
+			cache_touch(ls, slot);
+			ls->write_hit++;
+		}
+		else {
+			cache_update(ls, offset + i, &blocks[i]);
+			ls->write_miss++;
+		}
+	}
+	return block_writev(ls->below, offset, count, blocks);
+}
+
+/* Pin the block at the given offset in the cache, reading it into a
+ * cache entry if necessary.
+ */
+static const block_t *lrudisk_pin(block_if bi, block_no offset){
+	struct lrudisk_state *ls = bi->state;
+
+	int i = cache_lookup(ls, offset);
+	if (i >= 0) {
+		cache_touch(ls, i);
+		ls->info[i].pins++;
+		ls->read_hit++;
+		return &ls->blocks[i];
+	}
+
+	if ((i = cache_alloc(ls)) < 0) {
+		return 0;
+	}
+	if ((*ls->below->read)(ls->below, offset, &ls->blocks[i]) < 0) {
+		ls->info[i].valid = 0;
+		lru_unlink(ls, i);
+		lru_link(ls, i, ls->info[ls->nblocks].prev);
+		return 0;
+	}
+	ls->info[i].offset = offset;
+	blockmap_insert(&ls->map, offset, i);
+	ls->info[i].pins++;
+	ls->read_miss++;
+	return &ls->blocks[i];
+}
+
+static void lrudisk_unpin(block_if bi, const block_t *block){
+	struct lrudisk_state *ls = bi->state;
+
+	ls->info[block - ls->blocks].pins--;
+}
+
+/* Drop any cached copies of the discarded blocks, making room for other
+ * blocks, and pass the discard on to the block store below.
+ */
+static int lrudisk_discard(block_if bi, block_no offset, block_no count){
+	struct lrudisk_state *ls = bi->state;
+
+	cache_invalidate(ls, offset, count);
+	return block_discard(ls->below, offset, count);
+}
+
+/* The cache is write-through, so there is nothing to write back.
+ */
+static int lrudisk_flush(block_if bi){
+	struct lrudisk_state *ls = bi->state;
+
+	return block_flush(ls->below);
+}
+
+static void lrudisk_destroy(block_if bi){
+	struct lrudisk_state *ls = bi->state;
+
+	blockmap_free(&ls->map);
+	free(ls->info);
+	free(ls);
+	free(bi);
+}
+
+void LRUdisk_dump_stats(block_if bi){
+	struct lrudisk_state *ls = bi->state;
+
+	printf("!$LRU: #read hits:    %u\n", ls->read_hit);
+	printf("!$LRU: #read misses:  %u\n", ls->read_miss);
+	printf("!$LRU: #write hits:   %u\n", ls->write_hit);
+	printf("!$LRU: #write misses: %u\n", ls->write_miss);
+}
+
+/* Create a new block store module on top of the specified module below.
+ * blocks points to a chunk of memory of nblocks blocks that can be used
+ * for caching.
+ */
+block_if LRUdisk_init(block_if below, block_t *blocks, block_no nblocks){
+	unsigned int i;
+
+	/* Create the block store state structure.  All entries start out
+	 * unused on the list.
+	 */
+	struct lrudisk_state *ls = calloc(1, sizeof(*ls));
+	ls->below = below;
+	ls->blocks = blocks;
+	ls->nblocks = nblocks;
+	ls->info = calloc(nblocks + 1, sizeof(*ls->info));
+	ls->info[nblocks].prev = ls->info[nblocks].next = nblocks;
+	for (i = 0; i < nblocks; i++) {
+		lru_link(ls, i, ls->info[nblocks].prev);
+	}
+	blockmap_init(&ls->map, nblocks);
+
+	/* Return a block interface to this inode.
+	 */
+	block_if bi = calloc(1, sizeof(*bi));
+	bi->state = ls;
+	bi->nblocks = lrudisk_nblocks;
+	bi->setsize = lrudisk_setsize;
+	bi->read = lrudisk_read;
+	bi->write = lrudisk_write;
+	bi->destroy = lrudisk_destroy;
+	bi->flush = lrudisk_flush;
+	bi->readv = lrudisk_readv;
+	bi->writev = lrudisk_writev;
+	bi->pin = lrudisk_pin;
+	bi->unpin = lrudisk_unpin;
+	bi->discard = lrudisk_discard;
+	return bi;
+}
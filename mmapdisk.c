@@ -0,0 +1,208 @@
+/* This code implements a block store on top of a file that is mapped into
+ * memory, so that reads and writes are simply memory copies and the host
+ * kernel takes care of paging and readahead:
+ *
+ *		block_if mmapdisk_init(char *file_name, block_no nblocks)
+ *			Create a new block store, stored in the file by the given
+ *			name and with the given number of blocks.  The file is grown
+ *			to hold nblocks blocks if necessary.
+ *
+ * Blocks may be pinned, giving direct access to the mapped file.  The
+ * size of the block store cannot be changed while blocks are pinned, as
+ * that may move the mapping.  Written blocks reach the file at the
+ * discretion of the kernel, or when the block store is flushed.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "block_if.h"
+
+struct mmapdisk_state {
+	block_no nblocks;			// #blocks in the block store
+	int fd;						// POSIX file descriptor of underlying file
+	block_t *blocks;			// the mapped file (null if nblocks == 0)
+	unsigned int pins;			// #outstanding pins
+};
+
+static int mmapdisk_nblocks(block_if bi){
+	struct mmapdisk_state *ms = bi->state;
+
+	return ms->nblocks;
+}
+
+/* Change the size of both the file and the mapping.  The mapping may move.
+ */
+static int mmapdisk_setsize(block_if bi, block_no nblocks){
+	struct mmapdisk_state *ms = bi->state;
+	size_t oldsize = (size_t) ms->nblocks * BLOCK_SIZE;
+	size_t newsize = (size_t) nblocks * BLOCK_SIZE;
+	void *p;
+
+	if (ms->pins != 0) {
+		fprintf(stderr, "mmapdisk_setsize: blocks are pinned\n");
+		return -1;
+	}
+	if (ftruncate(ms->fd, (off_t) newsize) < 0) {
+		perror("mmapdisk_setsize");
+		return -1;
+	}
+	if (nblocks == 0) {
+		p = 0;
+	}
+	else if (ms->nblocks == 0) {
+		p = mmap(0, newsize, PROT_READ | PROT_WRITE, MAP_SHARED, ms->fd, 0);
+	}
+	else {
+		p = mremap(ms->blocks, oldsize, newsize, MREMAP_MAYMOVE);
+	}
+	if (p == MAP_FAILED) {
+		perror("mmapdisk_setsize");
+		return -1;
+	}
+	if (nblocks == 0 && ms->nblocks != 0) {
+		munmap(ms->blocks, oldsize);
+	}
+
+	int before = ms->nblocks;
+	ms->blocks = p;
+	ms->nblocks = nblocks;
+	return before;
+}
+
+static int mmapdisk_readv(block_if bi, block_no offset, block_no count, block_t *blocks){
+	struct mmapdisk_state *ms = bi->state;
+
+	if (count > ms->nblocks || offset > ms->nblocks - count) {
+		fprintf(stderr, "mmapdisk_read: bad range %u %u\n", offset, count);
+		return -1;
+	}
+	memcpy(blocks, &ms->blocks[offset], (size_t) count * BLOCK_SIZE);
+	return 0;
+}
+
+static int mmapdisk_writev(block_if bi, block_no offset, block_no count, block_t *blocks){
+	struct mmapdisk_state *ms = bi->state;
+
+	if (count > ms->nblocks || offset > ms->nblocks - count) {
+		fprintf(stderr, "mmapdisk_write: bad range %u %u\n", offset, count);
+		return -1;
+	}
+	memcpy(&ms->blocks[offset], blocks, (size_t) count * BLOCK_SIZE);
+	return 0;
+}
+
+static int mmapdisk_read(block_if bi, block_no offset, block_t *block){
+	return mmapdisk_readv(bi, offset, 1, block);
+}
+
+static int mmapdisk_write(block_if bi, block_no offset, block_t *block){
+	return mmapdisk_writev(bi, offset, 1, block);
+}
+
+static const block_t *mmapdisk_pin(block_if bi, block_no offset){
+	struct mmapdisk_state *ms = bi->state;
+
+	if (offset >= ms->nblocks) {
+		fprintf(stderr, "mmapdisk_pin: bad offset %u\n", offset);
+		return 0;
+	}
+	ms->pins++;
+	return &ms->blocks[offset];
+}
+
+static void mmapdisk_unpin(block_if bi, const block_t *block){
+	struct mmapdisk_state *ms = bi->state;
+
+	ms->pins--;
+}
+
+/* Punch a hole in the file, which also drops the pages from the mapping.
+ */
+static int mmapdisk_discard(block_if bi, block_no offset, block_no count){
+	struct mmapdisk_state *ms = bi->state;
+
+	if (count > ms->nblocks || offset > ms->nblocks - count) {
+		fprintf(stderr, "mmapdisk_discard: bad range %u %u\n", offset, count);
+		return -1;
+	}
+	if (fallocate(ms->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			(off_t) offset * BLOCK_SIZE, (off_t) count * BLOCK_SIZE) < 0 &&
+			errno != EOPNOTSUPP && errno != ENOSYS) {
+		perror("mmapdisk_discard");
+		return -1;
+	}
+	return 0;
+}
+
+static int mmapdisk_flush(block_if bi){
+	struct mmapdisk_state *ms = bi->state;
+
+	if (ms->nblocks != 0 &&
+			msync(ms->blocks, (size_t) ms->nblocks * BLOCK_SIZE, MS_SYNC) < 0) {
+		perror("mmapdisk_flush");
+		return -1;
+	}
+	return 0;
+}
+
+static void mmapdisk_destroy(block_if bi){
+	struct mmapdisk_state *ms = bi->state;
+
+	if (ms->nblocks != 0) {
+		munmap(ms->blocks, (size_t) ms->nblocks * BLOCK_SIZE);
+	}
+	close(ms->fd);
+	free(ms);
+	free(bi);
+}
+
+block_if mmapdisk_init(char *file_name, block_no nblocks){
+	struct mmapdisk_state *ms = calloc(1, sizeof(*ms));
+	size_t size = (size_t) nblocks * BLOCK_SIZE;
+	struct stat st;
+
+	ms->fd = open(file_name, O_RDWR | O_CREAT, 0600);
+	if (ms->fd < 0) {
+		perror(file_name);
+		panic("mmapdisk_init");
+	}
+
+	/* Accessing the mapping beyond the end of the file is an error, so
+	 * make sure the file is large enough.
+	 */
+	if (fstat(ms->fd, &st) < 0 ||
+			(st.st_size < size && ftruncate(ms->fd, (off_t) size) < 0)) {
+		perror(file_name);
+		panic("mmapdisk_init");
+	}
+	if (nblocks != 0) {
+		ms->blocks = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, ms->fd, 0);
+		if (ms->blocks == MAP_FAILED) {
+			perror(file_name);
+			panic("mmapdisk_init");
+		}
+	}
+	ms->nblocks = nblocks;
+
+	block_if bi = calloc(1, sizeof(*bi));
+	bi->state = ms;
+	bi->nblocks = mmapdisk_nblocks;
+	bi->setsize = mmapdisk_setsize;
+	bi->read = mmapdisk_read;
+	bi->write = mmapdisk_write;
+	bi->destroy = mmapdisk_destroy;
+	bi->readv = mmapdisk_readv;
+	bi->writev = mmapdisk_writev;
+	bi->pin = mmapdisk_pin;
+	bi->unpin = mmapdisk_unpin;
+	bi->discard = mmapdisk_discard;
+	bi->flush = mmapdisk_flush;
+	return bi;
+}
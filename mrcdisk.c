@@ -0,0 +1,483 @@
+/* This block store module passes all operations on to the underlying
+ * block store, while estimating the miss ratio curve of the accesses:
+ * the miss ratio an LRU cache would have, for every cache size.  The
+ * interface is as follows:
+ *
+ *		block_if mrcdisk_init(block_if below, unsigned int max_samples)
+ *			'below' is the underlying block store.  At most
+ *			'max_samples' distinct blocks are tracked at a time.
+ *
+ *		void mrcdisk_dump_stats(block_if bi)
+ *			Prints the estimated miss ratio curve.
+ *
+ * The estimate uses SHARDS (Waldspurger et al., FAST 2015).  A block is
+ * sampled if a hash of its number is below a threshold T, so that either
+ * all accesses to a block are sampled or none are, and the sampling rate
+ * is R = T / MRC_P.  For each access to a sampled block, the reuse
+ * distance is the number of distinct sampled blocks accessed since the
+ * previous access to it; divided by R, that estimates the LRU stack
+ * distance of the access.  An access hits in an LRU cache of C blocks
+ * if its stack distance is less than C.
+ *
+ * The last access time of each tracked block is kept in a treap ordered
+ * by time, where each node knows the size of its subtree, so the reuse
+ * distance is the number of nodes with a later time.  To bound memory,
+ * T starts at MRC_P (sample everything), and when more than max_samples
+ * blocks are tracked, T is lowered to the largest hash of a tracked block
+ * (kept in a heap) and the blocks at or above it are dropped.  The counts
+ * gathered so far are scaled down to the new rate.  The difference
+ * between the expected and actual number of sampled accesses is counted
+ * as hits, as in SHARDS_adj.
+ *
+ * Distances are counted in a histogram with MRC_EXACT exact buckets,
+ * followed by MRC_SUB buckets per power of two.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "block_if.h"
+#include "blockmap.h"
+
+#define MRC_P			(1u << 24)		// range of the sampling hash
+#define MRC_EXACT		64				// #buckets of width 1
+#define MRC_SUB			16				// #buckets per power of two after that
+#define MRC_NBUCKETS	(MRC_EXACT + 27 * MRC_SUB)
+#define MRC_NIL			((unsigned int) -1)
+
+struct mrc_node {
+	block_no offset;			// block number
+	uint32_t hash;				// sampling hash of offset
+	unsigned long long time;	// time of the last access
+	unsigned int left, right;	// children in the treap
+	unsigned int prio;			// treap priority
+	unsigned int size;			// #nodes in this subtree
+	unsigned int heap;			// position in the heap
+};
+
+struct mrcdisk_state {
+	block_if below;				// block store below
+	unsigned int max_samples;	// max #blocks tracked
+	struct mrc_node *nodes;		// max_samples + 1 nodes
+	unsigned int *free;			// stack of free nodes
+	unsigned int nfree;			// #free nodes
+	unsigned int *heap;			// max-heap of tracked nodes by hash
+	unsigned int ntracked;		// #tracked blocks (size of heap)
+	unsigned int root;			// root of the treap
+	struct blockmap map;		// offset -> node
+	uint32_t threshold;			// sample if hash < threshold
+	unsigned long long clock;	// #sampled accesses, used as time
+	unsigned int seed;			// for treap priorities
+
+	/* Stats, in units of sampled accesses at the current rate.
+	 */
+	unsigned long long naccess;	// #accesses, sampled or not
+	double nsampled;			// #sampled accesses
+	double ncold;				// #sampled accesses to untracked blocks
+	double hist[MRC_NBUCKETS];	// #sampled accesses by stack distance
+};
+
+static uint32_t mrc_hash(block_no offset){
+	uint64_t h = (uint64_t) offset * 0x9E3779B97F4A7C15ull;
+
+	h ^= h >> 31;
+	h *= 0xBF58476D1CE4E5B9ull;
+	h ^= h >> 29;
+	return (uint32_t) h & (MRC_P - 1);
+}
+
+/* Map a stack distance to its histogram bucket.
+ */
+static unsigned int mrc_bucket(unsigned long long d){
+	unsigned int e = 0;
+
+	if (d < MRC_EXACT) {
+		return d;
+	}
+	while ((d >> e) >= 2) {
+		e++;
+	}
+	if (e >= 6 + 27) {
+		return MRC_NBUCKETS - 1;
+	}
+	return MRC_EXACT + (e - 6) * MRC_SUB + ((d >> (e - 4)) & (MRC_SUB - 1));
+}
+
+/* The smallest stack distance in the given bucket.
+ */
+static unsigned long long mrc_bucket_start(unsigned int b){
+	if (b < MRC_EXACT) {
+		return b;
+	}
+	unsigned int e = 6 + (b - MRC_EXACT) / MRC_SUB;
+	return (unsigned long long) (MRC_SUB + (b - MRC_EXACT) % MRC_SUB) << (e - 4);
+}
+
+/* Treap operations.  Nodes are ordered by time.
+ */
+static unsigned int mrc_size(struct mrcdisk_state *ms, unsigned int t){
+	return t == MRC_NIL ? 0 : ms->nodes[t].size;
+}
+
+static void mrc_fix(struct mrcdisk_state *ms, unsigned int t){
+	struct mrc_node *n = &ms->nodes[t];
+
+	n->size = 1 + mrc_size(ms, n->left) + mrc_size(ms, n->right);
+}
+
+/* Split treap t into the nodes with time <= key (*l) and the rest (*r).
+ */
+static void mrc_split(struct mrcdisk_state *ms, unsigned int t, unsigned long long key,
+										unsigned int *l, unsigned int *r){
+	if (t == MRC_NIL) {
+		*l = *r = MRC_NIL;
+	}
+	else if (ms->nodes[t].time <= key) {
+		mrc_split(ms, ms->nodes[t].right, key, &ms->nodes[t].right, r);
+		*l = t;
+		mrc_fix(ms, t);
+	}
+	else {
+		mrc_split(ms, ms->nodes[t].left, key, l, &ms->nodes[t].left);
+		*r = t;
+		mrc_fix(ms, t);
+	}
+}
+
+/* Join treaps l and r, where all nodes in l are older than those in r.
+ */
+static unsigned int mrc_merge(struct mrcdisk_state *ms, unsigned int l, unsigned int r){
+	if (l == MRC_NIL) {
+		return r;
+	}
+	if (r == MRC_NIL) {
+		return l;
+	}
+	if (ms->nodes[l].prio > ms->nodes[r].prio) {
+		ms->nodes[l].right = mrc_merge(ms, ms->nodes[l].right, r);
+		mrc_fix(ms, l);
+		return l;
+	}
+	ms->nodes[r].left = mrc_merge(ms, l, ms->nodes[r].left);
+	mrc_fix(ms, r);
+	return r;
+}
+
+static void mrc_remove(struct mrcdisk_state *ms, unsigned int i){
+	unsigned int l, m, r;
+
+	mrc_split(ms, ms->root, ms->nodes[i].time, &l, &r);
+	mrc_split(ms, l, ms->nodes[i].time - 1, &l, &m);
+	ms->root = mrc_merge(ms, l, r);
+}
+
+/* Add node i, which must be the most recently accessed one.
+ */
+static void mrc_append(struct mrcdisk_state *ms, unsigned int i){
+	struct mrc_node *n = &ms->nodes[i];
+
+	n->left = n->right = MRC_NIL;
+	n->size = 1;
+	ms->seed = ms->seed * 1103515245 + 12345;
+	n->prio = ms->seed;
+	ms->root = mrc_merge(ms, ms->root, i);
+}
+
+/* Count the nodes accessed after the given time.
+ */
+static unsigned int mrc_count_after(struct mrcdisk_state *ms, unsigned long long time){
+	unsigned int t = ms->root, count = 0;
+
+	while (t != MRC_NIL) {
+		if (ms->nodes[t].time > time) {
+			count += 1 + mrc_size(ms, ms->nodes[t].right);
+			t = ms->nodes[t].left;
+		}
+		else {
+			t = ms->nodes[t].right;
+		}
+	}
+	return count;
+}
+
+/* Heap operations.  The heap holds the tracked nodes, largest hash first.
+ */
+static void mrc_heap_set(struct mrcdisk_state *ms, unsigned int pos, unsigned int i){
+	ms->heap[pos] = i;
+	ms->nodes[i].heap = pos;
+}
+
+static void mrc_heap_up(struct mrcdisk_state *ms, unsigned int pos){
+	unsigned int i = ms->heap[pos];
+
+	while (pos > 0 && ms->nodes[ms->heap[(pos - 1) / 2]].hash < ms->nodes[i].hash) {
+		mrc_heap_set(ms, pos, ms->heap[(pos - 1) / 2]);
+		pos = (pos - 1) / 2;
+	}
+	mrc_heap_set(ms, pos, i);
+}
+
+static void mrc_heap_down(struct mrcdisk_state *ms, unsigned int pos){
+	unsigned int i = ms->heap[pos], child;
+
+	while ((child = 2 * pos + 1) < ms->ntracked) {
+		if (child + 1 < ms->ntracked &&
+				ms->nodes[ms->heap[child + 1]].hash > ms->nodes[ms->heap[child]].hash) {
+			child++;
+		}
+		if (ms->nodes[ms->heap[child]].hash <= ms->nodes[i].hash) {
+			break;
+		}
+		mrc_heap_set(ms, pos, ms->heap[child]);
+		pos = child;
+	}
+	mrc_heap_set(ms, pos, i);
+}
+
+/* Stop tracking the block with the largest hash.
+ */
+static void mrc_drop_max(struct mrcdisk_state *ms){
+	unsigned int i = ms->heap[0];
+
+	mrc_remove(ms, i);
+	blockmap_remove(&ms->map, ms->nodes[i].offset);
+	if (--ms->ntracked > 0) {
+		mrc_heap_set(ms, 0, ms->heap[ms->ntracked]);
+		mrc_heap_down(ms, 0);
+	}
+	ms->free[ms->nfree++] = i;
+}
+
+/* Lower the sampling threshold until at most max_samples blocks are
+ * tracked, and scale the counts to the new rate.
+ */
+static void mrc_lower(struct mrcdisk_state *ms){
+	uint32_t threshold = ms->nodes[ms->heap[0]].hash;
+	double scale = (double) threshold / ms->threshold;
+	unsigned int b;
+
+	while (ms->ntracked > 0 && ms->nodes[ms->heap[0]].hash >= threshold) {
+		mrc_drop_max(ms);
+	}
+	for (b = 0; b < MRC_NBUCKETS; b++) {
+		ms->hist[b] *= scale;
+	}
+	ms->nsampled *= scale;
+	ms->ncold *= scale;
+	ms->threshold = threshold;
+}
+
+/* Record an access to the given block.
+ */
+static void mrc_access(struct mrcdisk_state *ms, block_no offset){
+	uint32_t hash = mrc_hash(offset);
+	int i;
+
+	ms->naccess++;
+	if (hash >= ms->threshold) {
+		return;
+	}
+	ms->nsampled++;
+	ms->clock++;
+
+	if ((i = blockmap_lookup(&ms->map, offset)) >= 0) {
+		unsigned int d = mrc_count_after(ms, ms->nodes[i].time);
+		ms->hist[mrc_bucket((unsigned long long) d * MRC_P / ms->threshold)]++;
+		mrc_remove(ms, i);
+		ms->nodes[i].time = ms->clock;
+		mrc_append(ms, i);
+		return;
+	}
+
+	ms->ncold++;
+	i = ms->free[--ms->nfree];
+	ms->nodes[i].offset = offset;
+	ms->nodes[i].hash = hash;
+	ms->nodes[i].time = ms->clock;
+	mrc_append(ms, i);
+	blockmap_insert(&ms->map, offset, i);
+	ms->heap[ms->ntracked] = i;
+	mrc_heap_up(ms, ms->ntracked++);
+	if (ms->ntracked > ms->max_samples) {
+		mrc_lower(ms);
+	}
+}
+
+static int mrcdisk_nblocks(block_if bi){
+	struct mrcdisk_state *ms = bi->state;
+
+	return (*ms->below->nblocks)(ms->below);
+}
+
+static int mrcdisk_setsize(block_if bi, block_no nblocks){
+	struct mrcdisk_state *ms = bi->state;
+
+	return (*ms->below->setsize)(ms->below, nblocks);
+}
+
+static int mrcdisk_read(block_if bi, block_no offset, block_t *block){
+	struct mrcdisk_state *ms = bi->state;
+
+	mrc_access(ms, offset);
+	return (*ms->below->read)(ms->below, offset, block);
+}
+
+static int mrcdisk_write(block_if bi, block_no offset, block_t *block){
+	struct mrcdisk_state *ms = bi->state;
+
+	mrc_access(ms, offset);
+	return (*ms->below->write)(ms->below, offset, block);
+}
+
+static int mrcdisk_readv(block_if bi, block_no offset, block_no count, block_t *blocks){
+	struct mrcdisk_state *ms = bi->state;
+	block_no i;
+
+	for (i = 0; i < count; i++) {
+		mrc_access(ms, offset + i);
+	}
+	return block_readv(ms->below, offset, count, blocks);
+}
+
+static int mrcdisk_writev(block_if bi, block_no offset, block_no count, block_t *blocks){
+	struct mrcdisk_state *ms = bi->state;
+	block_no i;
+
+	for (i = 0; i < count; i++) {
+		mrc_access(ms, offset + i);
+	}
+	return block_writev(ms->below, offset, count, blocks);
+}
+
+/* Pins are passed on, so the block store below may still hand out its
+ * own memory.  A block that cannot be pinned below is read into scratch
+ * memory by block_pin, and that read is counted as well.
+ */
+static const block_t *mrcdisk_pin(block_if bi, block_no offset){
+	struct mrcdisk_state *ms = bi->state;
+	const block_t *block;
+
+	if (ms->below->pin == 0 || (block = (*ms->below->pin)(ms->below, offset)) == 0) {
+		return 0;
+	}
+	mrc_access(ms, offset);
+	return block;
+}
+
+static void mrcdisk_unpin(block_if bi, const block_t *block){
+	struct mrcdisk_state *ms = bi->state;
+
+	if (ms->below->unpin != 0) {
+		(*ms->below->unpin)(ms->below, block);
+	}
+}
+
+static int mrcdisk_discard(block_if bi, block_no offset, block_no count){
+	struct mrcdisk_state *ms = bi->state;
+
+	return block_discard(ms->below, offset, count);
+}
+
+static int mrcdisk_flush(block_if bi){
+	struct mrcdisk_state *ms = bi->state;
+
+	return block_flush(ms->below);
+}
+
+static void mrcdisk_hint(block_if bi, block_no offset, enum block_class cls){
+	struct mrcdisk_state *ms = bi->state;
+
+	block_hint(ms->below, offset, cls);
+}
+
+static void mrcdisk_destroy(block_if bi){
+	struct mrcdisk_state *ms = bi->state;
+
+	blockmap_free(&ms->map);
+	free(ms->nodes);
+	free(ms->free);
+	free(ms->heap);
+	free(ms);
+	free(bi);
+}
+
+/* Print the miss ratio for the cache sizes at the bucket boundaries, up to
+ * the largest distance seen.
+ */
+void mrcdisk_dump_stats(block_if bi){
+	struct mrcdisk_state *ms = bi->state;
+	double expected = (double) ms->naccess * ms->threshold / MRC_P;
+	double hits = 0;
+	unsigned int b, last = 0;
+
+	printf("!$MRC: #accesses:      %llu\n", ms->naccess);
+	printf("!$MRC: #sampled:       %.0f\n", ms->nsampled);
+	printf("!$MRC: sampling rate:  %.6f\n", (double) ms->threshold / MRC_P);
+	printf("!$MRC: #tracked:       %u\n", ms->ntracked);
+	if (expected == 0) {
+		return;
+	}
+	for (b = 0; b < MRC_NBUCKETS; b++) {
+		if (ms->hist[b] > 0) {
+			last = b;
+		}
+	}
+	for (b = 0; b <= last; b++) {
+		hits += ms->hist[b];
+		double ratio = (ms->nsampled - hits) / expected;
+		if (ratio < 0) {
+			ratio = 0;
+		}
+		printf("!$MRC: cache size %10llu: miss ratio %.4f\n",
+						mrc_bucket_start(b + 1), ratio > 1 ? 1 : ratio);
+	}
+}
+
+/* Create a new block store module on top of the specified module below.
+ * Memory use is proportional to max_samples.
+ */
+block_if mrcdisk_init(block_if below, unsigned int max_samples){
+	unsigned int i;
+
+	if (max_samples == 0) {
+		max_samples = 1;
+	}
+
+	/* Create the block store state structure.
+	 */
+	struct mrcdisk_state *ms = calloc(1, sizeof(*ms));
+	ms->below = below;
+	ms->max_samples = max_samples;
+	ms->nodes = calloc(max_samples + 1, sizeof(*ms->nodes));
+	ms->free = calloc(max_samples + 1, sizeof(*ms->free));
+	ms->heap = calloc(max_samples + 1, sizeof(*ms->heap));
+	if (ms->nodes == 0 || ms->free == 0 || ms->heap == 0) {
+		panic("mrcdisk_init");
+	}
+	for (i = 0; i <= max_samples; i++) {
+		ms->free[ms->nfree++] = max_samples - i;
+	}
+	ms->root = MRC_NIL;
+	blockmap_init(&ms->map, max_samples + 1);
+	ms->threshold = MRC_P;
+	ms->seed = 1;
+
+	/* Return a block interface to this inode.
+	 */
+	block_if bi = calloc(1, sizeof(*bi));
+	bi->state = ms;
+	bi->nblocks = mrcdisk_nblocks;
+	bi->setsize = mrcdisk_setsize;
+	bi->read = mrcdisk_read;
+	bi->write = mrcdisk_write;
+	bi->destroy = mrcdisk_destroy;
+	bi->flush = mrcdisk_flush;
+	bi->readv = mrcdisk_readv;
+	bi->writev = mrcdisk_writev;
+	bi->pin = mrcdisk_pin;
+	bi->unpin = mrcdisk_unpin;
+	bi->discard = mrcdisk_discard;
+	bi->hint = mrcdisk_hint;
+	return bi;
+}
@@ -56,6 +56,60 @@ static int partdisk_write(block_if bi, block_no offset, block_t *block){
 	return (*ps->below->write)(ps->below, ps->delta + offset, block);
 }
 
+static int partdisk_readv(block_if bi, block_no offset, block_no count, block_t *blocks){
+	struct partdisk_state *ps = bi->state;
+
+	if (count > ps->nblocks || offset > ps->nblocks - count) {
+		fprintf(stderr, "partdisk_readv: range too large\n");
+		return -1;
+	}
+	return block_readv(ps->below, ps->delta + offset, count, blocks);
+}
+
+static int partdisk_writev(block_if bi, block_no offset, block_no count, block_t *blocks){
+	struct partdisk_state *ps = bi->state;
+
+	if (count > ps->nblocks || offset > ps->nblocks - count) {
+		fprintf(stderr, "partdisk_writev: range too large\n");
+		return -1;
+	}
+	return block_writev(ps->below, ps->delta + offset, count, blocks);
+}
+
+static const block_t *partdisk_pin(block_if bi, block_no offset){
+	struct partdisk_state *ps = bi->state;
+
+	if (offset >= ps->nblocks) {
+		fprintf(stderr, "partdisk_pin: offset too large\n");
+		return 0;
+	}
+	return (*ps->below->pin)(ps->below, ps->delta + offset);
+}
+
+static void partdisk_unpin(block_if bi, const block_t *block){
+	struct partdisk_state *ps = bi->state;
+
+	if (ps->below->unpin != 0) {
+		(*ps->below->unpin)(ps->below, block);
+	}
+}
+
+static int partdisk_discard(block_if bi, block_no offset, block_no count){
+	struct partdisk_state *ps = bi->state;
+
+	if (count > ps->nblocks || offset > ps->nblocks - count) {
+		fprintf(stderr, "partdisk_discard: range too large\n");
+		return -1;
+	}
+	return block_discard(ps->below, ps->delta + offset, count);
+}
+
+static int partdisk_flush(block_if bi){
+	struct partdisk_state *ps = bi->state;
+
+	return block_flush(ps->below);
+}
+
 static void partdisk_destroy(block_if bi){
 	free(bi->state);
 	free(bi);
@@ -78,5 +132,13 @@ block_if partdisk_init(block_if below, block_no delta, block_no nblocks){
 	bi->read = partdisk_read;
 	bi->write = partdisk_write;
 	bi->destroy = partdisk_destroy;
+	bi->flush = partdisk_flush;
+	bi->readv = partdisk_readv;
+	bi->writev = partdisk_writev;
+	bi->discard = partdisk_discard;
+	if (below->pin != 0) {
+		bi->pin = partdisk_pin;
+		bi->unpin = partdisk_unpin;
+	}
 	return bi;
 }
@@ -0,0 +1,411 @@
+/* This block store module mirrors the underlying block store but reads
+ * ahead when it sees blocks being read in sequence.  The interface is as
+ * follows:
+ *
+ *		block_if radisk_init(block_if below, block_t *blocks, block_no nblocks)
+ *			'below' is the underlying block store.  'blocks' points to
+ *			a chunk of memory with 'nblocks' blocks to hold blocks that
+ *			were read ahead.
+ *
+ *		void radisk_dump_stats(block_if bi)
+ *			Prints the readahead statistics.
+ *
+ * Up to RA_NSTREAMS sequential streams are followed at once, so reads of
+ * several files (or several regions of one store) that are interleaved
+ * are each recognized.  A read that continues where a stream left off
+ * extends that stream; any other read starts a new stream, replacing
+ * the stream that was used least recently.
+ *
+ * A stream does not read ahead until its second read.  From then on,
+ * whenever fewer than half a window of blocks are left ahead of the
+ * reader, the next window of blocks is read with a single range read
+ * (readv).  The window starts at RA_MIN blocks and doubles with every
+ * readahead, up to RA_MAX blocks (or half the buffer).  When a block that
+ * was read ahead is evicted from the buffer before it was used, the
+ * window of its stream is halved.
+ *
+ * The buffer is replaced in FIFO order.  Writes update the copy in the
+ * buffer, if any, and are passed through.  A block read ahead that gets
+ * used counts as useful; one that is evicted or discarded unused counts
+ * as wasted.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "block_if.h"
+#include "blockmap.h"
+
+#define RA_NSTREAMS		16			// #streams followed at once
+#define RA_MIN			4			// initial window, in blocks
+#define RA_MAX			64			// max window, in blocks
+
+struct ra_info {
+	enum { RI_EMPTY, RI_AHEAD, RI_USED } status;
+	block_no offset;
+	unsigned int stream;		// stream that read it ahead
+	unsigned int gen;			// generation of that stream
+};
+
+struct ra_stream {
+	block_no next;				// where the next read is expected
+	block_no ahead;				// end of the blocks read ahead
+	unsigned int window;		// #blocks to read ahead
+	unsigned int gen;			// incremented when the stream is reused
+	int active;					// has read ahead any blocks
+	unsigned long last_use;		// for LRU replacement of streams
+};
+
+struct radisk_state {
+	block_if below;				// block store below
+	block_t *blocks;			// buffer of blocks read ahead
+	block_no nblocks;			// #blocks in the buffer
+	struct ra_info *binfo;		// information about each buffered block
+	struct blockmap map;		// offset -> entry
+	unsigned int hand;			// next entry to replace
+	unsigned int max_window;	// max window size
+	struct ra_stream streams[RA_NSTREAMS];
+	unsigned long clock;		// #reads, used as time
+
+	/* Stats.
+	 */
+	unsigned int nread;			// #blocks read by the client
+	unsigned int nstream;		// #streams that started reading ahead
+	unsigned int nahead;		// #range reads issued to read ahead
+	unsigned int nprefetch;		// #blocks read ahead
+	unsigned int nuseful;		// #blocks read ahead and then used
+	unsigned int nwasted;		// #blocks read ahead and never used
+};
+
+/* Empty entry i.  A block that was read ahead but not used is wasted,
+ * and its stream reads less far ahead from now on.
+ */
+static void ra_drop(struct radisk_state *rs, unsigned int i){
+	struct ra_info *info = &rs->binfo[i];
+
+	if (info->status == RI_AHEAD) {
+		struct ra_stream *s = &rs->streams[info->stream];
+
+		rs->nwasted++;
+		if (s->gen == info->gen && s->window > RA_MIN) {
+			s->window /= 2;
+		}
+	}
+	if (info->status != RI_EMPTY) {
+		blockmap_remove(&rs->map, info->offset);
+		info->status = RI_EMPTY;
+	}
+}
+
+/* Drop buffered blocks in [offset, offset + count).
+ */
+static void ra_invalidate(struct radisk_state *rs, block_no offset, block_no count){
+	block_no i;
+	int slot;
+
+	if (count < rs->nblocks) {
+		for (i = 0; i < count; i++) {
+			if ((slot = blockmap_lookup(&rs->map, offset + i)) >= 0) {
+				ra_drop(rs, slot);
+			}
+		}
+		return;
+	}
+	for (i = 0; i < rs->nblocks; i++) {
+		if (rs->binfo[i].status != RI_EMPTY && rs->binfo[i].offset >= offset &&
+									rs->binfo[i].offset - offset < count) {
+			ra_drop(rs, i);
+		}
+	}
+}
+
+/* Read blocks [start, end) for stream s, skipping the ones that are
+ * buffered already.  Blocks before 'ahead' are about to be read by the
+ * client, so only the blocks in [ahead, end) count as read ahead.
+ */
+static void ra_fill(struct radisk_state *rs, struct ra_stream *s,
+							block_no start, block_no end, block_no ahead){
+	block_t tmp[RA_MAX];
+	block_no offset, j;
+	int size = -1;
+
+	for (offset = start; offset < end; offset = j) {
+		if (blockmap_lookup(&rs->map, offset) >= 0) {
+			j = offset + 1;
+			continue;
+		}
+
+		/* Don't read past the end of the block store below.
+		 */
+		if (size < 0) {
+			if ((size = (*rs->below->nblocks)(rs->below)) < 0) {
+				return;
+			}
+			if (end > (block_no) size) {
+				end = size;
+			}
+			if (offset >= end) {
+				return;
+			}
+		}
+		for (j = offset + 1; j < end && j - offset < RA_MAX; j++) {
+			if (blockmap_lookup(&rs->map, j) >= 0) {
+				break;
+			}
+		}
+		if (block_readv(rs->below, offset, j - offset, tmp) < 0) {
+			return;
+		}
+		rs->nahead++;
+
+		block_no k;
+		for (k = offset; k < j; k++) {
+			unsigned int i = rs->hand;
+
+			rs->hand = (rs->hand + 1) % rs->nblocks;
+			ra_drop(rs, i);
+			memcpy(&rs->blocks[i], &tmp[k - offset], BLOCK_SIZE);
+			rs->binfo[i].offset = k;
+			rs->binfo[i].stream = s - rs->streams;
+			rs->binfo[i].gen = s->gen;
+			if (k >= ahead) {
+				rs->binfo[i].status = RI_AHEAD;
+				rs->nprefetch++;
+			}
+			else {
+				rs->binfo[i].status = RI_USED;
+			}
+			blockmap_insert(&rs->map, k, i);
+		}
+	}
+}
+
+/* The client is about to read blocks [offset, offset + count).  Find the
+ * stream this read belongs to, or start a new one, and read ahead if the
+ * stream is running out of blocks.  If the read itself is no larger than
+ * the window, it is included in the same range read.
+ */
+static void ra_access(struct radisk_state *rs, block_no offset, block_no count){
+	struct ra_stream *s, *lru = &rs->streams[0];
+	unsigned int i;
+
+	rs->clock++;
+	for (i = 0; i < RA_NSTREAMS; i++) {
+		s = &rs->streams[i];
+		if (s->last_use != 0 && s->next == offset) {
+			break;
+		}
+		if (s->last_use < lru->last_use) {
+			lru = s;
+		}
+	}
+	if (i == RA_NSTREAMS) {
+		lru->next = offset + count;
+		lru->ahead = offset + count;
+		lru->window = RA_MIN;
+		lru->gen++;
+		lru->active = 0;
+		lru->last_use = rs->clock;
+		return;
+	}
+
+	s->next = offset + count;
+	s->last_use = rs->clock;
+	if (s->ahead < s->next + s->window / 2) {
+		block_no start = count <= s->window ? offset : s->next;
+
+		if (start < s->ahead) {
+			start = s->ahead;
+		}
+		unsigned int before = rs->nprefetch;
+		s->ahead = s->next + s->window;
+		ra_fill(rs, s, start, s->ahead, s->next);
+		if (!s->active && rs->nprefetch != before) {
+			s->active = 1;
+			rs->nstream++;
+		}
+		if (s->window < rs->max_window) {
+			s->window *= 2;
+			if (s->window > rs->max_window) {
+				s->window = rs->max_window;
+			}
+		}
+	}
+}
+
+/* Copy a buffered block, if it's there.
+ */
+static int ra_lookup(struct radisk_state *rs, block_no offset, block_t *block){
+	int i = blockmap_lookup(&rs->map, offset);
+
+	if (i < 0) {
+		return 0;
+	}
+	if (rs->binfo[i].status == RI_AHEAD) {
+		rs->binfo[i].status = RI_USED;
+		rs->nuseful++;
+	}
+	memcpy(block, &rs->blocks[i], BLOCK_SIZE);
+	return 1;
+}
+
+static int radisk_nblocks(block_if bi){
+	struct radisk_state *rs = bi->state;
+
+	return (*rs->below->nblocks)(rs->below);
+}
+
+static int radisk_setsize(block_if bi, block_no nblocks){
+	struct radisk_state *rs = bi->state;
+
+	int before = (*rs->below->setsize)(rs->below, nblocks);
+	if (before > 0 && (block_no) before > nblocks) {
+		ra_invalidate(rs, nblocks, before - nblocks);
+	}
+	return before;
+}
+
+static int radisk_read(block_if bi, block_no offset, block_t *block){
+	struct radisk_state *rs = bi->state;
+
+	ra_access(rs, offset, 1);
+	rs->nread++;
+	if (ra_lookup(rs, offset, block)) {
+		return 0;
+	}
+	return (*rs->below->read)(rs->below, offset, block);
+}
+
+/* Read a range of blocks.  Blocks that are buffered are copied from
+ * there, while each run of other blocks is read from the block store
+ * below using a single range read.
+ */
+static int radisk_readv(block_if bi, block_no offset, block_no count, block_t *blocks){
+	struct radisk_state *rs = bi->state;
+	block_no i = 0, j;
+
+	ra_access(rs, offset, count);
+	rs->nread += count;
+	while (i < count) {
+		if (ra_lookup(rs, offset + i, &blocks[i])) {
+			i++;
+			continue;
+		}
+		for (j = i + 1; j < count; j++) {
+			if (blockmap_lookup(&rs->map, offset + j) >= 0) {
+				break;
+			}
+		}
+		if (block_readv(rs->below, offset + i, j - i, &blocks[i]) < 0) {
+			return -1;
+		}
+		i = j;
+	}
+	return 0;
+}
+
+static int radisk_write(block_if bi, block_no offset, block_t *block){
+	struct radisk_state *rs = bi->state;
+
+	int i = blockmap_lookup(&rs->map, offset);
+	if (i >= 0) {
+		memcpy(&rs->blocks[i], block, BLOCK_SIZE);
+	}
+	return (*rs->below->write)(rs->below, offset, block);
+}
+
+static int radisk_writev(block_if bi, block_no offset, block_no count, block_t *blocks){
+	struct radisk_state *rs = bi->state;
+	block_no k;
+	int i;
+
+	for (k = 0; k < count; k++) {
+		if ((i = blockmap_lookup(&rs->map, offset + k)) >= 0) {
+			memcpy(&rs->blocks[i], &blocks[k], BLOCK_SIZE);
+		}
+	}
+	return block_writev(rs->below, offset, count, blocks);
+}
+
+static int radisk_discard(block_if bi, block_no offset, block_no count){
+	struct radisk_state *rs = bi->state;
+
+	ra_invalidate(rs, offset, count);
+	return block_discard(rs->below, offset, count);
+}
+
+static int radisk_flush(block_if bi){
+	struct radisk_state *rs = bi->state;
+
+	return block_flush(rs->below);
+}
+
+static void radisk_hint(block_if bi, block_no offset, enum block_class cls){
+	struct radisk_state *rs = bi->state;
+
+	block_hint(rs->below, offset, cls);
+}
+
+static void radisk_destroy(block_if bi){
+	struct radisk_state *rs = bi->state;
+
+	blockmap_free(&rs->map);
+	free(rs->binfo);
+	free(rs);
+	free(bi);
+}
+
+void radisk_dump_stats(block_if bi){
+	struct radisk_state *rs = bi->state;
+	unsigned int i, pending = 0;
+
+	for (i = 0; i < rs->nblocks; i++) {
+		if (rs->binfo[i].status == RI_AHEAD) {
+			pending++;
+		}
+	}
+	printf("!$RA: #reads:        %u\n", rs->nread);
+	printf("!$RA: #streams:      %u\n", rs->nstream);
+	printf("!$RA: #readaheads:   %u\n", rs->nahead);
+	printf("!$RA: #prefetched:   %u\n", rs->nprefetch);
+	printf("!$RA: #useful:       %u\n", rs->nuseful);
+	printf("!$RA: #wasted:       %u\n", rs->nwasted);
+	printf("!$RA: #pending:      %u\n", pending);
+}
+
+/* Create a new block store module on top of the specified module below.
+ * blocks points to a chunk of memory of nblocks blocks that is used to
+ * hold blocks that were read ahead.
+ */
+block_if radisk_init(block_if below, block_t *blocks, block_no nblocks){
+	if (nblocks < 2 * RA_MIN) {
+		fprintf(stderr, "radisk_init: need at least %u blocks\n", 2 * RA_MIN);
+		return 0;
+	}
+
+	/* Create the block store state structure.
+	 */
+	struct radisk_state *rs = calloc(1, sizeof(*rs));
+	rs->below = below;
+	rs->blocks = blocks;
+	rs->nblocks = nblocks;
+	rs->binfo = calloc(nblocks, sizeof(*rs->binfo));
+	blockmap_init(&rs->map, nblocks);
+	rs->max_window = nblocks / 2 < RA_MAX ? nblocks / 2 : RA_MAX;
+
+	/* Return a block interface to this inode.
+	 */
+	block_if bi = calloc(1, sizeof(*bi));
+	bi->state = rs;
+	bi->nblocks = radisk_nblocks;
+	bi->setsize = radisk_setsize;
+	bi->read = radisk_read;
+	bi->write = radisk_write;
+	bi->destroy = radisk_destroy;
+	bi->flush = radisk_flush;
+	bi->readv = radisk_readv;
+	bi->writev = radisk_writev;
+	bi->discard = radisk_discard;
+	bi->hint = radisk_hint;
+	return bi;
+}
@@ -15,6 +15,16 @@
 struct raid0disk_state {
 	block_if *below;		// block stores below
 	unsigned int nbelow;	// #block stores
+	unsigned int *outstanding;	// #asynchronous requests per store
+};
+
+/* A batch of asynchronous requests is split into a request per block store
+ * below.  The batch is freed once all its requests have been reaped.
+ */
+struct raid0disk_batch {
+	unsigned int remaining;			// #requests not yet reaped
+	struct block_req **parents;		// reqs[i] is on behalf of parents[i]
+	struct block_req reqs[];
 };
 
 static int raid0disk_nblocks(block_if bi){
@@ -52,8 +62,210 @@ static int raid0disk_write(block_if bi, block_no offset, block_t *block){
 	return (*rds->below[i]->write)(rds->below[i], offset, block);
 }
 
+/* Blocks are striped across the underlying stores one at a time, so a
+ * range of blocks maps to a range on each of the underlying stores.  Find
+ * the first block in the range that is stored on store m and the number
+ * of blocks in the range that are stored there.  Returns 0 if store m
+ * has none of the blocks.
+ */
+static int raid0disk_stripe(struct raid0disk_state *rds, block_no offset,
+						block_no count, unsigned int m, block_no *first, block_no *n){
+	*first = offset + (m + rds->nbelow - offset % rds->nbelow) % rds->nbelow;
+	if (*first >= offset + count) {
+		return 0;
+	}
+	*n = (offset + count - *first + rds->nbelow - 1) / rds->nbelow;
+	return 1;
+}
+
+/* Transfer a range of blocks to or from the underlying stores.  The
+ * blocks of the range on each store are interleaved with those of the
+ * other stores in the caller's array, so transfer them through a buffer.
+ * 'write' selects between reading and writing.
+ */
+static int raid0disk_rangeio(block_if bi, block_no offset, block_no count,
+									block_t *blocks, int write){
+	struct raid0disk_state *rds = bi->state;
+	unsigned int i;
+	block_no j, first, n;
+
+	if (rds->nbelow == 1) {
+		return write ? block_writev(rds->below[0], offset, count, blocks)
+					 : block_readv(rds->below[0], offset, count, blocks);
+	}
+
+	block_t *buf = malloc(((size_t) count / rds->nbelow + 1) * BLOCK_SIZE);
+	int result = 0;
+	for (i = 0; i < rds->nbelow; i++) {
+		if (!raid0disk_stripe(rds, offset, count, i, &first, &n)) {
+			continue;
+		}
+		if (write) {
+			for (j = 0; j < n; j++) {
+				buf[j] = blocks[first - offset + j * rds->nbelow];
+			}
+			if (block_writev(rds->below[first % rds->nbelow], first / rds->nbelow, n, buf) < 0) {
+				result = -1;
+				break;
+			}
+		}
+		else {
+			if (block_readv(rds->below[first % rds->nbelow], first / rds->nbelow, n, buf) < 0) {
+				result = -1;
+				break;
+			}
+			for (j = 0; j < n; j++) {
+				blocks[first - offset + j * rds->nbelow] = buf[j];
+			}
+		}
+	}
+	free(buf);
+	return result;
+}
+
+static int raid0disk_readv(block_if bi, block_no offset, block_no count, block_t *blocks){
+	return raid0disk_rangeio(bi, offset, count, blocks, 0);
+}
+
+static int raid0disk_writev(block_if bi, block_no offset, block_no count, block_t *blocks){
+	return raid0disk_rangeio(bi, offset, count, blocks, 1);
+}
+
+/* Submit a batch of requests.  Requests for the same block store below are
+ * submitted together so each underlying store sees a single batch.
+ */
+static int raid0disk_submit(block_if bi, struct block_req *reqs, unsigned int nreqs){
+	struct raid0disk_state *rds = bi->state;
+	unsigned int i, m, *start;
+
+	if (nreqs == 0) {
+		return 0;
+	}
+	struct raid0disk_batch *batch = malloc(sizeof(*batch) + nreqs * sizeof(struct block_req));
+	batch->remaining = nreqs;
+	batch->parents = malloc(nreqs * sizeof(*batch->parents));
+
+	/* Sort the requests by block store below.
+	 */
+	start = calloc(rds->nbelow + 1, sizeof(*start));
+	for (i = 0; i < nreqs; i++) {
+		start[reqs[i].offset % rds->nbelow + 1]++;
+	}
+	for (m = 0; m < rds->nbelow; m++) {
+		start[m + 1] += start[m];
+	}
+	for (i = 0; i < nreqs; i++) {
+		struct block_req *req = &batch->reqs[start[reqs[i].offset % rds->nbelow]++];
+		*req = reqs[i];
+		req->offset /= rds->nbelow;
+		req->cookie = batch;
+		batch->parents[req - batch->reqs] = &reqs[i];
+	}
+
+	/* start[m] is now the end of the requests for store m.
+	 */
+	for (m = 0, i = 0; m < rds->nbelow; i = start[m++]) {
+		if (start[m] == i) {
+			continue;
+		}
+		rds->outstanding[m] += start[m] - i;
+		if (block_submit(rds->below[m], &batch->reqs[i], start[m] - i) < 0) {
+			panic("raid0disk_submit");
+		}
+	}
+	free(start);
+	return 0;
+}
+
+/* A request completed by a block store below.  Return the request on
+ * whose behalf it was submitted.
+ */
+static struct block_req *raid0disk_complete(struct raid0disk_state *rds,
+								unsigned int m, struct block_req *req){
+	struct raid0disk_batch *batch = req->cookie;
+	struct block_req *parent = batch->parents[req - batch->reqs];
+
+	parent->result = req->result;
+	rds->outstanding[m]--;
+	if (--batch->remaining == 0) {
+		free(batch->parents);
+		free(batch);
+	}
+	return parent;
+}
+
+static int raid0disk_reap(block_if bi, struct block_req **done, unsigned int max, unsigned int min){
+	struct raid0disk_state *rds = bi->state;
+	unsigned int m, n = 0, busy;
+	int i, k;
+
+	for (;;) {
+		/* Collect whatever is available without waiting.
+		 */
+		for (m = 0; m < rds->nbelow && n < max; m++) {
+			if (rds->outstanding[m] == 0) {
+				continue;
+			}
+			k = block_reap(rds->below[m], &done[n], max - n, 0);
+			for (i = 0; i < k; i++, n++) {
+				done[n] = raid0disk_complete(rds, m, done[n]);
+			}
+		}
+		for (busy = 0; busy < rds->nbelow; busy++) {
+			if (rds->outstanding[busy] != 0) {
+				break;
+			}
+		}
+		if (n >= min || n == max || busy == rds->nbelow) {
+			return n;
+		}
+
+		/* Wait for one of the block stores that still has work.
+		 */
+		k = block_reap(rds->below[busy], &done[n], max - n, 1);
+		for (i = 0; i < k; i++, n++) {
+			done[n] = raid0disk_complete(rds, busy, done[n]);
+		}
+	}
+}
+
+/* A range of blocks maps to a range on each of the block stores below.
+ */
+static int raid0disk_discard(block_if bi, block_no offset, block_no count){
+	struct raid0disk_state *rds = bi->state;
+	unsigned int i;
+	block_no first, n;
+	int result = 0;
+
+	for (i = 0; i < rds->nbelow; i++) {
+		if (!raid0disk_stripe(rds, offset, count, i, &first, &n)) {
+			continue;
+		}
+		if (block_discard(rds->below[first % rds->nbelow], first / rds->nbelow, n) < 0) {
+			result = -1;
+		}
+	}
+	return result;
+}
+
+static int raid0disk_flush(block_if bi){
+	struct raid0disk_state *rds = bi->state;
+	unsigned int i;
+	int result = 0;
+
+	for (i = 0; i < rds->nbelow; i++) {
+		if (block_flush(rds->below[i]) < 0) {
+			result = -1;
+		}
+	}
+	return result;
+}
+
 static void raid0disk_destroy(block_if bi){
-	free(bi->state);
+	struct raid0disk_state *rds = bi->state;
+
+	free(rds->outstanding);
+	free(rds);
 	free(bi);
 }
 
@@ -63,6 +275,7 @@ block_if raid0disk_init(block_if *below, unsigned int nbelow){
 	struct raid0disk_state *rds = calloc(1, sizeof(*rds));
 	rds->below = below;
 	rds->nbelow = nbelow;
+	rds->outstanding = calloc(nbelow, sizeof(*rds->outstanding));
 
 	/* Return a block interface to this inode.
 	 */
@@ -73,5 +286,11 @@ block_if raid0disk_init(block_if *below, unsigned int nbelow){
 	bi->read = raid0disk_read;
 	bi->write = raid0disk_write;
 	bi->destroy = raid0disk_destroy;
+	bi->readv = raid0disk_readv;
+	bi->writev = raid0disk_writev;
+	bi->submit = raid0disk_submit;
+	bi->reap = raid0disk_reap;
+	bi->discard = raid0disk_discard;
+	bi->flush = raid0disk_flush;
 	return bi;
 }
@@ -16,6 +16,29 @@ struct raid1disk_state {
 	block_if *below;		// block stores below
 	unsigned int nbelow;	// #block stores
 	char *broken;			// keeps track of which stores are broken
+
+	/* Asynchronous I/O.
+	 */
+	unsigned int *outstanding;		// #requests per store
+	unsigned int next_read;			// store to send the next read to
+	struct block_req *completed;	// completed but not yet reaped
+};
+
+/* An asynchronous request submitted to this layer becomes one request
+ * to one of the stores below in case of a read, and one request for each
+ * store that is not broken in case of a write.
+ */
+struct raid1disk_io {
+	struct block_req *parent;		// request submitted to this layer
+	unsigned int pending;			// #requests below not yet completed
+	unsigned int tries;				// #stores tried (reads only)
+	int ok;							// some write succeeded
+};
+
+struct raid1disk_child {
+	struct block_req req;			// request submitted below
+	struct raid1disk_io *io;		// what it is part of
+	unsigned int member;			// store it was submitted to
 };
 
 static int raid1disk_nblocks(block_if bi){
@@ -96,9 +119,202 @@ static int raid1disk_write(block_if bi, block_no offset, block_t *block){
 	return result;
 }
 
+/* Find a store that is not broken, starting at store 'm'.  Returns nbelow
+ * if there is none.
+ */
+static unsigned int raid1disk_next(struct raid1disk_state *rds, unsigned int m){
+	unsigned int i;
+
+	for (i = 0; i < rds->nbelow; i++, m++) {
+		if (m >= rds->nbelow) {
+			m = 0;
+		}
+		if (!rds->broken[m]) {
+			return m;
+		}
+	}
+	return rds->nbelow;
+}
+
+static void raid1disk_send(struct raid1disk_state *rds, struct raid1disk_io *io, unsigned int m){
+	struct raid1disk_child *child = calloc(1, sizeof(*child));
+
+	child->req.op = io->parent->op;
+	child->req.offset = io->parent->offset;
+	child->req.block = io->parent->block;
+	child->req.cookie = child;
+	child->io = io;
+	child->member = m;
+	io->pending++;
+	rds->outstanding[m]++;
+	if (block_submit(rds->below[m], &child->req, 1) < 0) {
+		panic("raid1disk_send");
+	}
+}
+
+/* Reads are spread over the stores in a round-robin fashion so that
+ * concurrent reads can proceed in parallel.  Writes go to all stores.
+ */
+static int raid1disk_submit(block_if bi, struct block_req *reqs, unsigned int nreqs){
+	struct raid1disk_state *rds = bi->state;
+	unsigned int i, m;
+
+	for (i = 0; i < nreqs; i++) {
+		struct raid1disk_io *io = calloc(1, sizeof(*io));
+		io->parent = &reqs[i];
+		if (reqs[i].op == BLOCK_READ) {
+			if ((m = raid1disk_next(rds, rds->next_read)) < rds->nbelow) {
+				rds->next_read = m + 1;
+				io->tries = 1;
+				raid1disk_send(rds, io, m);
+			}
+		}
+		else {
+			for (m = 0; m < rds->nbelow; m++) {
+				if (!rds->broken[m]) {
+					raid1disk_send(rds, io, m);
+				}
+			}
+		}
+
+		/* No store is left to send the request to.
+		 */
+		if (io->pending == 0) {
+			reqs[i].result = -1;
+			reqs[i].next = rds->completed;
+			rds->completed = &reqs[i];
+			free(io);
+		}
+	}
+	return 0;
+}
+
+/* A request below has completed.  Returns the request submitted to this
+ * layer if it is now complete as well, or 0 otherwise.  A failed read is
+ * retried at the next store.
+ */
+static struct block_req *raid1disk_complete(struct raid1disk_state *rds, struct block_req *req){
+	struct raid1disk_child *child = req->cookie;
+	struct raid1disk_io *io = child->io;
+	struct block_req *parent = io->parent;
+	unsigned int m;
+
+	rds->outstanding[child->member]--;
+	io->pending--;
+	if (parent->op == BLOCK_READ) {
+		if (req->result < 0 && io->tries < rds->nbelow &&
+				(m = raid1disk_next(rds, child->member + 1)) < rds->nbelow) {
+			io->tries++;
+			raid1disk_send(rds, io, m);
+		}
+		else {
+			parent->result = req->result;
+		}
+	}
+	else {
+		if (req->result < 0) {
+			rds->broken[child->member] = 1;
+		}
+		else {
+			io->ok = 1;
+		}
+		parent->result = io->ok ? 0 : -1;
+	}
+	free(child);
+
+	if (io->pending != 0) {
+		return 0;
+	}
+	free(io);
+	return parent;
+}
+
+static int raid1disk_reap(block_if bi, struct block_req **done, unsigned int max, unsigned int min){
+	struct raid1disk_state *rds = bi->state;
+	struct block_req *reqs[16], *parent;
+	unsigned int m, n = 0, busy;
+	int i, k;
+
+	for (;;) {
+		while (n < max && rds->completed != 0) {
+			done[n++] = rds->completed;
+			rds->completed = rds->completed->next;
+		}
+
+		/* Collect whatever is available without waiting.  Each request
+		 * below completes at most one request, so never collect more
+		 * than there is room for.
+		 */
+		for (m = 0; m < rds->nbelow && n < max; m++) {
+			if (rds->outstanding[m] == 0) {
+				continue;
+			}
+			k = block_reap(rds->below[m], reqs, max - n < 16 ? max - n : 16, 0);
+			for (i = 0; i < k; i++) {
+				if ((parent = raid1disk_complete(rds, reqs[i])) != 0) {
+					done[n++] = parent;
+				}
+			}
+		}
+		for (busy = 0; busy < rds->nbelow; busy++) {
+			if (rds->outstanding[busy] != 0) {
+				break;
+			}
+		}
+		if (n >= min || n == max || (busy == rds->nbelow && rds->completed == 0)) {
+			return n;
+		}
+		if (busy == rds->nbelow) {
+			continue;
+		}
+
+		/* Wait for one of the block stores that still has work.
+		 */
+		k = block_reap(rds->below[busy], reqs, max - n < 16 ? max - n : 16, 1);
+		for (i = 0; i < k; i++) {
+			if ((parent = raid1disk_complete(rds, reqs[i])) != 0) {
+				done[n++] = parent;
+			}
+		}
+	}
+}
+
+static int raid1disk_discard(block_if bi, block_no offset, block_no count){
+	struct raid1disk_state *rds = bi->state;
+	int i;
+
+	for (i = 0; i < rds->nbelow; i++) {
+		if (!rds->broken[i]) {
+			block_discard(rds->below[i], offset, count);
+		}
+	}
+	return 0;
+}
+
+/* Succeeds if at least one of the stores could be flushed.
+ */
+static int raid1disk_flush(block_if bi){
+	struct raid1disk_state *rds = bi->state;
+	int i, result = -1;
+
+	for (i = 0; i < rds->nbelow; i++) {
+		if (rds->broken[i]) {
+			continue;
+		}
+		if (block_flush(rds->below[i]) < 0) {
+			rds->broken[i] = 1;
+		}
+		else {
+			result = 0;
+		}
+	}
+	return result;
+}
+
 static void raid1disk_destroy(block_if bi){
 	struct raid1disk_state *rds = bi->state;
 
+	free(rds->outstanding);
 	free(rds->broken);
 	free(rds);
 	free(bi);
@@ -111,6 +327,7 @@ block_if raid1disk_init(block_if *below, unsigned int nbelow){
 	rds->below = below;
 	rds->nbelow = nbelow;
 	rds->broken = calloc(1, nbelow);
+	rds->outstanding = calloc(nbelow, sizeof(*rds->outstanding));
 
 	/* Return a block interface to this inode.
 	 */
@@ -121,5 +338,9 @@ block_if raid1disk_init(block_if *below, unsigned int nbelow){
 	bi->read = raid1disk_read;
 	bi->write = raid1disk_write;
 	bi->destroy = raid1disk_destroy;
+	bi->submit = raid1disk_submit;
+	bi->reap = raid1disk_reap;
+	bi->discard = raid1disk_discard;
+	bi->flush = raid1disk_flush;
 	return bi;
 }
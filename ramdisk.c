@@ -55,6 +55,41 @@ static int ramdisk_write(block_if bi, block_no offset, block_t *block){
 	return 0;
 }
 
+static int ramdisk_readv(block_if bi, block_no offset, block_no count, block_t *blocks){
+	struct ramdisk_state *rs = bi->state;
+
+	if (count > rs->nblocks || offset > rs->nblocks - count) {
+		fprintf(stderr, "ramdisk_readv: bad range %u %u\n", offset, count);
+		return -1;
+	}
+	memcpy(blocks, &rs->blocks[offset], (size_t) count * BLOCK_SIZE);
+	return 0;
+}
+
+static int ramdisk_writev(block_if bi, block_no offset, block_no count, block_t *blocks){
+	struct ramdisk_state *rs = bi->state;
+
+	if (count > rs->nblocks || offset > rs->nblocks - count) {
+		fprintf(stderr, "ramdisk_writev: bad range\n");
+		return -1;
+	}
+	memcpy(&rs->blocks[offset], blocks, (size_t) count * BLOCK_SIZE);
+	return 0;
+}
+
+/* Blocks live in memory that is never reused for other blocks, so there
+ * is no need to keep track of pins.
+ */
+static const block_t *ramdisk_pin(block_if bi, block_no offset){
+	struct ramdisk_state *rs = bi->state;
+
+	if (offset >= rs->nblocks) {
+		fprintf(stderr, "ramdisk_pin: bad offset %u\n", offset);
+		return 0;
+	}
+	return &rs->blocks[offset];
+}
+
 static void ramdisk_destroy(block_if bi){
 	free(bi->state);
 	free(bi);
@@ -73,5 +108,8 @@ block_if ramdisk_init(block_t *blocks, block_no nblocks){
 	bi->read = ramdisk_read;
 	bi->write = ramdisk_write;
 	bi->destroy = ramdisk_destroy;
+	bi->readv = ramdisk_readv;
+	bi->writev = ramdisk_writev;
+	bi->pin = ramdisk_pin;
 	return bi;
 }
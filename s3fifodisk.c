@@ -0,0 +1,507 @@
+/* This block store module mirrors the underlying block store but contains
+ * a write-through cache.  The caching strategy is S3-FIFO (Yang et al.,
+ * SOSP 2023), or a variant of 2Q (Johnson and Shasha, VLDB 1994).  Both
+ * resist being flushed by sequential scans.  The interface is as follows:
+ *
+ *		block_if s3fifodisk_init(block_if below,
+ *									block_t *blocks, block_no nblocks)
+ *		block_if twoqdisk_init(block_if below,
+ *									block_t *blocks, block_no nblocks)
+ *			'below' is the underlying block store.  'blocks' points to
+ *			a chunk of memory wth 'nblocks' blocks for caching.
+ *
+ *		void s3fifodisk_dump_stats(block_if bi)
+ *			Prints the cache statistics (of either kind of cache).
+ *
+ * The cache consists of a small FIFO queue S of about 10% of the cache, a
+ * main FIFO queue M with the rest, and a ghost FIFO queue G that only
+ * holds the block numbers of about as many blocks as M.  A hit merely
+ * bumps a small per-entry counter, so hits never reorder any queue.
+ * Missed blocks go to the head of S, or to the head of M if they are in
+ * G.  When a cache entry is needed:
+ *
+ *	- If S is over its target size, its tail is evicted into G.  With
+ *	  S3-FIFO, a block that was hit while in S is moved to M instead.
+ *	  With 2Q, only blocks found in G get into M.
+ *	- Otherwise, if the tail of M was hit since it was last looked at, it
+ *	  is reinserted at the head of M with its count decremented, as with
+ *	  CLOCK.  Otherwise it is evicted.
+ *
+ * A scan thus only passes through S and G, and blocks that are used once
+ * are evicted quickly.  The queues are doubly-linked through an array with
+ * an entry per cache block, and resident and ghost blocks are found
+ * through hash indexes (see blockmap.h).
+ *
+ * Blocks may be pinned in the cache, giving the client read-only access
+ * to the cache entry itself.  A pinned entry is not evicted until it has
+ * been unpinned as many times as it was pinned.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "block_if.h"
+#include "blockmap.h"
+
+#define S3_MAXFREQ		3		// max hit count per entry
+
+enum s3_queue { S3_SMALL, S3_MAIN, S3_NQUEUES, S3_FREE = S3_NQUEUES };
+
+/* Per block in the cache we keep track of the following info:
+ */
+struct s3_info {
+	block_no offset;		// block being cached if not S3_FREE
+	enum s3_queue queue;	// queue the entry is on
+	unsigned int freq;		// #hits, up to S3_MAXFREQ
+	unsigned int pins;		// #outstanding pins; entry may not be evicted
+	unsigned int prev;		// entry towards the head of the queue
+	unsigned int next;		// entry towards the tail of the queue
+};
+
+/* State contains the pointer to the block module below as well as caching
+ * information and caching statistics.
+ */
+struct s3fifodisk_state {
+	block_if below;				// block store below
+	block_t *blocks;			// memory for caching blocks
+	block_no nblocks;			// size of cache (not size of block store!)
+	int twoq;					// 2Q rather than S3-FIFO
+	unsigned int small;			// target size of S
+
+	/* Entries nblocks and nblocks + 1 are the heads of S and M.  Free
+	 * entries are on a stack.
+	 */
+	struct s3_info *info;
+	unsigned int len[S3_NQUEUES];
+	unsigned int *free, nfree;
+	struct blockmap map;		// offset to cache entry of cached blocks
+
+	/* The ghost queue is a ring of block numbers.  An entry in the ring is
+	 * only valid if the ghost index maps the block number to its position.
+	 */
+	block_no *ghost;
+	unsigned int nghost;		// size of the ring
+	unsigned int ghost_next;	// next position to fill
+	struct blockmap ghost_map;	// offset to position in ring
+
+	/* Stats.
+	 */
+	unsigned int read_hit, read_miss, write_hit, write_miss;
+	unsigned int ghost_hit;		// #misses on blocks in G
+	unsigned int promote;		// #blocks moved from S to M
+	unsigned int reinsert;		// #blocks reinserted into M
+	unsigned int evict[S3_NQUEUES];	// #blocks evicted from S and M
+};
+
+static void s3_unlink(struct s3fifodisk_state *ss, unsigned int i){
+	struct s3_info *info = ss->info;
+
+	info[info[i].prev].next = info[i].next;
+	info[info[i].next].prev = info[i].prev;
+	ss->len[info[i].queue]--;
+}
+
+/* Put entry i at the head of the given queue.
+ */
+static void s3_push(struct s3fifodisk_state *ss, unsigned int i, enum s3_queue queue){
+	struct s3_info *info = ss->info;
+	unsigned int h = ss->nblocks + queue;
+
+	info[i].queue = queue;
+	info[i].prev = h;
+	info[i].next = info[h].next;
+	info[info[h].next].prev = i;
+	info[h].next = i;
+	ss->len[queue]++;
+}
+
+static void s3_free(struct s3fifodisk_state *ss, unsigned int i){
+	s3_unlink(ss, i);
+	blockmap_remove(&ss->map, ss->info[i].offset);
+	ss->info[i].queue = S3_FREE;
+	ss->free[ss->nfree++] = i;
+}
+
+static void ghost_insert(struct s3fifodisk_state *ss, block_no offset){
+	unsigned int pos = ss->ghost_next;
+
+	if (blockmap_lookup(&ss->ghost_map, ss->ghost[pos]) == pos) {
+		blockmap_remove(&ss->ghost_map, ss->ghost[pos]);
+	}
+	ss->ghost[pos] = offset;
+	blockmap_insert(&ss->ghost_map, offset, pos);
+	ss->ghost_next = (pos + 1) % ss->nghost;
+}
+
+/* Evict one block to free up a cache entry.  Returns 0, or -1 if all
+ * entries are pinned.
+ */
+static int s3_evict(struct s3fifodisk_state *ss){
+	unsigned int steps, i;
+
+	/* Each step either evicts a block or moves one along with a lower
+	 * hit count, so this only runs out if entries are pinned.
+	 */
+	for (steps = 0; steps < 2 * (S3_MAXFREQ + 1) * ss->nblocks; steps++) {
+		if (ss->len[S3_SMALL] > ss->small || ss->len[S3_MAIN] == 0) {
+			i = ss->info[ss->nblocks + S3_SMALL].prev;
+			if (ss->info[i].pins != 0 || (!ss->twoq && ss->info[i].freq > 0)) {
+				s3_unlink(ss, i);
+				s3_push(ss, i, S3_MAIN);
+				ss->info[i].freq = 0;
+				ss->promote++;
+				continue;
+			}
+			ghost_insert(ss, ss->info[i].offset);
+			s3_free(ss, i);
+			ss->evict[S3_SMALL]++;
+			return 0;
+		}
+		i = ss->info[ss->nblocks + S3_MAIN].prev;
+		if (ss->info[i].pins != 0 || ss->info[i].freq > 0) {
+			if (ss->info[i].freq > 0) {
+				ss->info[i].freq--;
+			}
+			s3_unlink(ss, i);
+			s3_push(ss, i, S3_MAIN);
+			ss->reinsert++;
+			continue;
+		}
+		s3_free(ss, i);
+		ss->evict[S3_MAIN]++;
+		return 0;
+	}
+	return -1;
+}
+
+/* A block is about to be placed in the cache.  Returns the index of the
+ * entry to use, or -1 if all entries are pinned.  The caller fills in the
+ * entry, or frees it again if that fails.
+ */
+static int cache_alloc(struct s3fifodisk_state *ss, block_no offset){
+	int pos;
+
+	if (ss->nfree == 0 && s3_evict(ss) < 0) {
+		return -1;
+	}
+	unsigned int i = ss->free[--ss->nfree];
+	ss->info[i].offset = offset;
+	ss->info[i].freq = 0;
+	blockmap_insert(&ss->map, offset, i);
+	if ((pos = blockmap_remove(&ss->ghost_map, offset)) >= 0) {
+		s3_push(ss, i, S3_MAIN);
+		ss->ghost_hit++;
+	}
+	else {
+		s3_push(ss, i, S3_SMALL);
+	}
+	return i;
+}
+
+/* The given block was just used but it's not in the cache.  Stick it in
+ * the cache, if possible.
+ */
+static void cache_update(struct s3fifodisk_state *ss, block_no offset, block_t *block){
+	int i = cache_alloc(ss, offset);
+
+	if (i >= 0) {
+		memcpy(&ss->blocks[i], block, BLOCK_SIZE);
+	}
+}
+
+/* Return the index of the cache entry that holds the given block, or -1
+ * if the block is not in the cache.
+ */
+static int cache_lookup(struct s3fifodisk_state *ss, block_no offset){
+	return blockmap_lookup(&ss->map, offset);
+}
+
+/* A cached block was used.
+ */
+static void cache_hit(struct s3fifodisk_state *ss, unsigned int i){
+	if (ss->info[i].freq < S3_MAXFREQ) {
+		ss->info[i].freq++;
+	}
+}
+
+/* Forget about the 'count' blocks starting at offset, including ghosts.
+ * If there are fewer such blocks than cache entries, look each one up in
+ * the indexes.  Otherwise it is cheaper to go through the entries.
+ */
+static void cache_invalidate(struct s3fifodisk_state *ss, block_no offset, block_no count){
+	block_no i;
+	int slot;
+
+	if (count < ss->nblocks) {
+		for (i = 0; i < count; i++) {
+			if ((slot = cache_lookup(ss, offset + i)) >= 0) {
+				s3_free(ss, slot);
+			}
+			blockmap_remove(&ss->ghost_map, offset + i);
+		}
+		return;
+	}
+	for (i = 0; i < ss->nblocks; i++) {
+		if (ss->info[i].queue != S3_FREE && ss->info[i].offset >= offset &&
+									ss->info[i].offset - offset < count) {
+			s3_free(ss, i);
+		}
+	}
+	for (i = 0; i < ss->nghost; i++) {
+		if (ss->ghost[i] >= offset && ss->ghost[i] - offset < count &&
+							blockmap_lookup(&ss->ghost_map, ss->ghost[i]) == i) {
+			blockmap_remove(&ss->ghost_map, ss->ghost[i]);
+		}
+	}
+}
+
+static int s3fifodisk_nblocks(block_if bi){
+	struct s3fifodisk_state *ss = bi->state;
+
+	return (*ss->below->nblocks)(ss->below);
+}
+
+/* The old size returned by the block store below tells which blocks are
+ * cut off, so they can be dropped from the cache.
+ */
+static int s3fifodisk_setsize(block_if bi, block_no nblocks){
+	struct s3fifodisk_state *ss = bi->state;
+
+	int before = (*ss->below->setsize)(ss->below, nblocks);
+	if (before > 0 && (block_no) before > nblocks) {
+		cache_invalidate(ss, nblocks, before - nblocks);
+	}
+	return before;
+}
+
+static int s3fifodisk_read(block_if bi, block_no offset, block_t *block){
+	struct s3fifodisk_state *ss = bi->state;
+
+	/* Check the cache first.
+	 */
+	int i = cache_lookup(ss, offset);
+	if (i >= 0) {
+		memcpy(block, &ss->blocks[i], BLOCK_SIZE);
+		cache_hit(ss, i);
+		ss->read_hit++;
+		return 0;
+	}
+
+	int r = (*ss->below->read)(ss->below, offset, block);
+	if (r >= 0) {
+		cache_update(ss, offset, block);
+		ss->read_miss++;
+	}
+	return r;
+}
+
+static int s3fifodisk_write(block_if bi, block_no offset, block_t *block){
+	struct s3fifodisk_state *ss = bi->state;
+
+	/* Check the cache first.  Even if it's in the cache, write to the
+	 * block store below because this implements a write-through cache.
+	 */
+	int i = cache_lookup(ss, offset);
+	if (i >= 0) {
+		memcpy(&ss->blocks[i], block, BLOCK_SIZE);
+		cache_hit(ss, i);
+		ss->write_hit++;
+		return (*ss->below->write)(ss->below, offset, block);
+	}
+
+	cache_update(ss, offset, block);
+	ss->write_miss++;
+	return (*ss->below->write)(ss->below, offset, block);
+}
+
+/* Read a range of blocks.  Blocks that are in the cache are copied from
+ * there, while each run of consecutive misses is read from the block
+ * store below using a single range read.
+ */
+static int s3fifodisk_readv(block_if bi, block_no offset, block_no count, block_t *blocks){
+	struct s3fifodisk_state *ss = bi->state;
+	block_no i = 0, j;
+	int slot;
+
+	while (i < count) {
+		if ((slot = cache_lookup(ss, offset + i)) >= 0) {
+			memcpy(&blocks[i], &ss->blocks[slot], BLOCK_SIZE);
+			cache_hit(ss, slot);
+			ss->read_hit++;
+			i++;
+			continue;
+		}
+
+		/* Find the end of the run of misses.
+		 */
+		for (j = i + 1; j < count; j++) {
+			if (cache_lookup(ss, offset + j) >= 0) {
+				break;
+			}
+		}
+		int r = block_readv(ss->below, offset + i, j - i, &blocks[i]);
+		if (r < 0) {
+			return r;
+		}
+		for (; i < j; i++) {
+			cache_update(ss, offset + i, &blocks[i]);
+			ss->read_miss++;
+		}
+	}
+	return 0;
+}
+
+/* Write a range of blocks.  Update the cache block by block, and then
+ * write the entire range through to the block store below.
+ */
+static int s3fifodisk_writev(block_if bi, block_no offset, block_no count, block_t *blocks){
+	struct s3fifodisk_state *ss = bi->state;
+	block_no i;
+	int slot;
+
+	for (i = 0; i < count; i++) {
+		if ((slot = cache_lookup(ss, offset + i)) >= 0) {
+			memcpy(&ss->blocks[slot], &blocks[i], BLOCK_SIZE);
+			cache_hit(ss, slot);
+			ss->write_hit++;
+		}
+		else {
+			cache_update(ss, offset + i, &blocks[i]);
+			ss->write_miss++;
+		}
+	}
+	return block_writev(ss->below, offset, count, blocks);
+}
+
+/* Pin the block at the given offset in the cache, reading it into a
+ * cache entry if necessary.
+ */
+static const block_t *s3fifodisk_pin(block_if bi, block_no offset){
+	struct s3fifodisk_state *ss = bi->state;
+
+	int i = cache_lookup(ss, offset);
+	if (i >= 0) {
+		cache_hit(ss, i);
+		ss->info[i].pins++;
+		ss->read_hit++;
+		return &ss->blocks[i];
+	}
+
+	if ((i = cache_alloc(ss, offset)) < 0) {
+		return 0;
+	}
+	if ((*ss->below->read)(ss->below, offset, &ss->blocks[i]) < 0) {
+		s3_free(ss, i);
+		return 0;
+	}
+	ss->info[i].pins++;
+	ss->read_miss++;
+	return &ss->blocks[i];
+}
+
+static void s3fifodisk_unpin(block_if bi, const block_t *block){
+	struct s3fifodisk_state *ss = bi->state;
+
+	ss->info[block - ss->blocks].pins--;
+}
+
+/* Drop any cached copies of the discarded blocks, making room for other
+ * blocks, and pass the discard on to the block store below.
+ */
+static int s3fifodisk_discard(block_if bi, block_no offset, block_no count){
+	struct s3fifodisk_state *ss = bi->state;
+
+	cache_invalidate(ss, offset, count);
+	return block_discard(ss->below, offset, count);
+}
+
+/* The cache is write-through, so there is nothing to write back.
+ */
+static int s3fifodisk_flush(block_if bi){
+	struct s3fifodisk_state *ss = bi->state;
+
+	return block_flush(ss->below);
+}
+
+static void s3fifodisk_destroy(block_if bi){
+	struct s3fifodisk_state *ss = bi->state;
+
+	blockmap_free(&ss->map);
+	blockmap_free(&ss->ghost_map);
+	free(ss->ghost);
+	free(ss->free);
+	free(ss->info);
+	free(ss);
+	free(bi);
+}
+
+void s3fifodisk_dump_stats(block_if bi){
+	struct s3fifodisk_state *ss = bi->state;
+	char *name = ss->twoq ? "!$2Q" : "!$S3FIFO";
+
+	printf("%s: #read hits:    %u\n", name, ss->read_hit);
+	printf("%s: #read misses:  %u\n", name, ss->read_miss);
+	printf("%s: #write hits:   %u\n", name, ss->write_hit);
+	printf("%s: #write misses: %u\n", name, ss->write_miss);
+	printf("%s: #ghost hits:   %u\n", name, ss->ghost_hit);
+	printf("%s: #promotions:   %u\n", name, ss->promote);
+	printf("%s: #reinsertions: %u\n", name, ss->reinsert);
+	printf("%s: #evict small:  %u\n", name, ss->evict[S3_SMALL]);
+	printf("%s: #evict main:   %u\n", name, ss->evict[S3_MAIN]);
+}
+
+static block_if s3fifodisk_create(block_if below, block_t *blocks, block_no nblocks, int twoq){
+	unsigned int i;
+
+	/* Create the block store state structure.  S gets 10% of the cache
+	 * with S3-FIFO and 25% with 2Q, and G remembers as many blocks as
+	 * M can hold.
+	 */
+	struct s3fifodisk_state *ss = calloc(1, sizeof(*ss));
+	ss->below = below;
+	ss->blocks = blocks;
+	ss->nblocks = nblocks;
+	ss->twoq = twoq;
+	ss->small = twoq ? nblocks / 4 : nblocks / 10;
+	if (ss->small == 0) {
+		ss->small = 1;
+	}
+	ss->info = calloc(nblocks + S3_NQUEUES, sizeof(*ss->info));
+	for (i = 0; i < S3_NQUEUES; i++) {
+		ss->info[nblocks + i].prev = ss->info[nblocks + i].next = nblocks + i;
+	}
+	ss->free = calloc(nblocks, sizeof(*ss->free));
+	for (i = 0; i < nblocks; i++) {
+		ss->info[i].queue = S3_FREE;
+		ss->free[ss->nfree++] = nblocks - 1 - i;
+	}
+	blockmap_init(&ss->map, nblocks);
+	ss->nghost = nblocks > ss->small ? nblocks - ss->small : 1;
+	ss->ghost = calloc(ss->nghost, sizeof(*ss->ghost));
+	blockmap_init(&ss->ghost_map, ss->nghost);
+
+	/* Return a block interface to this inode.
+	 */
+	block_if bi = calloc(1, sizeof(*bi));
+	bi->state = ss;
+	bi->nblocks = s3fifodisk_nblocks;
+	bi->setsize = s3fifodisk_setsize;
+	bi->read = s3fifodisk_read;
+	bi->write = s3fifodisk_write;
+	bi->destroy = s3fifodisk_destroy;
+	bi->flush = s3fifodisk_flush;
+	bi->readv = s3fifodisk_readv;
+	bi->writev = s3fifodisk_writev;
+	bi->pin = s3fifodisk_pin;
+	bi->unpin = s3fifodisk_unpin;
+	bi->discard = s3fifodisk_discard;
+	return bi;
+}
+
+block_if s3fifodisk_init(block_if below, block_t *blocks, block_no nblocks){
+	return s3fifodisk_create(below, blocks, nblocks, 0);
+}
+
+block_if twoqdisk_init(block_if below, block_t *blocks, block_no nblocks){
+	return s3fifodisk_create(below, blocks, nblocks, 1);
+}
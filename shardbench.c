@@ -0,0 +1,97 @@
+/* Measures how the hit throughput of sharddisk scales with the number of
+ * threads.  Usage:
+ *
+ *		shardbench [max-threads [nshards [cache-size]]]
+ *
+ * For 1, 2, 4, ... up to max-threads threads, each thread reads random
+ * blocks from a working set that fits in the cache, once with a single
+ * shard (one lock for the whole cache) and once with nshards shards.
+ * Prints the number of reads per second and the speedup over one thread.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+#include "block_if.h"
+
+#define DISK_SIZE		(16 * 1024)		// size of "physical" disk
+#define NREADS			(1 << 20)		// #reads per thread
+
+static block_t blocks[DISK_SIZE];		// blocks for ram_disk
+
+struct bench_arg {
+	block_if bi;				// cache under test
+	block_no working_set;		// #distinct blocks read
+	unsigned int seed;			// for rand_r
+};
+
+static void *bench_thread(void *arg){
+	struct bench_arg *ba = arg;
+	block_t block;
+	int i;
+
+	for (i = 0; i < NREADS; i++) {
+		if ((*ba->bi->read)(ba->bi, rand_r(&ba->seed) % ba->working_set, &block) < 0) {
+			panic("shardbench: read failed");
+		}
+	}
+	return 0;
+}
+
+/* Run nthreads threads against the cache and return reads per second.
+ */
+static double bench(block_if bi, block_no working_set, int nthreads){
+	pthread_t threads[nthreads];
+	struct bench_arg args[nthreads];
+	struct timespec start, end;
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < nthreads; i++) {
+		args[i].bi = bi;
+		args[i].working_set = working_set;
+		args[i].seed = i + 1;
+		pthread_create(&threads[i], 0, bench_thread, &args[i]);
+	}
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(threads[i], 0);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	return (double) nthreads * NREADS / secs;
+}
+
+int main(int argc, char **argv){
+	int max_threads = argc > 1 ? atoi(argv[1]) : 8;
+	unsigned int nshards = argc > 2 ? atoi(argv[2]) : 16;
+	block_no cache_size = argc > 3 ? atoi(argv[3]) : 4096;
+	block_no working_set = cache_size / 2;
+	double base[2] = { 0, 0 };
+	int nthreads, k;
+
+	block_if disk = ramdisk_init(blocks, DISK_SIZE);
+	block_t *cache = malloc(cache_size * BLOCK_SIZE);
+
+	printf("threads  1 shard: reads/sec  speedup  %u shards: reads/sec  speedup\n", nshards);
+	for (nthreads = 1; nthreads <= max_threads; nthreads *= 2) {
+		printf("%7d", nthreads);
+		for (k = 0; k < 2; k++) {
+			block_if cdisk = sharddisk_init(disk, cache, cache_size, k == 0 ? 1 : nshards);
+
+			bench(cdisk, working_set, 1);		// warm up the cache
+			double rate = bench(cdisk, working_set, nthreads);
+			if (nthreads == 1) {
+				base[k] = rate;
+			}
+			printf("  %18.0f  %7.2f", rate, rate / base[k]);
+			(*cdisk->destroy)(cdisk);
+		}
+		printf("\n");
+	}
+
+	(*disk->destroy)(disk);
+	free(cache);
+	return 0;
+}
@@ -0,0 +1,405 @@
+/* This block store module mirrors the underlying block store but contains
+ * a write-through cache that can be used by multiple threads at the same
+ * time.  The interface is as follows:
+ *
+ *		block_if sharddisk_init(block_if below, block_t *blocks,
+ *									block_no nblocks, unsigned int nshards)
+ *			'below' is the underlying block store.  'blocks' points to
+ *			a chunk of memory wth 'nblocks' blocks for caching.  The
+ *			cache is split into 'nshards' shards.
+ *
+ *		void sharddisk_dump_stats(block_if bi)
+ *			Prints the cache statistics, summed over all shards.
+ *
+ * Block numbers are spread over the shards by hash, and each shard is a
+ * CLOCK cache of its own with its own lock, hash index (see blockmap.h),
+ * clock hand, and statistics.  Threads that hit in different shards
+ * therefore do not get in each other's way.  The underlying block store
+ * need not be thread-safe: all calls to it are serialized by a separate
+ * lock.  A shard stays locked while one of its misses is served from
+ * below, so that the cache and the block store below see writes to the
+ * same block in the same order.
+ *
+ * Operations on ranges of blocks go one block at a time, as the blocks
+ * belong to different shards.  setsize locks all shards.
+ *
+ * Blocks may be pinned in the cache, as in clockdisk.  A pinned entry is
+ * not evicted until it has been unpinned as many times as it was pinned.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "block_if.h"
+#include "blockmap.h"
+
+#define SHARD_ALIGN		64		// cache line size
+
+struct shard_info {
+	enum { SI_EMPTY, SI_UNUSED, SI_USED } status;
+	block_no offset;
+	unsigned int pins;		// #outstanding pins; entry may not be evicted
+};
+
+/* One shard of the cache.  The lock protects all fields.  Shards are
+ * aligned to cache lines, so that threads using neighboring shards do not
+ * contend for the same lines.
+ */
+struct shard {
+	pthread_mutex_t lock;
+	block_t *blocks;			// memory for the cached blocks
+	unsigned int nblocks;		// #blocks in this shard
+	struct shard_info *binfo;	// information about each entry
+	struct blockmap map;		// offset -> entry
+	unsigned int clock_hand;	// next entry to consider for eviction
+
+	/* Stats.
+	 */
+	unsigned int read_hit, read_miss, write_hit, write_miss;
+} __attribute__((aligned(SHARD_ALIGN)));
+
+/* State contains the pointer to the block module below as well as the
+ * shards.
+ */
+struct sharddisk_state {
+	block_if below;				// block store below
+	pthread_mutex_t below_lock;	// serializes calls to the store below
+	block_no nblocks;			// #blocks in all the shards
+	unsigned int nshards;		// #shards
+	struct shard *shards;		// array of nshards shards
+};
+
+/* Find the shard for the given block.
+ */
+static struct shard *shard_of(struct sharddisk_state *ss, block_no offset){
+	uint32_t h = (uint32_t) offset * 0x9E3779B1u;
+
+	return &ss->shards[(h ^ (h >> 16)) % ss->nshards];
+}
+
+/* Choose an entry to hold a new block, using the clock algorithm and
+ * skipping pinned entries.  Returns -1 if all entries are pinned.  The
+ * caller holds the shard lock.
+ */
+static int shard_alloc(struct shard *sh){
+	unsigned int step;
+
+	if (sh->nblocks == 0) {
+		return -1;
+	}
+	for (step = 0; step < 2 * sh->nblocks; step++) {
+		struct shard_info *info = &sh->binfo[sh->clock_hand];
+		int i = sh->clock_hand;
+
+		if (++sh->clock_hand == sh->nblocks) {
+			sh->clock_hand = 0;
+		}
+		if (info->pins > 0) {
+			continue;
+		}
+		if (info->status == SI_USED) {
+			info->status = SI_UNUSED;
+			continue;
+		}
+		if (info->status == SI_UNUSED) {
+			blockmap_remove(&sh->map, info->offset);
+		}
+		info->status = SI_USED;
+		return i;
+	}
+	return -1;
+}
+
+/* Put the block in the shard, if there is room.  The caller holds the
+ * shard lock.
+ */
+static void shard_update(struct shard *sh, block_no offset, block_t *block){
+	int i = shard_alloc(sh);
+
+	if (i >= 0) {
+		sh->binfo[i].offset = offset;
+		blockmap_insert(&sh->map, offset, i);
+		memcpy(&sh->blocks[i], block, BLOCK_SIZE);
+	}
+}
+
+/* Drop cached blocks in [offset, offset + count) from the shard.  The
+ * caller holds the shard lock.
+ */
+static void shard_invalidate(struct shard *sh, block_no offset, block_no count){
+	unsigned int i;
+
+	for (i = 0; i < sh->nblocks; i++) {
+		if (sh->binfo[i].status != SI_EMPTY && sh->binfo[i].offset >= offset &&
+									sh->binfo[i].offset - offset < count) {
+			blockmap_remove(&sh->map, sh->binfo[i].offset);
+			sh->binfo[i].status = SI_EMPTY;
+		}
+	}
+}
+
+static int sharddisk_nblocks(block_if bi){
+	struct sharddisk_state *ss = bi->state;
+
+	pthread_mutex_lock(&ss->below_lock);
+	int r = (*ss->below->nblocks)(ss->below);
+	pthread_mutex_unlock(&ss->below_lock);
+	return r;
+}
+
+/* Lock all shards (in order, so this cannot deadlock) and drop the blocks
+ * that are cut off.
+ */
+static int sharddisk_setsize(block_if bi, block_no nblocks){
+	struct sharddisk_state *ss = bi->state;
+	unsigned int i;
+
+	for (i = 0; i < ss->nshards; i++) {
+		pthread_mutex_lock(&ss->shards[i].lock);
+	}
+	pthread_mutex_lock(&ss->below_lock);
+	int before = (*ss->below->setsize)(ss->below, nblocks);
+	pthread_mutex_unlock(&ss->below_lock);
+	for (i = 0; i < ss->nshards; i++) {
+		if (before > 0 && (block_no) before > nblocks) {
+			shard_invalidate(&ss->shards[i], nblocks, before - nblocks);
+		}
+		pthread_mutex_unlock(&ss->shards[i].lock);
+	}
+	return before;
+}
+
+static int sharddisk_read(block_if bi, block_no offset, block_t *block){
+	struct sharddisk_state *ss = bi->state;
+	struct shard *sh = shard_of(ss, offset);
+
+	pthread_mutex_lock(&sh->lock);
+	int i = blockmap_lookup(&sh->map, offset);
+	if (i >= 0) {
+		memcpy(block, &sh->blocks[i], BLOCK_SIZE);
+		sh->binfo[i].status = SI_USED;
+		sh->read_hit++;
+		pthread_mutex_unlock(&sh->lock);
+		return 0;
+	}
+
+	pthread_mutex_lock(&ss->below_lock);
+	int r = (*ss->below->read)(ss->below, offset, block);
+	pthread_mutex_unlock(&ss->below_lock);
+	if (r >= 0) {
+		shard_update(sh, offset, block);
+		sh->read_miss++;
+	}
+	pthread_mutex_unlock(&sh->lock);
+	return r;
+}
+
+static int sharddisk_write(block_if bi, block_no offset, block_t *block){
+	struct sharddisk_state *ss = bi->state;
+	struct shard *sh = shard_of(ss, offset);
+
+	pthread_mutex_lock(&sh->lock);
+	int i = blockmap_lookup(&sh->map, offset);
+	if (i >= 0) {
+		memcpy(&sh->blocks[i], block, BLOCK_SIZE);
+		sh->binfo[i].status = SI_USED;
+		sh->write_hit++;
+	}
+	else {
+		shard_update(sh, offset, block);
+		sh->write_miss++;
+	}
+
+	pthread_mutex_lock(&ss->below_lock);
+	int r = (*ss->below->write)(ss->below, offset, block);
+	pthread_mutex_unlock(&ss->below_lock);
+	pthread_mutex_unlock(&sh->lock);
+	return r;
+}
+
+static const block_t *sharddisk_pin(block_if bi, block_no offset){
+	struct sharddisk_state *ss = bi->state;
+	struct shard *sh = shard_of(ss, offset);
+	const block_t *result = 0;
+
+	pthread_mutex_lock(&sh->lock);
+	int i = blockmap_lookup(&sh->map, offset);
+	if (i >= 0) {
+		sh->binfo[i].status = SI_USED;
+		sh->read_hit++;
+	}
+	else if ((i = shard_alloc(sh)) >= 0) {
+		pthread_mutex_lock(&ss->below_lock);
+		int r = (*ss->below->read)(ss->below, offset, &sh->blocks[i]);
+		pthread_mutex_unlock(&ss->below_lock);
+		if (r < 0) {
+			sh->binfo[i].status = SI_EMPTY;
+			i = -1;
+		}
+		else {
+			sh->binfo[i].offset = offset;
+			blockmap_insert(&sh->map, offset, i);
+			sh->read_miss++;
+		}
+	}
+	if (i >= 0) {
+		sh->binfo[i].pins++;
+		result = &sh->blocks[i];
+	}
+	pthread_mutex_unlock(&sh->lock);
+	return result;
+}
+
+static void sharddisk_unpin(block_if bi, const block_t *block){
+	struct sharddisk_state *ss = bi->state;
+	unsigned int i;
+
+	for (i = 0; i < ss->nshards; i++) {
+		struct shard *sh = &ss->shards[i];
+
+		if (block >= sh->blocks && block < sh->blocks + sh->nblocks) {
+			pthread_mutex_lock(&sh->lock);
+			sh->binfo[block - sh->blocks].pins--;
+			pthread_mutex_unlock(&sh->lock);
+			return;
+		}
+	}
+}
+
+/* Drop any cached copies of the discarded blocks and pass the discard on
+ * to the block store below.
+ */
+static int sharddisk_discard(block_if bi, block_no offset, block_no count){
+	struct sharddisk_state *ss = bi->state;
+	block_no i, n = count;
+	int slot;
+
+	/* For large ranges, scan the shards rather than look up each block.
+	 */
+	if (count >= ss->nblocks) {
+		for (i = 0; i < ss->nshards; i++) {
+			pthread_mutex_lock(&ss->shards[i].lock);
+			shard_invalidate(&ss->shards[i], offset, count);
+			pthread_mutex_unlock(&ss->shards[i].lock);
+		}
+		n = 0;
+	}
+	for (i = 0; i < n; i++) {
+		struct shard *sh = shard_of(ss, offset + i);
+
+		pthread_mutex_lock(&sh->lock);
+		if ((slot = blockmap_remove(&sh->map, offset + i)) >= 0) {
+			sh->binfo[slot].status = SI_EMPTY;
+		}
+		pthread_mutex_unlock(&sh->lock);
+	}
+	pthread_mutex_lock(&ss->below_lock);
+	int r = block_discard(ss->below, offset, count);
+	pthread_mutex_unlock(&ss->below_lock);
+	return r;
+}
+
+/* The cache is write-through, so there is nothing to write back.
+ */
+static int sharddisk_flush(block_if bi){
+	struct sharddisk_state *ss = bi->state;
+
+	pthread_mutex_lock(&ss->below_lock);
+	int r = block_flush(ss->below);
+	pthread_mutex_unlock(&ss->below_lock);
+	return r;
+}
+
+static void sharddisk_destroy(block_if bi){
+	struct sharddisk_state *ss = bi->state;
+	unsigned int i;
+
+	for (i = 0; i < ss->nshards; i++) {
+		struct shard *sh = &ss->shards[i];
+
+		pthread_mutex_destroy(&sh->lock);
+		blockmap_free(&sh->map);
+		free(sh->binfo);
+	}
+	pthread_mutex_destroy(&ss->below_lock);
+	free(ss->shards);
+	free(ss);
+	free(bi);
+}
+
+void sharddisk_dump_stats(block_if bi){
+	struct sharddisk_state *ss = bi->state;
+	unsigned int i, read_hit = 0, read_miss = 0, write_hit = 0, write_miss = 0;
+
+	for (i = 0; i < ss->nshards; i++) {
+		struct shard *sh = &ss->shards[i];
+
+		pthread_mutex_lock(&sh->lock);
+		read_hit += sh->read_hit;
+		read_miss += sh->read_miss;
+		write_hit += sh->write_hit;
+		write_miss += sh->write_miss;
+		pthread_mutex_unlock(&sh->lock);
+	}
+	printf("!$SHARD: #shards:       %u\n", ss->nshards);
+	printf("!$SHARD: #read hits:    %u\n", read_hit);
+	printf("!$SHARD: #read misses:  %u\n", read_miss);
+	printf("!$SHARD: #write hits:   %u\n", write_hit);
+	printf("!$SHARD: #write misses: %u\n", write_miss);
+}
+
+/* Create a new block store module on top of the specified module below.
+ * blocks points to a chunk of memory of nblocks blocks that is divided
+ * evenly among nshards shards.
+ */
+block_if sharddisk_init(block_if below, block_t *blocks, block_no nblocks, unsigned int nshards){
+	unsigned int i;
+	block_no first = 0;
+
+	if (nshards > nblocks) {
+		nshards = nblocks;
+	}
+	if (nshards == 0) {
+		nshards = 1;
+	}
+
+	/* Create the block store state structure.
+	 */
+	struct sharddisk_state *ss = calloc(1, sizeof(*ss));
+	ss->below = below;
+	ss->nblocks = nblocks;
+	ss->nshards = nshards;
+	if (posix_memalign((void **) &ss->shards, SHARD_ALIGN,
+										nshards * sizeof(*ss->shards)) != 0) {
+		panic("sharddisk_init");
+	}
+	memset(ss->shards, 0, nshards * sizeof(*ss->shards));
+	pthread_mutex_init(&ss->below_lock, 0);
+	for (i = 0; i < nshards; i++) {
+		struct shard *sh = &ss->shards[i];
+
+		pthread_mutex_init(&sh->lock, 0);
+		sh->blocks = &blocks[first];
+		sh->nblocks = nblocks / nshards + (i < nblocks % nshards);
+		sh->binfo = calloc(sh->nblocks, sizeof(*sh->binfo));
+		blockmap_init(&sh->map, sh->nblocks);
+		first += sh->nblocks;
+	}
+
+	/* Return a block interface to this inode.
+	 */
+	block_if bi = calloc(1, sizeof(*bi));
+	bi->state = ss;
+	bi->nblocks = sharddisk_nblocks;
+	bi->setsize = sharddisk_setsize;
+	bi->read = sharddisk_read;
+	bi->write = sharddisk_write;
+	bi->destroy = sharddisk_destroy;
+	bi->flush = sharddisk_flush;
+	bi->pin = sharddisk_pin;
+	bi->unpin = sharddisk_unpin;
+	bi->discard = sharddisk_discard;
+	return bi;
+}
@@ -0,0 +1,328 @@
+/* This code implements a block store in memory that is allocated lazily,
+ * so that a large block store that is mostly empty takes little memory:
+ *
+ *		block_if sparsedisk_init(block_no nblocks, int huge)
+ *			Create a new block store with nblocks blocks, all of which
+ *			initially contain zeroes.  If 'huge' is set, memory is
+ *			taken from huge pages if the host has any reserved, and
+ *			otherwise advised to be backed by transparent huge pages.
+ *
+ *		void sparsedisk_dump_stats(block_if bi)
+ *			Print how much memory the block store is using.
+ *
+ * The blocks are divided into chunks of SPARSE_CHUNK blocks.  Memory for a
+ * chunk is mapped upon the first write of a non-zero block into it, and
+ * blocks in chunks without memory read as zeroes.  Shrinking the block
+ * store or discarding whole chunks releases their memory.  Discarded
+ * blocks read as zeroes, as do blocks beyond the end after the block
+ * store is grown again.
+ *
+ * Only blocks in chunks with memory can be pinned.  The size of the block
+ * store cannot be reduced while blocks are pinned, and discard does not
+ * release memory then.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "block_if.h"
+
+#define SPARSE_CHUNK	4096		// #blocks per chunk (2 MB)
+
+#define SPARSE_CHUNK_SIZE	((size_t) SPARSE_CHUNK * BLOCK_SIZE)
+
+struct sparsedisk_state {
+	block_no nblocks;			// #blocks in the block store
+	block_t **chunks;			// memory of each chunk, or null
+	block_no nchunks;			// size of the chunks array
+	int huge;					// use huge pages
+	char *hugetlb;				// per chunk: mapped from MAP_HUGETLB
+	unsigned int nhugetlb;		// #chunks mapped from MAP_HUGETLB
+	unsigned int pins;			// #outstanding pins
+	unsigned int nmapped;		// #chunks with memory
+	unsigned int maxmapped;		// high water mark of nmapped
+};
+
+static const block_t sparsedisk_zero;
+
+static int sparsedisk_nblocks(block_if bi){
+	struct sparsedisk_state *ss = bi->state;
+
+	return ss->nblocks;
+}
+
+/* Map memory for a chunk.  Try reserved huge pages first if so requested,
+ * and then fall back on ordinary pages.  The host may run out of reserved
+ * huge pages, so each chunk records which kind it got.
+ */
+static block_t *sparsedisk_map(struct sparsedisk_state *ss, block_no chunk){
+	void *p = MAP_FAILED;
+
+	ss->hugetlb[chunk] = 0;
+	if (ss->huge) {
+		p = mmap(0, SPARSE_CHUNK_SIZE, PROT_READ | PROT_WRITE,
+					MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (p != MAP_FAILED) {
+			ss->hugetlb[chunk] = 1;
+			ss->nhugetlb++;
+		}
+	}
+	if (p == MAP_FAILED) {
+		p = mmap(0, SPARSE_CHUNK_SIZE, PROT_READ | PROT_WRITE,
+					MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (p == MAP_FAILED) {
+			perror("sparsedisk_map");
+			return 0;
+		}
+		if (ss->huge) {
+			(void) madvise(p, SPARSE_CHUNK_SIZE, MADV_HUGEPAGE);
+		}
+	}
+	if (++ss->nmapped > ss->maxmapped) {
+		ss->maxmapped = ss->nmapped;
+	}
+	return ss->chunks[chunk] = p;
+}
+
+static void sparsedisk_unmap(struct sparsedisk_state *ss, block_no chunk){
+	if (ss->chunks[chunk] != 0) {
+		munmap(ss->chunks[chunk], SPARSE_CHUNK_SIZE);
+		ss->chunks[chunk] = 0;
+		ss->nmapped--;
+		if (ss->hugetlb[chunk]) {
+			ss->hugetlb[chunk] = 0;
+			ss->nhugetlb--;
+		}
+	}
+}
+
+/* Clear the 'count' blocks starting at offset.  Chunks that are cleared
+ * entirely lose their memory, unless blocks are pinned.  Otherwise, pages
+ * are returned to the host where possible, which makes them read as zero.
+ */
+static void sparsedisk_clear(struct sparsedisk_state *ss, block_no offset, block_no count){
+	size_t pagesize = sysconf(_SC_PAGESIZE);
+
+	while (count > 0) {
+		block_no chunk = offset / SPARSE_CHUNK, first = offset % SPARSE_CHUNK;
+		block_no n = SPARSE_CHUNK - first;
+		if (n > count) {
+			n = count;
+		}
+		block_t *blocks = ss->chunks[chunk];
+		if (blocks == 0) {
+			/* nothing to do */
+		}
+		else if (n == SPARSE_CHUNK && ss->pins == 0) {
+			sparsedisk_unmap(ss, chunk);
+		}
+		else {
+			char *start = (char *) &blocks[first], *end = (char *) &blocks[first + n];
+			char *lo = (char *) (((uintptr_t) start + pagesize - 1) & ~(pagesize - 1));
+			char *hi = (char *) ((uintptr_t) end & ~(pagesize - 1));
+			if (!ss->hugetlb[chunk] && lo < hi && madvise(lo, hi - lo, MADV_DONTNEED) == 0) {
+				memset(start, 0, lo - start);
+				memset(hi, 0, end - hi);
+			}
+			else {
+				memset(start, 0, end - start);
+			}
+		}
+		offset += n;
+		count -= n;
+	}
+}
+
+static int sparsedisk_setsize(block_if bi, block_no nblocks){
+	struct sparsedisk_state *ss = bi->state;
+	block_no nchunks = (nblocks + SPARSE_CHUNK - 1) / SPARSE_CHUNK;
+
+	if (nblocks < ss->nblocks) {
+		if (ss->pins != 0) {
+			fprintf(stderr, "sparsedisk_setsize: blocks are pinned\n");
+			return -1;
+		}
+		sparsedisk_clear(ss, nblocks, ss->nblocks - nblocks);
+	}
+	if (nchunks > ss->nchunks) {
+		char *hugetlb = realloc(ss->hugetlb, nchunks);
+		if (hugetlb == 0) {
+			fprintf(stderr, "sparsedisk_setsize: out of memory\n");
+			return -1;
+		}
+		memset(&hugetlb[ss->nchunks], 0, nchunks - ss->nchunks);
+		ss->hugetlb = hugetlb;
+		block_t **chunks = realloc(ss->chunks, nchunks * sizeof(*chunks));
+		if (chunks == 0) {
+			fprintf(stderr, "sparsedisk_setsize: out of memory\n");
+			return -1;
+		}
+		memset(&chunks[ss->nchunks], 0, (nchunks - ss->nchunks) * sizeof(*chunks));
+		ss->chunks = chunks;
+		ss->nchunks = nchunks;
+	}
+
+	int before = ss->nblocks;
+	ss->nblocks = nblocks;
+	return before;
+}
+
+static int sparsedisk_readv(block_if bi, block_no offset, block_no count, block_t *blocks){
+	struct sparsedisk_state *ss = bi->state;
+
+	if (count > ss->nblocks || offset > ss->nblocks - count) {
+		fprintf(stderr, "sparsedisk_read: bad range %u %u\n", offset, count);
+		return -1;
+	}
+	while (count > 0) {
+		block_no chunk = offset / SPARSE_CHUNK, first = offset % SPARSE_CHUNK;
+		block_no n = SPARSE_CHUNK - first;
+		if (n > count) {
+			n = count;
+		}
+		if (ss->chunks[chunk] == 0) {
+			memset(blocks, 0, (size_t) n * BLOCK_SIZE);
+		}
+		else {
+			memcpy(blocks, &ss->chunks[chunk][first], (size_t) n * BLOCK_SIZE);
+		}
+		offset += n;
+		count -= n;
+		blocks += n;
+	}
+	return 0;
+}
+
+/* Writing zeroes into a chunk without memory does not need any memory.
+ */
+static int sparsedisk_iszero(block_t *blocks, block_no count){
+	block_no i;
+
+	for (i = 0; i < count; i++) {
+		if (memcmp(&blocks[i], &sparsedisk_zero, BLOCK_SIZE) != 0) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static int sparsedisk_writev(block_if bi, block_no offset, block_no count, block_t *blocks){
+	struct sparsedisk_state *ss = bi->state;
+
+	if (count > ss->nblocks || offset > ss->nblocks - count) {
+		fprintf(stderr, "sparsedisk_write: bad range %u %u\n", offset, count);
+		return -1;
+	}
+	while (count > 0) {
+		block_no chunk = offset / SPARSE_CHUNK, first = offset % SPARSE_CHUNK;
+		block_no n = SPARSE_CHUNK - first;
+		if (n > count) {
+			n = count;
+		}
+		if (ss->chunks[chunk] == 0 && !sparsedisk_iszero(blocks, n) &&
+								sparsedisk_map(ss, chunk) == 0) {
+			return -1;
+		}
+		if (ss->chunks[chunk] != 0) {
+			memcpy(&ss->chunks[chunk][first], blocks, (size_t) n * BLOCK_SIZE);
+		}
+		offset += n;
+		count -= n;
+		blocks += n;
+	}
+	return 0;
+}
+
+static int sparsedisk_read(block_if bi, block_no offset, block_t *block){
+	return sparsedisk_readv(bi, offset, 1, block);
+}
+
+static int sparsedisk_write(block_if bi, block_no offset, block_t *block){
+	return sparsedisk_writev(bi, offset, 1, block);
+}
+
+/* Blocks in chunks without memory cannot be pinned, in which case the
+ * caller falls back on reading the block (which is all zeroes).
+ */
+static const block_t *sparsedisk_pin(block_if bi, block_no offset){
+	struct sparsedisk_state *ss = bi->state;
+
+	if (offset >= ss->nblocks) {
+		fprintf(stderr, "sparsedisk_pin: bad offset %u\n", offset);
+		return 0;
+	}
+	block_t *blocks = ss->chunks[offset / SPARSE_CHUNK];
+	if (blocks == 0) {
+		return 0;
+	}
+	ss->pins++;
+	return &blocks[offset % SPARSE_CHUNK];
+}
+
+static void sparsedisk_unpin(block_if bi, const block_t *block){
+	struct sparsedisk_state *ss = bi->state;
+
+	ss->pins--;
+}
+
+static int sparsedisk_discard(block_if bi, block_no offset, block_no count){
+	struct sparsedisk_state *ss = bi->state;
+
+	if (count > ss->nblocks || offset > ss->nblocks - count) {
+		fprintf(stderr, "sparsedisk_discard: bad range %u %u\n", offset, count);
+		return -1;
+	}
+	sparsedisk_clear(ss, offset, count);
+	return 0;
+}
+
+static void sparsedisk_destroy(block_if bi){
+	struct sparsedisk_state *ss = bi->state;
+	block_no i;
+
+	for (i = 0; i < ss->nchunks; i++) {
+		sparsedisk_unmap(ss, i);
+	}
+	free(ss->chunks);
+	free(ss->hugetlb);
+	free(ss);
+	free(bi);
+}
+
+void sparsedisk_dump_stats(block_if bi){
+	struct sparsedisk_state *ss = bi->state;
+
+	printf("!$SPARSE: #chunks:     %u\n", (ss->nblocks + SPARSE_CHUNK - 1) / SPARSE_CHUNK);
+	printf("!$SPARSE: #mapped:     %u\n", ss->nmapped);
+	printf("!$SPARSE: #max mapped: %u\n", ss->maxmapped);
+	printf("!$SPARSE: huge pages:  %s\n", ss->huge ? "yes" : "no");
+	printf("!$SPARSE: #hugetlb:    %u\n", ss->nhugetlb);
+}
+
+block_if sparsedisk_init(block_no nblocks, int huge){
+	struct sparsedisk_state *ss = calloc(1, sizeof(*ss));
+
+	ss->huge = huge;
+
+	block_if bi = calloc(1, sizeof(*bi));
+	bi->state = ss;
+	bi->nblocks = sparsedisk_nblocks;
+	bi->setsize = sparsedisk_setsize;
+	bi->read = sparsedisk_read;
+	bi->write = sparsedisk_write;
+	bi->destroy = sparsedisk_destroy;
+	bi->readv = sparsedisk_readv;
+	bi->writev = sparsedisk_writev;
+	bi->pin = sparsedisk_pin;
+	bi->unpin = sparsedisk_unpin;
+	bi->discard = sparsedisk_discard;
+
+	if (sparsedisk_setsize(bi, nblocks) < 0) {
+		panic("sparsedisk_init");
+	}
+	return bi;
+}
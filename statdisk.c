@@ -48,6 +48,44 @@ static int statdisk_write(block_if bi, block_no offset, block_t *block){
 	return (*sds->below->write)(sds->below, offset, block);
 }
 
+/* Pinning a block counts as reading it.
+ */
+static const block_t *statdisk_pin(block_if bi, block_no offset){
+	struct statdisk_state *sds = bi->state;
+
+	const block_t *block = (*sds->below->pin)(sds->below, offset);
+	if (block != 0) {
+		sds->nread++;
+	}
+	return block;
+}
+
+static void statdisk_unpin(block_if bi, const block_t *block){
+	struct statdisk_state *sds = bi->state;
+
+	if (sds->below->unpin != 0) {
+		(*sds->below->unpin)(sds->below, block);
+	}
+}
+
+static int statdisk_discard(block_if bi, block_no offset, block_no count){
+	struct statdisk_state *sds = bi->state;
+
+	return block_discard(sds->below, offset, count);
+}
+
+static int statdisk_flush(block_if bi){
+	struct statdisk_state *sds = bi->state;
+
+	return block_flush(sds->below);
+}
+
+static void statdisk_hint(block_if bi, block_no offset, enum block_class cls){
+	struct statdisk_state *sds = bi->state;
+
+	block_hint(sds->below, offset, cls);
+}
+
 static void statdisk_destroy(block_if bi){
 	free(bi->state);
 	free(bi);
@@ -77,5 +115,12 @@ block_if statdisk_init(block_if below){
 	bi->read = statdisk_read;
 	bi->write = statdisk_write;
 	bi->destroy = statdisk_destroy;
+	bi->flush = statdisk_flush;
+	bi->discard = statdisk_discard;
+	bi->hint = statdisk_hint;
+	if (below->pin != 0) {
+		bi->pin = statdisk_pin;
+		bi->unpin = statdisk_unpin;
+	}
 	return bi;
 }
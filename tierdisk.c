@@ -0,0 +1,397 @@
+/* This block store module mirrors the underlying block store but contains
+ * a write-through cache with two tiers: a small one in memory, and a
+ * larger one kept in another block store, typically a disk_init() file on
+ * fast local storage.  The interface is as follows:
+ *
+ *		block_if tierdisk_init(block_if below, block_t *blocks,
+ *									block_no nblocks, block_if tier2)
+ *			'below' is the underlying block store.  'blocks' points to
+ *			a chunk of memory with 'nblocks' blocks for the first tier.
+ *			All blocks of 'tier2' are used for the second tier.
+ *
+ *		void tierdisk_dump_stats(block_if bi)
+ *			Prints the statistics of both tiers.
+ *
+ * The first tier is a CLOCK cache, like clockdisk.  A block that it evicts
+ * is written to the second tier, which is replaced in FIFO order and has
+ * its own index from block numbers to its blocks.  A read that misses the
+ * first tier but hits the second is served from the second tier without
+ * touching the block store below, and the block moves back to the first
+ * tier.  A block is thus in at most one tier at a time.  As the cache is
+ * write-through, blocks evicted from the second tier are simply dropped,
+ * and a second tier that fails just makes for more misses.
+ *
+ * The second tier's block store is not destroyed along with this one.
+ *
+ * Blocks may be pinned in the first tier, as in clockdisk.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "block_if.h"
+#include "blockmap.h"
+
+/* Information about an entry of the first tier.
+ */
+struct tier_info {
+	enum {
+		TI_EMPTY,			// cache entry not in use
+		TI_UNUSED,			// in use, but not recently used
+		TI_USED				// recently used
+	} status;
+	block_no offset;		// block being cached if not TI_EMPTY
+	unsigned int pins;		// #outstanding pins; entry may not be evicted
+};
+
+/* Information about a block of the second tier.
+ */
+struct tier2_info {
+	int valid;				// holds a cached block
+	block_no offset;		// block being cached if valid
+};
+
+struct tierdisk_state {
+	block_if below;				// block store below
+
+	/* First tier.
+	 */
+	block_t *blocks;			// memory for caching blocks
+	block_no nblocks;			// size of the first tier
+	struct tier_info *binfo;	// info per entry
+	struct blockmap map;		// offset to entry of cached blocks
+	unsigned int clock_hand;	// rotating hand for clock algorithm
+
+	/* Second tier.
+	 */
+	block_if tier2;				// block store holding the second tier
+	block_no nblocks2;			// size of the second tier
+	struct tier2_info *info2;	// info per block of tier2
+	struct blockmap map2;		// offset to block of tier2
+	unsigned int fifo_hand;		// next block of tier2 to replace
+
+	/* Stats.
+	 */
+	unsigned int read_hit, read_hit2, read_miss;
+	unsigned int write_hit, write_miss;
+	unsigned int demoted;		// #blocks moved from tier 1 to tier 2
+	unsigned int promoted;		// #blocks moved from tier 2 to tier 1
+	unsigned int evicted2;		// #blocks dropped from tier 2
+	unsigned int errors2;		// #failed reads and writes of tier 2
+};
+
+/* Drop the copy of the given block from the second tier, if any.
+ */
+static void tier2_drop(struct tierdisk_state *ts, block_no offset){
+	int i = blockmap_remove(&ts->map2, offset);
+
+	if (i >= 0) {
+		ts->info2[i].valid = 0;
+	}
+}
+
+/* Put a block evicted from the first tier into the second tier, replacing
+ * the oldest block there.
+ */
+static void tier2_put(struct tierdisk_state *ts, block_no offset, block_t *block){
+	if (ts->nblocks2 == 0) {
+		return;
+	}
+
+	unsigned int i = ts->fifo_hand;
+	ts->fifo_hand = (ts->fifo_hand + 1) % ts->nblocks2;
+	if (ts->info2[i].valid) {
+		blockmap_remove(&ts->map2, ts->info2[i].offset);
+		ts->info2[i].valid = 0;
+		ts->evicted2++;
+	}
+	if ((*ts->tier2->write)(ts->tier2, i, block) < 0) {
+		ts->errors2++;
+		return;
+	}
+	ts->info2[i].valid = 1;
+	ts->info2[i].offset = offset;
+	blockmap_insert(&ts->map2, offset, i);
+	ts->demoted++;
+}
+
+/* Take the given block out of the second tier.  Returns 0 if it was there
+ * and could be read, or -1 otherwise.
+ */
+static int tier2_take(struct tierdisk_state *ts, block_no offset, block_t *block){
+	int i = blockmap_remove(&ts->map2, offset);
+
+	if (i < 0) {
+		return -1;
+	}
+	ts->info2[i].valid = 0;
+	if ((*ts->tier2->read)(ts->tier2, i, block) < 0) {
+		ts->errors2++;
+		return -1;
+	}
+	return 0;
+}
+
+/* Find an entry in the first tier for a new block, using the clock
+ * algorithm and skipping pinned entries.  The block that was in it moves
+ * to the second tier.  Returns the index of the entry or -1 if all
+ * entries are pinned.
+ */
+static int tier_alloc(struct tierdisk_state *ts){
+	unsigned int n;
+
+	for (n = 0; n < 2 * ts->nblocks; n++) {
+		struct tier_info *info = &ts->binfo[ts->clock_hand];
+		int i = ts->clock_hand;
+
+		if (++ts->clock_hand == ts->nblocks) {
+			ts->clock_hand = 0;
+		}
+		if (info->pins > 0) {
+			continue;
+		}
+		if (info->status == TI_USED) {
+			info->status = TI_UNUSED;
+			continue;
+		}
+		if (info->status == TI_UNUSED) {
+			blockmap_remove(&ts->map, info->offset);
+			tier2_put(ts, info->offset, &ts->blocks[i]);
+		}
+		info->status = TI_USED;
+		return i;
+	}
+	return -1;
+}
+
+/* Put a block in the first tier, if there is room.  Returns the index of
+ * its entry, or -1.
+ */
+static int tier_insert(struct tierdisk_state *ts, block_no offset, block_t *block){
+	int i = tier_alloc(ts);
+
+	if (i >= 0) {
+		ts->binfo[i].offset = offset;
+		blockmap_insert(&ts->map, offset, i);
+		memcpy(&ts->blocks[i], block, BLOCK_SIZE);
+	}
+	return i;
+}
+
+/* Drop the cached copies of blocks in [offset, offset + count) from both
+ * tiers.
+ */
+static void tier_invalidate(struct tierdisk_state *ts, block_no offset, block_no count){
+	block_no i;
+
+	for (i = 0; i < ts->nblocks; i++) {
+		if (ts->binfo[i].status != TI_EMPTY && ts->binfo[i].offset >= offset &&
+									ts->binfo[i].offset - offset < count) {
+			blockmap_remove(&ts->map, ts->binfo[i].offset);
+			ts->binfo[i].status = TI_EMPTY;
+		}
+	}
+	for (i = 0; i < ts->nblocks2; i++) {
+		if (ts->info2[i].valid && ts->info2[i].offset >= offset &&
+									ts->info2[i].offset - offset < count) {
+			blockmap_remove(&ts->map2, ts->info2[i].offset);
+			ts->info2[i].valid = 0;
+		}
+	}
+}
+
+static int tierdisk_nblocks(block_if bi){
+	struct tierdisk_state *ts = bi->state;
+
+	return (*ts->below->nblocks)(ts->below);
+}
+
+static int tierdisk_setsize(block_if bi, block_no nblocks){
+	struct tierdisk_state *ts = bi->state;
+
+	int before = (*ts->below->setsize)(ts->below, nblocks);
+	if (before > 0 && (block_no) before > nblocks) {
+		tier_invalidate(ts, nblocks, before - nblocks);
+	}
+	return before;
+}
+
+/* Try the first tier, then the second, and then the block store below.
+ */
+static int tierdisk_read(block_if bi, block_no offset, block_t *block){
+	struct tierdisk_state *ts = bi->state;
+
+	int i = blockmap_lookup(&ts->map, offset);
+	if (i >= 0) {
+		memcpy(block, &ts->blocks[i], BLOCK_SIZE);
+		ts->binfo[i].status = TI_USED;
+		ts->read_hit++;
+		return 0;
+	}
+
+	if (tier2_take(ts, offset, block) == 0) {
+		ts->read_hit2++;
+		if (tier_insert(ts, offset, block) >= 0) {
+			ts->promoted++;
+		}
+		return 0;
+	}
+
+	int r = (*ts->below->read)(ts->below, offset, block);
+	if (r >= 0) {
+		tier_insert(ts, offset, block);
+		ts->read_miss++;
+	}
+	return r;
+}
+
+/* Written blocks go into the first tier, and any older copy in the second
+ * tier is dropped.
+ */
+static int tierdisk_write(block_if bi, block_no offset, block_t *block){
+	struct tierdisk_state *ts = bi->state;
+
+	int i = blockmap_lookup(&ts->map, offset);
+	if (i >= 0) {
+		memcpy(&ts->blocks[i], block, BLOCK_SIZE);
+		ts->binfo[i].status = TI_USED;
+		ts->write_hit++;
+	}
+	else {
+		tier2_drop(ts, offset);
+		tier_insert(ts, offset, block);
+		ts->write_miss++;
+	}
+	return (*ts->below->write)(ts->below, offset, block);
+}
+
+/* Pin the block at the given offset in the first tier, bringing it in
+ * from the second tier or the store below if necessary.
+ */
+static const block_t *tierdisk_pin(block_if bi, block_no offset){
+	struct tierdisk_state *ts = bi->state;
+	block_t block;
+
+	int i = blockmap_lookup(&ts->map, offset);
+	if (i >= 0) {
+		ts->binfo[i].status = TI_USED;
+		ts->read_hit++;
+	}
+	else {
+		if (tier2_take(ts, offset, &block) == 0) {
+			ts->read_hit2++;
+			ts->promoted++;
+		}
+		else if ((*ts->below->read)(ts->below, offset, &block) < 0) {
+			return 0;
+		}
+		else {
+			ts->read_miss++;
+		}
+		if ((i = tier_insert(ts, offset, &block)) < 0) {
+			return 0;
+		}
+	}
+	ts->binfo[i].pins++;
+	return &ts->blocks[i];
+}
+
+static void tierdisk_unpin(block_if bi, const block_t *block){
+	struct tierdisk_state *ts = bi->state;
+
+	ts->binfo[block - ts->blocks].pins--;
+}
+
+static int tierdisk_discard(block_if bi, block_no offset, block_no count){
+	struct tierdisk_state *ts = bi->state;
+	block_no i;
+	int slot;
+
+	if (count < ts->nblocks + ts->nblocks2) {
+		for (i = 0; i < count; i++) {
+			if ((slot = blockmap_remove(&ts->map, offset + i)) >= 0) {
+				ts->binfo[slot].status = TI_EMPTY;
+			}
+			tier2_drop(ts, offset + i);
+		}
+	}
+	else {
+		tier_invalidate(ts, offset, count);
+	}
+	return block_discard(ts->below, offset, count);
+}
+
+/* The cache is write-through, so the second tier never holds the only
+ * copy of a block and need not be flushed.
+ */
+static int tierdisk_flush(block_if bi){
+	struct tierdisk_state *ts = bi->state;
+
+	return block_flush(ts->below);
+}
+
+static void tierdisk_destroy(block_if bi){
+	struct tierdisk_state *ts = bi->state;
+
+	blockmap_free(&ts->map);
+	blockmap_free(&ts->map2);
+	free(ts->binfo);
+	free(ts->info2);
+	free(ts);
+	free(bi);
+}
+
+void tierdisk_dump_stats(block_if bi){
+	struct tierdisk_state *ts = bi->state;
+
+	printf("!$TIER: #read hits 1:   %u\n", ts->read_hit);
+	printf("!$TIER: #read hits 2:   %u\n", ts->read_hit2);
+	printf("!$TIER: #read misses:   %u\n", ts->read_miss);
+	printf("!$TIER: #write hits:    %u\n", ts->write_hit);
+	printf("!$TIER: #write misses:  %u\n", ts->write_miss);
+	printf("!$TIER: #demoted:       %u\n", ts->demoted);
+	printf("!$TIER: #promoted:      %u\n", ts->promoted);
+	printf("!$TIER: #evicted 2:     %u\n", ts->evicted2);
+	printf("!$TIER: #errors 2:      %u\n", ts->errors2);
+}
+
+/* Create a new block store module on top of the specified module below.
+ * blocks points to a chunk of memory of nblocks blocks for the first tier,
+ * and tier2 is the block store for the second tier.
+ */
+block_if tierdisk_init(block_if below, block_t *blocks, block_no nblocks, block_if tier2){
+	int nblocks2 = (*tier2->nblocks)(tier2);
+
+	if (nblocks == 0 || nblocks2 < 0) {
+		fprintf(stderr, "tierdisk_init: bad tier sizes\n");
+		return 0;
+	}
+
+	/* Create the block store state structure.
+	 */
+	struct tierdisk_state *ts = calloc(1, sizeof(*ts));
+	ts->below = below;
+	ts->blocks = blocks;
+	ts->nblocks = nblocks;
+	ts->binfo = calloc(nblocks, sizeof(*ts->binfo));
+	blockmap_init(&ts->map, nblocks);
+	ts->tier2 = tier2;
+	ts->nblocks2 = nblocks2;
+	ts->info2 = calloc(nblocks2 + 1, sizeof(*ts->info2));
+	blockmap_init(&ts->map2, nblocks2);
+
+	/* Return a block interface to this inode.
+	 */
+	block_if bi = calloc(1, sizeof(*bi));
+	bi->state = ts;
+	bi->nblocks = tierdisk_nblocks;
+	bi->setsize = tierdisk_setsize;
+	bi->read = tierdisk_read;
+	bi->write = tierdisk_write;
+	bi->destroy = tierdisk_destroy;
+	bi->flush = tierdisk_flush;
+	bi->pin = tierdisk_pin;
+	bi->unpin = tierdisk_unpin;
+	bi->discard = tierdisk_discard;
+	return bi;
+}
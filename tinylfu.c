@@ -0,0 +1,132 @@
+/* The TinyLFU cache admission filter.  See tinylfu.h for the interface.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "block_if.h"
+#include "tinylfu.h"
+
+#define TINYLFU_WORDBITS	(8 * sizeof(unsigned long))
+
+/* Derive two independent-looking hashes from a block number.  Row i of
+ * the sketch uses h1 + i * h2 (double hashing).
+ */
+static void tinylfu_hash(block_no offset, uint32_t *h1, uint32_t *h2){
+	uint64_t h = (uint64_t) offset * 0x9E3779B97F4A7C15ull;
+
+	h ^= h >> 31;
+	h *= 0xBF58476D1CE4E5B9ull;
+	h ^= h >> 29;
+	*h1 = (uint32_t) h;
+	*h2 = (uint32_t) (h >> 32) | 1;
+}
+
+static unsigned int tinylfu_pow2(unsigned int n){
+	unsigned int size = 16;
+
+	while (size < n) {
+		size *= 2;
+	}
+	return size;
+}
+
+void tinylfu_init(struct tinylfu *tf, unsigned int nentries){
+	memset(tf, 0, sizeof(*tf));
+	tf->mask = tinylfu_pow2(nentries) - 1;
+	tf->sample_size = 10 * (nentries == 0 ? 1 : nentries);
+	tf->dk_mask = tinylfu_pow2(4 * tf->sample_size) - 1;
+	tf->sketch = calloc(TINYLFU_DEPTH, tf->mask + 1);
+	tf->doorkeeper = calloc((tf->dk_mask + 1) / TINYLFU_WORDBITS, sizeof(unsigned long));
+	if (tf->sketch == 0 || tf->doorkeeper == 0) {
+		panic("tinylfu_init");
+	}
+}
+
+/* Check whether the block is in the doorkeeper, and add it if not.
+ * Returns whether it was in there.
+ */
+static int tinylfu_doorkeeper(struct tinylfu *tf, uint32_t h1, uint32_t h2){
+	unsigned int b1 = h1 & tf->dk_mask, b2 = h2 & tf->dk_mask;
+	unsigned long m1 = 1UL << (b1 % TINYLFU_WORDBITS);
+	unsigned long m2 = 1UL << (b2 % TINYLFU_WORDBITS);
+	unsigned long *w1 = &tf->doorkeeper[b1 / TINYLFU_WORDBITS];
+	unsigned long *w2 = &tf->doorkeeper[b2 / TINYLFU_WORDBITS];
+
+	if ((*w1 & m1) && (*w2 & m2)) {
+		return 1;
+	}
+	*w1 |= m1;
+	*w2 |= m2;
+	return 0;
+}
+
+/* Halve all counters and clear the doorkeeper.
+ */
+static void tinylfu_reset(struct tinylfu *tf){
+	unsigned int i;
+
+	for (i = 0; i < TINYLFU_DEPTH * (tf->mask + 1); i++) {
+		tf->sketch[i] >>= 1;
+	}
+	memset(tf->doorkeeper, 0, (tf->dk_mask + 1) / 8);
+	tf->samples /= 2;
+	tf->resets++;
+}
+
+void tinylfu_record(struct tinylfu *tf, block_no offset){
+	uint32_t h1, h2;
+	unsigned int i;
+
+	tinylfu_hash(offset, &h1, &h2);
+	if (tinylfu_doorkeeper(tf, h1, h2)) {
+		for (i = 0; i < TINYLFU_DEPTH; i++) {
+			unsigned char *c = &tf->sketch[i * (tf->mask + 1) + ((h1 + i * h2) & tf->mask)];
+			if (*c < TINYLFU_MAX) {
+				(*c)++;
+			}
+		}
+	}
+	if (++tf->samples >= tf->sample_size) {
+		tinylfu_reset(tf);
+	}
+}
+
+/* Estimate the number of recent accesses to the block: the smallest of its
+ * counters, plus one if it is in the doorkeeper.
+ */
+static unsigned int tinylfu_estimate(struct tinylfu *tf, block_no offset){
+	uint32_t h1, h2;
+	unsigned int i, est = TINYLFU_MAX;
+
+	tinylfu_hash(offset, &h1, &h2);
+	for (i = 0; i < TINYLFU_DEPTH; i++) {
+		unsigned char c = tf->sketch[i * (tf->mask + 1) + ((h1 + i * h2) & tf->mask)];
+		if (c < est) {
+			est = c;
+		}
+	}
+	unsigned int b1 = h1 & tf->dk_mask, b2 = h2 & tf->dk_mask;
+	if ((tf->doorkeeper[b1 / TINYLFU_WORDBITS] & (1UL << (b1 % TINYLFU_WORDBITS))) &&
+			(tf->doorkeeper[b2 / TINYLFU_WORDBITS] & (1UL << (b2 % TINYLFU_WORDBITS)))) {
+		est++;
+	}
+	return est;
+}
+
+int tinylfu_admit(struct tinylfu *tf, block_no candidate, block_no victim){
+	if (tinylfu_estimate(tf, candidate) > tinylfu_estimate(tf, victim)) {
+		tf->accepted++;
+		return 1;
+	}
+	tf->rejected++;
+	return 0;
+}
+
+void tinylfu_free(struct tinylfu *tf){
+	free(tf->sketch);
+	free(tf->doorkeeper);
+	tf->sketch = 0;
+	tf->doorkeeper = 0;
+}
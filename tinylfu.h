@@ -0,0 +1,52 @@
+/* TinyLFU (Einziger, Friedman and Manes, ACM ToS 2017) is an admission
+ * filter for caches.  It estimates how often each block was accessed
+ * recently, and only lets a missed block into the cache if it was used
+ * more often than the block it would evict.  This keeps blocks that are
+ * used once from pushing out blocks that are used over and over.
+ *
+ *		void tinylfu_init(struct tinylfu *tf, unsigned int nentries)
+ *			Initialize a filter for a cache of 'nentries' entries.
+ *
+ *		void tinylfu_record(struct tinylfu *tf, block_no offset)
+ *			Record an access to the given block, whether it hit or not.
+ *
+ *		int tinylfu_admit(struct tinylfu *tf, block_no candidate,
+ *														block_no victim)
+ *			Return whether 'candidate' should replace 'victim' in the
+ *			cache, and count the decision.
+ *
+ *		void tinylfu_free(struct tinylfu *tf)
+ *			Release the memory of the filter.
+ *
+ * Frequencies are kept in a count-min sketch of TINYLFU_DEPTH rows of
+ * small saturating counters.  The first access to a block since the last
+ * reset only sets its bits in a Bloom filter, the "doorkeeper", so blocks
+ * that are used once take no space in the sketch.  After a number of
+ * accesses ten times the size of the cache, all counters are halved and
+ * the doorkeeper is cleared, so the estimates follow changes in the load.
+ *
+ * Include "block_if.h" before this file.
+ */
+
+#define TINYLFU_DEPTH		4		// #rows in the count-min sketch
+#define TINYLFU_MAX			15		// max value of a counter
+
+struct tinylfu {
+	unsigned char *sketch;		// TINYLFU_DEPTH rows of counters
+	unsigned int mask;			// #counters per row minus 1
+	unsigned long *doorkeeper;	// Bloom filter bits
+	unsigned int dk_mask;		// #bits in the doorkeeper minus 1
+	unsigned int samples;		// #accesses since the last reset
+	unsigned int sample_size;	// #accesses between resets
+
+	/* Stats.
+	 */
+	unsigned int accepted;		// #candidates admitted
+	unsigned int rejected;		// #candidates turned away
+	unsigned int resets;		// #times the counters were halved
+};
+
+void tinylfu_init(struct tinylfu *tf, unsigned int nentries);
+void tinylfu_record(struct tinylfu *tf, block_no offset);
+int tinylfu_admit(struct tinylfu *tf, block_no candidate, block_no victim);
+void tinylfu_free(struct tinylfu *tf);
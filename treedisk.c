@@ -31,6 +31,12 @@ struct treedisk_snapshot {
 	union treedisk_block inodeblock;
 	block_no inode_blockno;
 	struct treedisk_inode *inode;
+
+	/* Range of freed blocks not yet discarded below.  Blocks are often
+	 * freed in order, so this lets the layers below see fewer, larger
+	 * discards.
+	 */
+	block_no discard_start, discard_count;
 };
 
 /* The state of a virtual block store, which is identified by an inode number.
@@ -60,6 +66,7 @@ static int treedisk_get_snapshot(struct treedisk_snapshot *snapshot,
 								block_if below, unsigned int inode_no){
 	/* Get the superblock.
 	 */
+	block_hint(below, 0, BLOCK_SUPER);
 	if ((*below->read)(below, 0, (block_t *) &snapshot->superblock) < 0) {
 		return -1;
 	}
@@ -74,6 +81,7 @@ static int treedisk_get_snapshot(struct treedisk_snapshot *snapshot,
 	/* Find the inode.
 	 */
 	snapshot->inode_blockno = 1 + inode_no / INODES_PER_BLOCK;
+	block_hint(below, snapshot->inode_blockno, BLOCK_INODE);
 	if ((*below->read)(below, snapshot->inode_blockno, (block_t *) &snapshot->inodeblock) < 0) {
 		return -1;
 	}
@@ -93,6 +101,7 @@ static block_no treedisk_alloc_block(block_if below, struct treedisk_snapshot *s
 	/* Read the freelist block and scan for a free block reference.
 	 */
 	union treedisk_block freelistblock;
+	block_hint(below, b, BLOCK_FREELIST);
 	if ((*below->read)(below, b, (block_t *) &freelistblock) < 0) {
 		panic("treedisk_alloc_block");
 	}
@@ -110,6 +119,7 @@ static block_no treedisk_alloc_block(block_if below, struct treedisk_snapshot *s
 	if (i == 0) {
 		free_blockno = b;
 		snapshot->superblock.superblock.free_list = freelistblock.freelistblock.refs[0];
+		block_hint(below, 0, BLOCK_SUPER);
 		if ((*below->write)(below, 0, (block_t *) &snapshot->superblock) < 0) {
 			panic("treedisk_alloc_block: superblock");
 		}
@@ -117,6 +127,7 @@ static block_no treedisk_alloc_block(block_if below, struct treedisk_snapshot *s
 	else {
 		free_blockno = freelistblock.freelistblock.refs[i];
 		freelistblock.freelistblock.refs[i] = 0;
+		block_hint(below, b, BLOCK_FREELIST);
 		if ((*below->write)(below, b, (block_t *) &freelistblock) < 0) {
 			panic("treedisk_alloc_block: freelistblock");
 		}
@@ -138,6 +149,37 @@ static int treedisk_nblocks(block_if bi){
 	return snapshot.inode->nblocks;
 }
 
+/* Discard any pending range of freed blocks.
+ */
+static void treedisk_discard_flush(block_if below, struct treedisk_snapshot *snapshot){
+	if (snapshot->discard_count != 0) {
+		block_discard(below, snapshot->discard_start, snapshot->discard_count);
+		snapshot->discard_count = 0;
+	}
+}
+
+/* Block 'bno' is now on the free list and its contents are dead.  Add it to
+ * the pending range if adjacent, or else start a new range.  Blocks are
+ * allocated from the end of a free list block, so adjacent data blocks
+ * often have descending block numbers.
+ */
+static void treedisk_discard(block_if below, block_no bno, struct treedisk_snapshot *snapshot){
+	if (snapshot->discard_count != 0) {
+		if (bno == snapshot->discard_start + snapshot->discard_count) {
+			snapshot->discard_count++;
+			return;
+		}
+		if (bno + 1 == snapshot->discard_start) {
+			snapshot->discard_start--;
+			snapshot->discard_count++;
+			return;
+		}
+	}
+	treedisk_discard_flush(below, snapshot);
+	snapshot->discard_start = bno;
+	snapshot->discard_count = 1;
+}
+
 /* Set the size of the file 'bi' to 'nblocks'.
  */
 static void freeblock(block_if below, block_no bno, struct treedisk_snapshot *snapshot) {
@@ -146,15 +188,19 @@ static void freeblock(block_if below, block_no bno, struct treedisk_snapshot *sn
 	if(sb->free_list == 0) {
 		// printf("CASE 1\n");
 		struct treedisk_freelistblock new_flb;
+		block_hint(below, bno, BLOCK_FREELIST);
 		(below->read)(below, bno, (block_t *) &new_flb);
 		memset(&new_flb, 0, BLOCK_SIZE);		// fill it with 0
 
+		block_hint(below, bno, BLOCK_FREELIST);
 		(below->write)(below, bno, (block_t *) &new_flb);
 		sb->free_list = bno;
+		block_hint(below, 0, BLOCK_SUPER);
 		(below->write)(below, 0, (block_t *) sb);
 	} else {
 		// printf("CASE 2\n");
 		struct treedisk_freelistblock old_flb;
+		block_hint(below, sb->free_list, BLOCK_FREELIST);
 		(below->read)(below, sb->free_list, (block_t *) &old_flb);
 
 		int is_space_avail = 0;
@@ -162,8 +208,13 @@ static void freeblock(block_if below, block_no bno, struct treedisk_snapshot *sn
 		for(int i=0; i < REFS_PER_BLOCK; i++) {
 			if(old_flb.refs[i] == 0) {
 				old_flb.refs[i] = bno;
+				block_hint(below, sb->free_list, BLOCK_FREELIST);
 				(below->write)(below, sb->free_list, (block_t *) &old_flb);
 				is_space_avail = 1;
+
+				// The contents of the block are now dead, so let the
+				// layers below reclaim the space.
+				treedisk_discard(below, bno, snapshot);
 				break;
 			}
 		}
@@ -172,6 +223,7 @@ static void freeblock(block_if below, block_no bno, struct treedisk_snapshot *sn
 		if(is_space_avail == 0) {
 			// printf("CASE 3\n");
 			struct treedisk_freelistblock new_flb;
+			block_hint(below, bno, BLOCK_FREELIST);
 			(below->read)(below, bno, (block_t *) &new_flb);
 			new_flb.refs[0] = sb->free_list;
 
@@ -179,7 +231,9 @@ static void freeblock(block_if below, block_no bno, struct treedisk_snapshot *sn
 				new_flb.refs[i] = 0;
 			}
 			sb->free_list = bno;
+			block_hint(below, 0, BLOCK_SUPER);
 			(below->write)(below, 0, (block_t *) sb);
+			block_hint(below, bno, BLOCK_FREELIST);
 			(below->write)(below, bno, (block_t *) &new_flb);
 		}
 	}
@@ -189,13 +243,18 @@ static void traverse_helper(block_if below, block_no bno, unsigned int nlevels,
 	if(nlevels == 0) {
 		if(bno != 0) { freeblock(below, bno, snapshot); }
 	} else {
-		struct treedisk_indirblock ib;
-		(below->read)(below, bno, (block_t *) &ib);
+		// Pin the indirect block while walking its children, copying it
+		// into ib only if the store below cannot pin.
+		block_t ib;
+		block_hint(below, bno, BLOCK_INDIRECT);
+		const struct treedisk_indirblock *tib = (const struct treedisk_indirblock *) block_pin(below, bno, &ib);
+		if(tib == 0) { return; }
 		for(int i=0; i < REFS_PER_BLOCK; i++) {
-			if(ib.refs[i] != 0) {
-				traverse_helper(below, ib.refs[i], nlevels-1, snapshot);
+			if(tib->refs[i] != 0) {
+				traverse_helper(below, tib->refs[i], nlevels-1, snapshot);
 			}
 		}
+		block_unpin(below, (const block_t *) tib, &ib);
 		freeblock(below, bno, snapshot);
 	}
 }
@@ -205,6 +264,7 @@ static int treedisk_setsize(block_if bi, block_no nblocks){
 
 	struct treedisk_snapshot snapshot;
 	treedisk_get_snapshot(&snapshot, ts->below, ts->inode_no);
+	snapshot.discard_count = 0;
 
 	if (nblocks == snapshot.inode->nblocks) {
 		return nblocks;
@@ -235,12 +295,14 @@ static int treedisk_setsize(block_if bi, block_no nblocks){
 
 			// Walk down from the root
 			traverse_helper(ts->below, snapshot.inode->root, nlevels, &snapshot);
+			treedisk_discard_flush(ts->below, &snapshot);
 
 			// Update inode
 			snapshot.inode->root = 0;
 			snapshot.inode->nblocks = 0;
 
 			// Write inode block back
+			block_hint(ts->below, snapshot.inode_blockno, BLOCK_INODE);
 			(ts->below->write)(ts->below, snapshot.inode_blockno, (block_t *) &snapshot.inodeblock);
 		}
 		return 0;
@@ -278,36 +340,35 @@ static int treedisk_read(block_if bi, block_no offset, block_t *block){
 		}
 	}
 
-	/* Walk down from the root block.
+	/* Walk down from the root block.  The indirect blocks are only needed
+	 * to find the next block, so pin rather than copy them if the block
+	 * store below allows it.  Otherwise *block serves as scratch space.
 	 */
 	block_no b = snapshot.inode->root;
-	for (;;) {
-		/* If there's a hole, return the null block.
-		 */
-		if (b == 0) {
-			memset(block, 0, BLOCK_SIZE);
-			return 0;
-		}
-
-		/* Return the next level.  If the last level, we're done.
-		 */
-		int result = (*ts->below->read)(ts->below, b, block);
-		if (result < 0) {
-			return result;
-		}
-		if (nlevels == 0) {
-			return 0;
+	while (nlevels > 0 && b != 0) {
+		block_hint(ts->below, b, BLOCK_INDIRECT);
+		const block_t *indir = block_pin(ts->below, b, block);
+		if (indir == 0) {
+			return -1;
 		}
 
 		/* The block is an indirect block.  Figure out the index into this
 		 * block and get the block number.
 		 */
 		nlevels--;
-		struct treedisk_indirblock *tib = (struct treedisk_indirblock *) block;
+		const struct treedisk_indirblock *tib = (const struct treedisk_indirblock *) indir;
 		unsigned int index = log_shift_r(offset, nlevels * log_rpb) % REFS_PER_BLOCK;
 		b = tib->refs[index];
+		block_unpin(ts->below, indir, block);
 	}
-	return 0;
+
+	/* If there's a hole, return the null block.
+	 */
+	if (b == 0) {
+		memset(block, 0, BLOCK_SIZE);
+		return 0;
+	}
+	return (*ts->below->read)(ts->below, b, block);
 }
 
 /* Write *block at the given block number 'offset'.
@@ -364,6 +425,7 @@ static int treedisk_write(block_if bi, block_no offset, block_t *block){
 			tib.refs[0] = snapshot.inode->root;
 			snapshot.inode->root = indir;
 			dirty_inode = 1;
+			block_hint(ts->below, indir, BLOCK_INDIRECT);
 			if ((*ts->below->write)(ts->below, indir, (block_t *) &tib) < 0) {
 				panic("treedisk_write: indirect block");
 			}
@@ -375,6 +437,7 @@ static int treedisk_write(block_if bi, block_no offset, block_t *block){
 	/* If the inode block was updated, write it back now.
 	 */
 	if (dirty_inode) {
+		block_hint(ts->below, snapshot.inode_blockno, BLOCK_INODE);
 		if ((*ts->below->write)(ts->below, snapshot.inode_blockno, (block_t *) &snapshot.inodeblock) < 0) {
 			panic("treedisk_write: inode block");
 		}
@@ -387,12 +450,14 @@ static int treedisk_write(block_if bi, block_no offset, block_t *block){
 	block_no *parent_no = &snapshot.inode->root;
 	block_no parent_off = snapshot.inode_blockno;
 	block_t *parent_block = (block_t *) &snapshot.inodeblock;
+	enum block_class parent_class = BLOCK_INODE;
 	for (;;) {
 		/* Get or allocate the next block.
 		 */
 		struct treedisk_indirblock tib;
 		if ((b = *parent_no) == 0) {
 			b = *parent_no = treedisk_alloc_block(ts->below, &snapshot);
+			block_hint(ts->below, parent_off, parent_class);
 			if ((*ts->below->write)(ts->below, parent_off, parent_block) < 0) {
 				panic("treedisk_write: parent");
 			}
@@ -405,6 +470,7 @@ static int treedisk_write(block_if bi, block_no offset, block_t *block){
 			if (nlevels == 0) {
 				break;
 			}
+			block_hint(ts->below, b, BLOCK_INDIRECT);
 			if ((*ts->below->read)(ts->below, b, (block_t *) &tib) < 0) {
 				panic("treedisk_write");
 			}
@@ -416,6 +482,7 @@ static int treedisk_write(block_if bi, block_no offset, block_t *block){
 		unsigned int index = log_shift_r(offset, nlevels * log_rpb) % REFS_PER_BLOCK;
 		parent_no = &tib.refs[index];
 		parent_block = (block_t *) &tib;
+		parent_class = BLOCK_INDIRECT;
 		parent_off = b;
 	}
 	if ((*ts->below->write)(ts->below, b, block) < 0) {
@@ -424,6 +491,12 @@ static int treedisk_write(block_if bi, block_no offset, block_t *block){
 	return 0;
 }
 
+static int treedisk_flush(block_if bi){
+	struct treedisk_state *ts = bi->state;
+
+	return block_flush(ts->below);
+}
+
 static void treedisk_destroy(block_if bi){
 	free(bi->state);
 	free(bi);
@@ -462,6 +535,7 @@ block_if treedisk_init(block_if below, unsigned int inode_no){
 	bi->read = treedisk_read;
 	bi->write = treedisk_write;
 	bi->destroy = treedisk_destroy;
+	bi->flush = treedisk_flush;
 	return bi;
 }
 
@@ -487,6 +561,7 @@ block_no setup_freelist(block_if below, block_no next_free, block_no nblocks){
 		for (; i < REFS_PER_BLOCK; i++) {
 			freelist_data[i] = 0;
 		}
+		block_hint(below, freelist_block, BLOCK_FREELIST);
 		if ((*below->write)(below, freelist_block, (block_t *) freelist_data) < 0) {
 			panic("treedisk_setup_freelist");
 		}
@@ -516,6 +591,7 @@ int treedisk_create(block_if below, unsigned int n_inodes){
 	superblock.superblock.n_inodeblocks = n_inodeblocks;
 	superblock.superblock.free_list =
 				setup_freelist(below, n_inodeblocks + 1, nblocks);
+	block_hint(below, 0, BLOCK_SUPER);
 	if ((*below->write)(below, 0, (block_t *) &superblock) < 0) {
 		return -1;
 	}
@@ -524,6 +600,7 @@ int treedisk_create(block_if below, unsigned int n_inodes){
 	 */
 	int i;
 	for (i = 1; i <= n_inodeblocks; i++) {
+		block_hint(below, i, BLOCK_INODE);
 		if ((*below->write)(below, i, &null_block) < 0) {
 			return -1;
 		}
@@ -0,0 +1,612 @@
+/* This code implements a block store on top of the underlying POSIX
+ * file system, like disk.c, but performs all I/O through a Linux io_uring
+ * instance.  The io_uring system calls are invoked directly, so no
+ * library is needed:
+ *
+ *		block_if uringdisk_init(char *file_name, block_no nblocks)
+ *			Create a new block store, stored in the file by the given
+ *			name and with the given number of blocks.  If the kernel
+ *			does not support io_uring, this returns a disk_init() block
+ *			store instead.
+ *
+ * The file is registered with the kernel as a fixed file, and a pool of
+ * single-block buffers is registered as fixed buffers.  Single-block
+ * reads and writes use these buffers.  Range reads and writes are split
+ * into chunks that are submitted together with a single system call.
+ * Asynchronous requests are batched the same way, so the kernel sees a
+ * whole batch of submitted requests at once.
+ *
+ * All operations on a block store are serialized by a lock, but requests
+ * submitted through the ring proceed concurrently in the kernel.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#undef BLOCK_SIZE				// defined by <linux/fs.h>
+#include "block_if.h"
+
+#define URING_ENTRIES		64		// #entries in the submission queue
+#define URING_NBUFS			64		// #registered single-block buffers
+#define URING_CHUNK			64		// max #blocks per range operation
+
+/* An operation in flight in the ring.
+ */
+struct uringdisk_op {
+	struct block_req *req;		// asynchronous request, or null
+	int write;					// write rather than read
+	struct iovec iov;			// data left to transfer
+	off_t pos;					// file offset of iov
+	int buf;					// registered buffer in use, or -1
+	block_t *block;				// caller's block if buf >= 0
+	int done;					// set upon completion (synchronous only)
+	int result;					// 0 or -1 upon completion
+};
+
+struct uringdisk_state {
+	block_no nblocks;			// #blocks in the block store
+	int fd;						// POSIX file descriptor of underlying file
+	int ring_fd;				// file descriptor of the io_uring
+	int fixed_file;				// fd is registered as fixed file 0
+	pthread_mutex_t lock;		// protects everything
+
+	/* Submission queue.
+	 */
+	void *sq_ring;
+	size_t sq_ring_size;
+	unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+	unsigned int sq_entries;
+	unsigned int queued;		// #entries filled but not yet submitted
+	unsigned int inflight;		// #entries submitted and not completed
+
+	/* Completion queue.
+	 */
+	void *cq_ring;
+	size_t cq_ring_size;
+	unsigned int *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	/* Registered buffers.
+	 */
+	block_t *bufs;				// URING_NBUFS blocks, or null
+	int free_bufs[URING_NBUFS];	// indices of unused buffers
+	unsigned int nfree;			// #unused buffers
+
+	/* Asynchronous requests.
+	 */
+	struct block_req *completed;	// completed but not yet reaped
+	unsigned int busy;				// #submitted but not yet completed
+};
+
+static int uring_setup(unsigned int entries, struct io_uring_params *p){
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(int ring_fd, unsigned int to_submit,
+							unsigned int min_complete, unsigned int flags){
+	return syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, 0, 0);
+}
+
+static int uring_register(int ring_fd, unsigned int opcode, void *arg, unsigned int nr_args){
+	return syscall(__NR_io_uring_register, ring_fd, opcode, arg, nr_args);
+}
+
+static void uringdisk_queue_op(struct uringdisk_state *us, struct uringdisk_op *op);
+
+/* Finish an operation whose completion entry has arrived.  Like disk.c,
+ * a partial transfer is continued by resubmitting the remainder, and only
+ * a read that returns nothing, which means it is at or beyond the end of
+ * the file, reads as null bytes.  The completion entry that was just
+ * consumed leaves room in the submission queue for the remainder.
+ */
+static void uringdisk_complete(struct uringdisk_state *us, struct uringdisk_op *op, int res){
+	if (res == -EINTR || res == -EAGAIN) {
+		uringdisk_queue_op(us, op);
+		return;
+	}
+	if (res > 0 && res < op->iov.iov_len) {
+		op->iov.iov_base = (char *) op->iov.iov_base + res;
+		op->iov.iov_len -= res;
+		op->pos += res;
+		uringdisk_queue_op(us, op);
+		return;
+	}
+
+	op->result = 0;
+	if (res < 0) {
+		fprintf(stderr, "%s: %s\n", op->write ? "uringdisk_write" : "uringdisk_read", strerror(-res));
+		op->result = -1;
+	}
+	else if (res == 0 && op->iov.iov_len != 0) {
+		if (op->write) {
+			fprintf(stderr, "uringdisk_write: no progress at offset %lld\n", (long long) op->pos);
+			op->result = -1;
+		}
+		else {
+			memset(op->iov.iov_base, 0, op->iov.iov_len);
+		}
+	}
+	if (op->buf >= 0) {
+		if (!op->write && op->result == 0) {
+			memcpy(op->block, &us->bufs[op->buf], BLOCK_SIZE);
+		}
+		us->free_bufs[us->nfree++] = op->buf;
+	}
+
+	if (op->req == 0) {
+		op->done = 1;
+	}
+	else {
+		op->req->result = op->result;
+		op->req->next = us->completed;
+		us->completed = op->req;
+		us->busy--;
+		free(op);
+	}
+}
+
+/* Process all available completion entries.  Remainders of partial
+ * transfers that this queues are sent to the kernel right away.
+ */
+static void uringdisk_drain(struct uringdisk_state *us){
+	unsigned int head = *us->cq_head;
+
+	while (head != __atomic_load_n(us->cq_tail, __ATOMIC_ACQUIRE)) {
+		struct io_uring_cqe *cqe = &us->cqes[head & *us->cq_mask];
+		struct uringdisk_op *op = (struct uringdisk_op *) (uintptr_t) cqe->user_data;
+		int res = cqe->res;
+		head++;
+		__atomic_store_n(us->cq_head, head, __ATOMIC_RELEASE);
+		us->inflight--;
+		uringdisk_complete(us, op, res);
+	}
+	if (us->queued != 0) {
+		int r = uring_enter(us->ring_fd, us->queued, 0, 0);
+		if (r > 0) {
+			us->inflight += r;
+			us->queued -= r;
+		}
+	}
+}
+
+/* Submit the queued entries to the kernel, and wait until at least
+ * 'wait' operations have completed.
+ */
+static int uringdisk_submit_queued(struct uringdisk_state *us, unsigned int wait){
+	for (;;) {
+		int r = uring_enter(us->ring_fd, us->queued, wait, wait ? IORING_ENTER_GETEVENTS : 0);
+		if (r >= 0) {
+			us->inflight += r;
+			us->queued -= r;
+			if (us->queued == 0) {
+				break;
+			}
+		}
+		else if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+			perror("uringdisk: io_uring_enter");
+			return -1;
+		}
+		else if (errno == EBUSY) {
+			/* Completion queue is full.  Make room.
+			 */
+			uringdisk_drain(us);
+		}
+	}
+	uringdisk_drain(us);
+	return 0;
+}
+
+/* Wait for one more operation to complete, submitting any queued entries
+ * first.
+ */
+static int uringdisk_wait(struct uringdisk_state *us){
+	int r = uring_enter(us->ring_fd, us->queued, 1, IORING_ENTER_GETEVENTS);
+	if (r >= 0) {
+		us->inflight += r;
+		us->queued -= r;
+	}
+	else if (errno != EINTR && errno != EBUSY) {
+		perror("uringdisk: io_uring_enter");
+		return -1;
+	}
+	uringdisk_drain(us);
+	return 0;
+}
+
+/* Fill in a submission entry for the given operation, at file offset
+ * op->pos.  It will be sent to the kernel by the next
+ * uringdisk_submit_queued().
+ */
+static void uringdisk_queue_op(struct uringdisk_state *us, struct uringdisk_op *op){
+	/* If the submission queue is full, submit what's there and wait
+	 * for something to complete.
+	 */
+	while (us->queued + us->inflight >= us->sq_entries) {
+		if (us->queued != 0) {
+			uringdisk_submit_queued(us, 0);
+		}
+		else {
+			uringdisk_wait(us);
+		}
+	}
+
+	unsigned int tail = *us->sq_tail;
+	unsigned int index = tail & *us->sq_mask;
+	struct io_uring_sqe *sqe = &us->sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	if (op->buf >= 0) {
+		sqe->opcode = op->write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+		sqe->addr = (uintptr_t) op->iov.iov_base;
+		sqe->len = op->iov.iov_len;
+		sqe->buf_index = op->buf;
+	}
+	else {
+		sqe->opcode = op->write ? IORING_OP_WRITEV : IORING_OP_READV;
+		sqe->addr = (uintptr_t) &op->iov;
+		sqe->len = 1;
+	}
+	if (us->fixed_file) {
+		sqe->fd = 0;
+		sqe->flags = IOSQE_FIXED_FILE;
+	}
+	else {
+		sqe->fd = us->fd;
+	}
+	sqe->off = op->pos;
+	sqe->user_data = (uintptr_t) op;
+	us->sq_array[index] = index;
+	__atomic_store_n(us->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	us->queued++;
+}
+
+static void uringdisk_queue(struct uringdisk_state *us, struct uringdisk_op *op, block_no offset){
+	op->pos = (off_t) offset * BLOCK_SIZE;
+	uringdisk_queue_op(us, op);
+}
+
+/* Set up an operation on a single block, using a registered buffer if
+ * one is available.
+ */
+static void uringdisk_prepare(struct uringdisk_state *us, struct uringdisk_op *op,
+								int write, block_t *block){
+	op->write = write;
+	op->block = block;
+	op->done = 0;
+	if (us->nfree > 0) {
+		op->buf = us->free_bufs[--us->nfree];
+		op->iov.iov_base = &us->bufs[op->buf];
+		if (write) {
+			memcpy(op->iov.iov_base, block, BLOCK_SIZE);
+		}
+	}
+	else {
+		op->buf = -1;
+		op->iov.iov_base = block;
+	}
+	op->iov.iov_len = BLOCK_SIZE;
+}
+
+static int uringdisk_nblocks(block_if bi){
+	struct uringdisk_state *us = bi->state;
+
+	return us->nblocks;
+}
+
+static int uringdisk_setsize(block_if bi, block_no nblocks){
+	struct uringdisk_state *us = bi->state;
+
+	pthread_mutex_lock(&us->lock);
+	int before = us->nblocks;
+	us->nblocks = nblocks;
+	ftruncate(us->fd, (off_t) nblocks * BLOCK_SIZE);
+	pthread_mutex_unlock(&us->lock);
+	return before;
+}
+
+static int uringdisk_check(struct uringdisk_state *us, block_no offset, block_no count){
+	if (count > us->nblocks || offset > us->nblocks - count) {
+		fprintf(stderr, "uringdisk: bad range %u %u %u\n", offset, count, us->nblocks);
+		return -1;
+	}
+	return 0;
+}
+
+/* Synchronous single-block I/O.
+ */
+static int uringdisk_io(block_if bi, int write, block_no offset, block_t *block){
+	struct uringdisk_state *us = bi->state;
+	struct uringdisk_op op;
+
+	pthread_mutex_lock(&us->lock);
+	if (uringdisk_check(us, offset, 1) < 0) {
+		pthread_mutex_unlock(&us->lock);
+		return -1;
+	}
+	op.req = 0;
+	uringdisk_prepare(us, &op, write, block);
+	uringdisk_queue(us, &op, offset);
+	if (uringdisk_submit_queued(us, 1) < 0) {
+		panic("uringdisk_io");
+	}
+	while (!op.done) {
+		uringdisk_wait(us);
+	}
+	pthread_mutex_unlock(&us->lock);
+	return op.result;
+}
+
+static int uringdisk_read(block_if bi, block_no offset, block_t *block){
+	return uringdisk_io(bi, 0, offset, block);
+}
+
+static int uringdisk_write(block_if bi, block_no offset, block_t *block){
+	return uringdisk_io(bi, 1, offset, block);
+}
+
+/* Synchronous range I/O.  The range is split into chunks that transfer
+ * directly from or to the caller's memory.  All chunks are submitted
+ * together.
+ */
+static int uringdisk_rangeio(block_if bi, int write, block_no offset, block_no count, block_t *blocks){
+	struct uringdisk_state *us = bi->state;
+	block_no nops = (count + URING_CHUNK - 1) / URING_CHUNK, i;
+	int result = 0;
+
+	pthread_mutex_lock(&us->lock);
+	if (uringdisk_check(us, offset, count) < 0) {
+		pthread_mutex_unlock(&us->lock);
+		return -1;
+	}
+	struct uringdisk_op *ops = calloc(nops, sizeof(*ops));
+	for (i = 0; i < nops; i++) {
+		block_no n = count - i * URING_CHUNK < URING_CHUNK ? count - i * URING_CHUNK : URING_CHUNK;
+		ops[i].write = write;
+		ops[i].buf = -1;
+		ops[i].iov.iov_base = &blocks[i * URING_CHUNK];
+		ops[i].iov.iov_len = (size_t) n * BLOCK_SIZE;
+		uringdisk_queue(us, &ops[i], offset + i * URING_CHUNK);
+	}
+	if (uringdisk_submit_queued(us, 0) < 0) {
+		panic("uringdisk_rangeio");
+	}
+	for (i = 0; i < nops; i++) {
+		while (!ops[i].done) {
+			uringdisk_wait(us);
+		}
+		if (ops[i].result < 0) {
+			result = -1;
+		}
+	}
+	free(ops);
+	pthread_mutex_unlock(&us->lock);
+	return result;
+}
+
+static int uringdisk_readv(block_if bi, block_no offset, block_no count, block_t *blocks){
+	return uringdisk_rangeio(bi, 0, offset, count, blocks);
+}
+
+static int uringdisk_writev(block_if bi, block_no offset, block_no count, block_t *blocks){
+	return uringdisk_rangeio(bi, 1, offset, count, blocks);
+}
+
+/* Queue all requests and then submit them to the kernel at once.
+ */
+static int uringdisk_submit(block_if bi, struct block_req *reqs, unsigned int nreqs){
+	struct uringdisk_state *us = bi->state;
+	unsigned int i;
+
+	pthread_mutex_lock(&us->lock);
+	for (i = 0; i < nreqs; i++) {
+		struct block_req *req = &reqs[i];
+		if (uringdisk_check(us, req->offset, 1) < 0) {
+			req->result = -1;
+			req->next = us->completed;
+			us->completed = req;
+			continue;
+		}
+		struct uringdisk_op *op = calloc(1, sizeof(*op));
+		op->req = req;
+		uringdisk_prepare(us, op, req->op == BLOCK_WRITE, req->block);
+		us->busy++;
+		uringdisk_queue(us, op, req->offset);
+	}
+	int r = uringdisk_submit_queued(us, 0);
+	pthread_mutex_unlock(&us->lock);
+	return r;
+}
+
+static int uringdisk_reap(block_if bi, struct block_req **done, unsigned int max, unsigned int min){
+	struct uringdisk_state *us = bi->state;
+	unsigned int n = 0;
+
+	pthread_mutex_lock(&us->lock);
+	uringdisk_drain(us);
+	for (;;) {
+		while (n < max && us->completed != 0) {
+			done[n++] = us->completed;
+			us->completed = us->completed->next;
+		}
+		if (n >= min || n == max || us->busy == 0) {
+			break;
+		}
+		uringdisk_wait(us);
+	}
+	pthread_mutex_unlock(&us->lock);
+	return n;
+}
+
+static int uringdisk_discard(block_if bi, block_no offset, block_no count){
+	struct uringdisk_state *us = bi->state;
+
+	if (uringdisk_check(us, offset, count) < 0) {
+		return -1;
+	}
+	if (fallocate(us->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			(off_t) offset * BLOCK_SIZE, (off_t) count * BLOCK_SIZE) < 0 &&
+			errno != EOPNOTSUPP && errno != ENOSYS) {
+		perror("uringdisk_discard");
+		return -1;
+	}
+	return 0;
+}
+
+static int uringdisk_flush(block_if bi){
+	struct uringdisk_state *us = bi->state;
+
+	if (fdatasync(us->fd) < 0) {
+		perror("uringdisk_flush");
+		return -1;
+	}
+	return 0;
+}
+
+static void uringdisk_destroy(block_if bi){
+	struct uringdisk_state *us = bi->state;
+
+	/* Wait for outstanding requests.
+	 */
+	pthread_mutex_lock(&us->lock);
+	if (us->queued != 0) {
+		uringdisk_submit_queued(us, 0);
+	}
+	while (us->inflight != 0) {
+		uringdisk_wait(us);
+	}
+	pthread_mutex_unlock(&us->lock);
+
+	close(us->ring_fd);
+	munmap(us->sqes, us->sqes_size);
+	if (us->cq_ring != us->sq_ring) {
+		munmap(us->cq_ring, us->cq_ring_size);
+	}
+	munmap(us->sq_ring, us->sq_ring_size);
+	free(us->bufs);
+	close(us->fd);
+	pthread_mutex_destroy(&us->lock);
+	free(us);
+	free(bi);
+}
+
+/* Map the rings that the kernel set up.
+ */
+static int uringdisk_map(struct uringdisk_state *us, struct io_uring_params *p){
+	us->sq_ring_size = p->sq_off.array + p->sq_entries * sizeof(unsigned int);
+	us->cq_ring_size = p->cq_off.cqes + p->cq_entries * sizeof(struct io_uring_cqe);
+	if (p->features & IORING_FEAT_SINGLE_MMAP) {
+		if (us->cq_ring_size > us->sq_ring_size) {
+			us->sq_ring_size = us->cq_ring_size;
+		}
+		us->cq_ring_size = us->sq_ring_size;
+	}
+
+	us->sq_ring = mmap(0, us->sq_ring_size, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, us->ring_fd, IORING_OFF_SQ_RING);
+	if (us->sq_ring == MAP_FAILED) {
+		return -1;
+	}
+	if (p->features & IORING_FEAT_SINGLE_MMAP) {
+		us->cq_ring = us->sq_ring;
+	}
+	else {
+		us->cq_ring = mmap(0, us->cq_ring_size, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, us->ring_fd, IORING_OFF_CQ_RING);
+		if (us->cq_ring == MAP_FAILED) {
+			return -1;
+		}
+	}
+	us->sqes_size = p->sq_entries * sizeof(struct io_uring_sqe);
+	us->sqes = mmap(0, us->sqes_size, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, us->ring_fd, IORING_OFF_SQES);
+	if (us->sqes == MAP_FAILED) {
+		return -1;
+	}
+
+	char *sq = us->sq_ring, *cq = us->cq_ring;
+	us->sq_head = (unsigned int *) (sq + p->sq_off.head);
+	us->sq_tail = (unsigned int *) (sq + p->sq_off.tail);
+	us->sq_mask = (unsigned int *) (sq + p->sq_off.ring_mask);
+	us->sq_array = (unsigned int *) (sq + p->sq_off.array);
+	us->cq_head = (unsigned int *) (cq + p->cq_off.head);
+	us->cq_tail = (unsigned int *) (cq + p->cq_off.tail);
+	us->cq_mask = (unsigned int *) (cq + p->cq_off.ring_mask);
+	us->cqes = (struct io_uring_cqe *) (cq + p->cq_off.cqes);
+	us->sq_entries = p->sq_entries;
+	return 0;
+}
+
+block_if uringdisk_init(char *file_name, block_no nblocks){
+	struct uringdisk_state *us = calloc(1, sizeof(*us));
+	struct io_uring_params params;
+
+	/* Fall back to the pread/pwrite block store if the kernel does not
+	 * support io_uring or does not allow us to use it.
+	 */
+	memset(&params, 0, sizeof(params));
+	us->ring_fd = uring_setup(URING_ENTRIES, &params);
+	if (us->ring_fd < 0) {
+		fprintf(stderr, "uringdisk_init: io_uring not available (%s), using disk_init\n", strerror(errno));
+		free(us);
+		return disk_init(file_name, nblocks);
+	}
+	if (uringdisk_map(us, &params) < 0) {
+		perror("uringdisk_init");
+		panic("uringdisk_init: can't map rings");
+	}
+
+	us->fd = open(file_name, O_RDWR | O_CREAT, 0600);
+	if (us->fd < 0) {
+		perror(file_name);
+		panic("uringdisk_init");
+	}
+	us->nblocks = nblocks;
+	pthread_mutex_init(&us->lock, 0);
+
+	/* Register the file and the buffers.  Both are optimizations, so it
+	 * is not a problem if the kernel refuses.
+	 */
+	us->fixed_file = uring_register(us->ring_fd, IORING_REGISTER_FILES, &us->fd, 1) == 0;
+	void *bufs;
+	if (posix_memalign(&bufs, 4096, URING_NBUFS * BLOCK_SIZE) == 0) {
+		struct iovec iovs[URING_NBUFS];
+		int i;
+		us->bufs = bufs;
+		for (i = 0; i < URING_NBUFS; i++) {
+			iovs[i].iov_base = &us->bufs[i];
+			iovs[i].iov_len = BLOCK_SIZE;
+		}
+		if (uring_register(us->ring_fd, IORING_REGISTER_BUFFERS, iovs, URING_NBUFS) == 0) {
+			for (i = 0; i < URING_NBUFS; i++) {
+				us->free_bufs[i] = i;
+			}
+			us->nfree = URING_NBUFS;
+		}
+	}
+
+	block_if bi = calloc(1, sizeof(*bi));
+	bi->state = us;
+	bi->nblocks = uringdisk_nblocks;
+	bi->setsize = uringdisk_setsize;
+	bi->read = uringdisk_read;
+	bi->write = uringdisk_write;
+	bi->destroy = uringdisk_destroy;
+	bi->readv = uringdisk_readv;
+	bi->writev = uringdisk_writev;
+	bi->submit = uringdisk_submit;
+	bi->reap = uringdisk_reap;
+	bi->discard = uringdisk_discard;
+	bi->flush = uringdisk_flush;
+	return bi;
+}